@@ -0,0 +1,437 @@
+/******************************************************************************
+ * Microbenchmarks del servidor de chat
+ * ---------------------------------------------------------------------------
+ * Incluye server.c tal cual y mide sus estructuras internas sin red: no hay
+ * sockets ni contexto de libwebsockets, así que los números no dependen del
+ * kernel ni de la carga de la máquina más allá de la CPU.
+ *
+ *   registry   búsqueda de clientes por nombre y por wsi con 10 a 100k
+ *              registrados, contra el recorrido de la lista enlazada que
+ *              usaba el servidor antes del registro con tablas hash
+ *   broadcast  reparto de un broadcast a 1k y 10k destinatarios: un frame
+ *              compartido por referencia contra una copia del payload por
+ *              destinatario (como hacía send_ws_text)
+ *   parse      decodificación de mensajes entrantes: chat_decode en el
+ *              buffer recibido contra strndup + cJSON_Parse + cadena de
+ *              strcmp, y contra el camino de respaldo con cJSON
+ *
+ * Compilar:
+ *   gcc chat_bench.c -o chat_bench -O2 -lwebsockets -lcjson -lpthread
+ *
+ * Ejecutar:
+ *   ./chat_bench registry
+ *   ./chat_bench broadcast
+ *   ./chat_bench parse
+ ******************************************************************************/
+
+ // Sin conexiones reales: lo que server.c le pide a lws sobre un wsi se
+ // reemplaza por funciones de acá que solo cuentan
+ #define lws_write bench_write
+ #define lws_callback_on_writable bench_on_writable
+ #define lws_send_pipe_choked bench_pipe_choked
+ #define main server_main
+ #include "../chat_server/server.c"
+ #undef main
+ #undef lws_write
+ #undef lws_callback_on_writable
+ #undef lws_send_pipe_choked
+
+ #define BENCH_MIN_NS 200000000ull   // cada medición corre al menos 0,2 s
+ #define ORDER_LEN 65536             // búsquedas al azar precalculadas
+
+ static volatile uintptr_t sink;     // evita que el compilador borre el trabajo
+
+ static uint64_t now_ns(void) {
+     struct timespec ts;
+     clock_gettime(CLOCK_MONOTONIC, &ts);
+     return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+ }
+
+ typedef void (*BenchFn)(void *arg, size_t reps);
+
+ // Repite fn con cada vez más repeticiones hasta que una tanda dure
+ // BENCH_MIN_NS; devuelve nanosegundos por repetición
+ static double ns_per_op(BenchFn fn, void *arg) {
+     size_t reps = 1;
+     for (;;) {
+         uint64_t t0 = now_ns();
+         fn(arg, reps);
+         uint64_t dt = now_ns() - t0;
+         if (dt >= BENCH_MIN_NS) return (double)dt / (double)reps;
+         reps = dt < BENCH_MIN_NS / 16 ? reps * 16 : reps * 2;
+     }
+ }
+
+ static uint64_t written;           // bytes que "salieron" por bench_write
+
+ int bench_write(struct lws *wsi, unsigned char *buf, size_t len, enum lws_write_protocol protocol) {
+     (void)wsi;
+     (void)protocol;
+     sink += buf[len - 1];
+     written += len;
+     return (int)len;
+ }
+
+ int bench_on_writable(struct lws *wsi) {
+     (void)wsi;
+     return 0;
+ }
+
+ int bench_pipe_choked(struct lws *wsi) {
+     (void)wsi;
+     return 0;
+ }
+
+ static uint32_t xorshift(uint32_t *s) {
+     uint32_t x = *s;
+     x ^= x << 13;
+     x ^= x >> 17;
+     x ^= x << 5;
+     return *s = x;
+ }
+
+ // ----------------- registry -----------------
+
+ // El cliente y la búsqueda de antes del registro: una lista enlazada con
+ // los más nuevos adelante, recorrida con strcmp (por nombre) o comparando
+ // wsi (al desconectar)
+ typedef struct OldClient {
+     struct lws *wsi;
+     char name[50];
+     char ip[INET_ADDRSTRLEN];
+     char status[MAX_STATUS_LEN];
+     time_t last_activity;
+     struct OldClient *next;
+ } OldClient;
+
+ typedef struct {
+     size_t n;
+     Client **clients;      // en orden de alta
+     OldClient *old;        // la misma gente en la lista de antes
+     uint32_t order[ORDER_LEN];
+ } RegBench;
+
+ static OldClient *old_find_name(OldClient *head, const char *name) {
+     for (OldClient *c = head; c; c = c->next)
+         if (strcmp(c->name, name) == 0) return c;
+     return NULL;
+ }
+
+ static OldClient *old_find_wsi(OldClient *head, const struct lws *wsi) {
+     for (OldClient *c = head; c; c = c->next)
+         if (c->wsi == wsi) return c;
+     return NULL;
+ }
+
+ static void bench_old_name(void *arg, size_t reps) {
+     RegBench *b = arg;
+     for (size_t i = 0; i < reps; i++)
+         sink += (uintptr_t)old_find_name(b->old, b->clients[b->order[i % ORDER_LEN]]->name);
+ }
+
+ static void bench_old_wsi(void *arg, size_t reps) {
+     RegBench *b = arg;
+     for (size_t i = 0; i < reps; i++)
+         sink += (uintptr_t)old_find_wsi(b->old, b->clients[b->order[i % ORDER_LEN]]->wsi);
+ }
+
+ // Lo que hace cada handler con un destinatario: client_lookup sin lock
+ static void bench_lookup(void *arg, size_t reps) {
+     RegBench *b = arg;
+     for (size_t i = 0; i < reps; i++) {
+         Client *c = client_lookup(b->clients[b->order[i % ORDER_LEN]]->name);
+         sink += (uintptr_t)c;
+         client_unref(c);
+     }
+ }
+
+ // Lo que hace remove_client al cerrarse una conexión
+ static void bench_find_wsi(void *arg, size_t reps) {
+     RegBench *b = arg;
+     for (size_t i = 0; i < reps; i++) {
+         clients_lock();
+         sink += (uintptr_t)registry_find_wsi(b->clients[b->order[i % ORDER_LEN]]->wsi);
+         pthread_mutex_unlock(&clients_mutex);
+     }
+ }
+
+ static int reg_add(RegBench *b) {
+     size_t i = b->n;
+     Client *c = calloc(1, sizeof(Client));
+     OldClient *o = calloc(1, sizeof(OldClient));
+     if (!c || !o) return -1;
+     // wsi falsos: direcciones distintas con la misma alineación que las reales
+     c->wsi = o->wsi = (struct lws *)(uintptr_t)(0x10000 + i * 256);
+     snprintf(c->name, sizeof(c->name), "usuario%06zu", i);
+     memcpy(o->name, c->name, sizeof(o->name));
+     c->refs = 1;
+     clients_lock();
+     int rc = registry_attach(c);
+     if (rc == 0 && (rc = registry_insert(c)) < 0) registry_remove(c);
+     pthread_mutex_unlock(&clients_mutex);
+     if (rc < 0) return -1;
+     b->clients[b->n++] = c;
+     o->next = b->old;
+     b->old = o;
+     return 0;
+ }
+
+ static int run_registry(void) {
+     static const size_t sizes[] = { 10, 100, 1000, 10000, 100000 };
+     size_t max = sizes[sizeof(sizes) / sizeof(sizes[0]) - 1];
+     RegBench *b = calloc(1, sizeof(RegBench));
+     if (!b || !(b->clients = calloc(max, sizeof(Client *)))) return 1;
+     // client_lookup toma el camino sin lock solo dentro de un shard
+     cfg.threads = 1;
+     shards = calloc(1, sizeof(Shard));
+     if (!shards) return 1;
+     cur_shard = &shards[0];
+
+     printf("ns por búsqueda (nombres y wsi al azar entre los registrados)\n");
+     printf("%9s %14s %14s %14s %14s\n", "clientes", "lista/nombre", "lista/wsi", "tabla/nombre",
+            "tabla/wsi");
+     for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+         while (b->n < sizes[s])
+             if (reg_add(b) < 0) return 1;
+         uint32_t seed = 2463534242u;
+         for (size_t i = 0; i < ORDER_LEN; i++) b->order[i] = xorshift(&seed) % b->n;
+         printf("%9zu %14.1f %14.1f %14.1f %14.1f\n", b->n, ns_per_op(bench_old_name, b),
+                ns_per_op(bench_old_wsi, b), ns_per_op(bench_lookup, b), ns_per_op(bench_find_wsi, b));
+         fflush(stdout);
+     }
+     return 0;
+ }
+
+ // ----------------- broadcast -----------------
+
+ // Un broadcast típico de "chat-protocol", ya serializado: la serialización
+ // es una sola por broadcast en los dos casos y no entra en la medición
+ static const char bcast_payload[] =
+     "{\"type\":\"broadcast\",\"sender\":\"usuario000042\","
+     "\"content\":\"Hola a todos, ¿alguien sabe a qué hora es la reunión de mañana?\","
+     "\"timestamp\":\"2026-10-16 10:00:00\"}";
+
+ // Cola de salida de antes de los frames compartidos: cada mensaje es una
+ // copia propia del payload, con su lock por cliente
+ typedef struct {
+     struct lws *wsi;
+     pthread_mutex_t out_lock;
+     struct {
+         unsigned char *buf;
+         size_t len;
+     } *items;
+     size_t head, count;
+ } CopyQueue;
+
+ typedef struct {
+     size_t n;
+     const char *payload;
+     size_t len;
+     CopyQueue *copyq;     // destinatarios con la cola de antes
+     Client **clients;     // los mismos, como miembros del shard
+ } BcastBench;
+
+ // Antes: bajo clients_mutex, malloc + memcpy del payload por destinatario;
+ // al vaciar la cola, un free por mensaje
+ static void bench_bcast_copy(void *arg, size_t reps) {
+     BcastBench *b = arg;
+     for (size_t r = 0; r < reps; r++) {
+         pthread_mutex_lock(&clients_mutex);
+         for (size_t i = 0; i < b->n; i++) {
+             CopyQueue *q = &b->copyq[i];
+             unsigned char *buf = malloc(LWS_PRE + b->len);
+             if (!buf) break;
+             memcpy(buf + LWS_PRE, b->payload, b->len);
+             pthread_mutex_lock(&q->out_lock);
+             size_t k = (q->head + q->count) % cfg.queue_max;
+             q->items[k].buf = buf;
+             q->items[k].len = b->len;
+             q->count++;
+             pthread_mutex_unlock(&q->out_lock);
+         }
+         pthread_mutex_unlock(&clients_mutex);
+         for (size_t i = 0; i < b->n; i++) {
+             CopyQueue *q = &b->copyq[i];
+             pthread_mutex_lock(&q->out_lock);
+             while (q->count) {
+                 unsigned char *buf = q->items[q->head].buf;
+                 size_t len = q->items[q->head].len;
+                 q->head = (q->head + 1) % cfg.queue_max;
+                 q->count--;
+                 pthread_mutex_unlock(&q->out_lock);
+                 bench_write(q->wsi, buf + LWS_PRE, len, LWS_WRITE_TEXT);
+                 free(buf);
+                 pthread_mutex_lock(&q->out_lock);
+             }
+             pthread_mutex_unlock(&q->out_lock);
+         }
+     }
+ }
+
+ // Ahora: un frame por broadcast, encolado por referencia a cada miembro
+ // del shard; después cada cola se vacía como en LWS_CALLBACK_SERVER_WRITEABLE
+ static void bench_bcast_frame(void *arg, size_t reps) {
+     BcastBench *b = arg;
+     for (size_t r = 0; r < reps; r++) {
+         Frame *fs[FMT_COUNT] = { NULL };
+         fs[FMT_JSON] = frame_new(b->payload, b->len);
+         if (!fs[FMT_JSON]) return;
+         shard_fanout(cur_shard, NULL, fs, NULL);
+         frame_unref(fs[FMT_JSON]);
+         for (size_t i = 0; i < b->n; i++) client_flush_queue(b->clients[i]);
+     }
+ }
+
+ static int run_broadcast(void) {
+     static const size_t sizes[] = { 1000, 10000 };
+     size_t max = sizes[sizeof(sizes) / sizeof(sizes[0]) - 1];
+     BcastBench *b = calloc(1, sizeof(BcastBench));
+     if (!b || !(b->clients = calloc(max, sizeof(Client *))) ||
+         !(b->copyq = calloc(max, sizeof(CopyQueue))))
+         return 1;
+     pool_init();
+     cfg.threads = 1;
+     shards = calloc(1, sizeof(Shard));
+     if (!shards) return 1;
+     cur_shard = &shards[0];
+     // Un payload del tamaño típico y uno del máximo que acepta el servidor
+     char *big = malloc(BUFFER_SIZE);
+     if (!big) return 1;
+     int head = snprintf(big, BUFFER_SIZE, "{\"type\":\"broadcast\",\"sender\":\"usuario000042\",\"content\":\"");
+     memset(big + head, 'x', BUFFER_SIZE - head);
+     memcpy(big + BUFFER_SIZE - 2, "\"}", 2);
+     const char *payloads[] = { bcast_payload, big };
+     size_t lens[] = { sizeof(bcast_payload) - 1, BUFFER_SIZE };
+
+     printf("us por broadcast (reparto + vaciado de las colas, sin syscalls)\n");
+     printf("%7s %13s %12s %12s %16s %16s\n", "bytes", "destinatarios", "copia", "frame",
+            "copia entregas/s", "frame entregas/s");
+     for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+         while (b->n < sizes[s]) {
+             struct lws *wsi = (struct lws *)(uintptr_t)(0x10000 + b->n * 256);
+             Client *c = client_new(wsi);
+             if (!c || shard_add_member(cur_shard, c) < 0) return 1;
+             c->fmt = FMT_JSON;
+             CopyQueue *q = &b->copyq[b->n];
+             q->wsi = wsi;
+             pthread_mutex_init(&q->out_lock, NULL);
+             if (!(q->items = calloc(cfg.queue_max, sizeof(*q->items)))) return 1;
+             b->clients[b->n++] = c;
+         }
+         for (size_t p = 0; p < 2; p++) {
+             b->payload = payloads[p];
+             b->len = lens[p];
+             double copy = ns_per_op(bench_bcast_copy, b);
+             double frame = ns_per_op(bench_bcast_frame, b);
+             printf("%7zu %13zu %12.1f %12.1f %16.0f %16.0f\n", b->len, b->n, copy / 1e3, frame / 1e3,
+                    (double)b->n * 1e9 / copy, (double)b->n * 1e9 / frame);
+             fflush(stdout);
+         }
+     }
+     return 0;
+ }
+
+ // ----------------- parse -----------------
+
+ static const char *const parse_msgs[][2] = {
+     { "register", "{\"type\":\"register\",\"sender\":\"usuario000042\",\"content\":null,"
+                   "\"timestamp\":\"2026-10-16 10:00:00\"}" },
+     { "broadcast", "{\"type\":\"broadcast\",\"sender\":\"usuario000042\","
+                    "\"content\":\"Hola a todos, ¿alguien sabe a qué hora es la reunión de mañana?\","
+                    "\"timestamp\":\"2026-10-16 10:00:00\"}" },
+     { "private", "{\"type\":\"private\",\"sender\":\"usuario000042\",\"target\":\"usuario000007\","
+                  "\"content\":\"te mando el \\\"link\\\" ahora \\u00e9\\ud83d\\ude00\\n\","
+                  "\"timestamp\":\"2026-10-16 10:00:00\"}" },
+     { "list_users", "{\"type\":\"list_users\",\"sender\":\"usuario000042\",\"content\":null}" },
+     { "change_status", "{\"type\":\"change_status\",\"sender\":\"usuario000042\","
+                        "\"content\":\"OCUPADO\",\"timestamp\":\"2026-10-16 10:00:00\"}" },
+ };
+
+ #define PARSE_MSGS (sizeof(parse_msgs) / sizeof(parse_msgs[0]))
+
+ typedef struct {
+     const char *msg;
+     size_t len;
+     char buf[BUFFER_SIZE];   // copia de trabajo: chat_decode escribe en ella
+ } ParseBench;
+
+ // Antes: copia terminada en '\0', árbol de cJSON, búsquedas sin distinguir
+ // mayúsculas y el tipo por una cadena de strcmp
+ static int old_type_of(const char *type) {
+     static const char *const types[] = { "register", "broadcast", "private", "list_users",
+                                          "user_info", "change_status", "disconnect" };
+     for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++)
+         if (strcmp(type, types[i]) == 0) return (int)i;
+     return -1;
+ }
+
+ static void bench_parse_old(void *arg, size_t reps) {
+     ParseBench *b = arg;
+     for (size_t r = 0; r < reps; r++) {
+         char *msg = strndup(b->msg, b->len);
+         if (!msg) return;
+         cJSON *root = cJSON_Parse(msg);
+         free(msg);
+         if (!root) continue;
+         cJSON *type = cJSON_GetObjectItem(root, "type");
+         cJSON *sender = cJSON_GetObjectItem(root, "sender");
+         cJSON *content = cJSON_GetObjectItem(root, "content");
+         if (cJSON_IsString(type) && cJSON_IsString(sender))
+             sink += (uintptr_t)old_type_of(type->valuestring) + (uintptr_t)content;
+         cJSON_Delete(root);
+     }
+ }
+
+ // El respaldo de hoy para formas que chat_decode no acepta
+ static void bench_parse_cjson(void *arg, size_t reps) {
+     ParseBench *b = arg;
+     for (size_t r = 0; r < reps; r++) {
+         ChatMsg m;
+         cJSON *root;
+         if (chat_decode_cjson(b->msg, b->len, &m, &root) < 0) continue;
+         sink += (uintptr_t)m.type + (uintptr_t)m.field[FIELD_CONTENT];
+         cJSON_Delete(root);
+     }
+ }
+
+ // Ahora: en el buffer recibido. Cada vuelta copia el mensaje de nuevo
+ // porque chat_decode lo modifica; la copia entra en la medición.
+ static void bench_parse_fast(void *arg, size_t reps) {
+     ParseBench *b = arg;
+     for (size_t r = 0; r < reps; r++) {
+         ChatMsg m;
+         memcpy(b->buf, b->msg, b->len);
+         if (chat_decode(b->buf, b->len, &m) < 0) continue;
+         sink += (uintptr_t)m.type + (uintptr_t)m.field[FIELD_CONTENT];
+     }
+ }
+
+ static int run_parse(void) {
+     ParseBench *b = calloc(1, sizeof(ParseBench));
+     if (!b) return 1;
+     printf("ns por mensaje\n");
+     printf("%14s %6s %14s %14s %14s\n", "tipo", "bytes", "cJSON antes", "cJSON hoy", "chat_decode");
+     for (size_t i = 0; i < PARSE_MSGS; i++) {
+         b->msg = parse_msgs[i][1];
+         b->len = strlen(b->msg);
+         // Que el mensaje de verdad vaya por el camino rápido
+         ChatMsg m;
+         memcpy(b->buf, b->msg, b->len);
+         if (chat_decode(b->buf, b->len, &m) < 0) {
+             fprintf(stderr, "%s: chat_decode no lo acepta\n", parse_msgs[i][0]);
+             return 1;
+         }
+         printf("%14s %6zu %14.1f %14.1f %14.1f\n", parse_msgs[i][0], b->len, ns_per_op(bench_parse_old, b),
+                ns_per_op(bench_parse_cjson, b), ns_per_op(bench_parse_fast, b));
+         fflush(stdout);
+     }
+     return 0;
+ }
+
+ int main(int argc, char **argv) {
+     if (argc == 2 && strcmp(argv[1], "registry") == 0) return run_registry();
+     if (argc == 2 && strcmp(argv[1], "broadcast") == 0) return run_broadcast();
+     if (argc == 2 && strcmp(argv[1], "parse") == 0) return run_parse();
+     fprintf(stderr, "Uso: %s registry|broadcast|parse\n", argv[0]);
+     return 2;
+ }
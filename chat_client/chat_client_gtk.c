@@ -2,28 +2,94 @@
  * Cliente de Chat con Interfaz Gráfica
  * ---------------------------------------------------------------------------
  * Requerimientos en Ubuntu:
- *   sudo apt-get install libgtk-3-dev libwebsockets-dev libcjson-dev
+ *   sudo apt-get install libgtk-3-dev libwebsockets-dev libwebsockets-evlib-glib libcjson-dev
  *
  * Compilar:
  *   gcc chat_client_gtk.c -o chat_client_gtk \
  *       $(pkg-config --cflags --libs gtk+-3.0) \
- *       -lwebsockets -lcjson -lpthread
+ *       -lwebsockets -lcjson
+ *
+ * libwebsockets tiene que estar compilado con LWS_WITH_GLIB (en Debian y
+ * Ubuntu es el plugin libwebsockets-evlib-glib): el cliente lo atiende
+ * dentro del bucle de GTK.
  *
  * Ejecutar:
- *   ./chat_client_gtk
+ *   ./chat_client_gtk [--scrollback N]
 
  ******************************************************************************/
 
  #include <gtk/gtk.h>
  #include <libwebsockets.h>
- #include <pthread.h>
  #include <string.h>
  #include <time.h>
  #include <stdlib.h>
+ #include <stdint.h>
  #include <cjson/cJSON.h>
  
  // Tamaños de buffers
  #define WS_BUFFER 2048
+ #define MAX_MESSAGE_SIZE (64 * 1024)   // mensaje reensamblado (el límite del servidor)
+ #define SEND_QUEUE_MAX (512 * 1024)    // bytes en cola de salida antes de rechazar
+ #define PENDING_MAX (256 * 1024)       // texto por vista que fuerza insertar sin esperar el cuadro
+ #define SCROLLBACK_DEFAULT 5000        // líneas por pestaña
+ 
+ // Subprotocolos, en el orden de protocols[] (el índice es su id)
+ enum { FMT_JSON, FMT_BIN };
+
+ // Id reservado del servidor en "chat-protocol-bin": nunca se anuncia
+ #define SERVER_UID 1
+ 
+ // Tipos de mensaje; los valores son los bytes de tipo de
+ // "chat-protocol-bin" y tienen que coincidir con server.c.
+ typedef enum {
+     MSG_UNKNOWN,
+     MSG_REGISTER,
+     MSG_BROADCAST,
+     MSG_PRIVATE,
+     MSG_LIST_USERS,
+     MSG_USER_INFO,
+     MSG_CHANGE_STATUS,
+     MSG_DISCONNECT,
+     MSG_ERROR,
+     MSG_REGISTER_SUCCESS,
+     MSG_LIST_USERS_RESPONSE,
+     MSG_USER_INFO_RESPONSE,
+     MSG_STATUS_UPDATE,
+     MSG_USER_DISCONNECTED,
+     MSG_USER_ID,
+     MSG_HISTORY,
+     MSG_JOIN,
+     MSG_LEAVE,
+     MSG_CHANNEL_MESSAGE,
+     MSG_STATUS_BATCH,
+     MSG_USER_JOINED,
+     MSG_USER_LEFT,
+     MSG_TYPE_COUNT
+ } MsgType;
+ 
+ static const char *const msg_names[MSG_TYPE_COUNT] = {
+     [MSG_REGISTER]            = "register",
+     [MSG_BROADCAST]           = "broadcast",
+     [MSG_PRIVATE]             = "private",
+     [MSG_LIST_USERS]          = "list_users",
+     [MSG_USER_INFO]           = "user_info",
+     [MSG_CHANGE_STATUS]       = "change_status",
+     [MSG_DISCONNECT]          = "disconnect",
+     [MSG_ERROR]               = "error",
+     [MSG_REGISTER_SUCCESS]    = "register_success",
+     [MSG_LIST_USERS_RESPONSE] = "list_users_response",
+     [MSG_USER_INFO_RESPONSE]  = "user_info_response",
+     [MSG_STATUS_UPDATE]       = "status_update",
+     [MSG_USER_DISCONNECTED]   = "user_disconnected",
+     [MSG_USER_ID]             = "user_id",
+     [MSG_HISTORY]             = "history",
+     [MSG_JOIN]                = "join",
+     [MSG_LEAVE]               = "leave",
+     [MSG_CHANNEL_MESSAGE]     = "channel_message",
+     [MSG_STATUS_BATCH]        = "status_batch",
+     [MSG_USER_JOINED]         = "user_joined",
+     [MSG_USER_LEFT]           = "user_left",
+ };
  
  // Estados posibles (según el protocolo)
  #define STATUS_ACTIVE   "ACTIVO"
@@ -39,34 +105,47 @@
      GtkWidget *entry_port;        // Campo de texto para puerto
      GtkWidget *btn_connect;       // Botón Conectar
  
-     GtkWidget *textview_chat;     // Área de texto para mensajes
+     GtkWidget *notebook;          // Una pestaña por canal; la primera es "general"
+     GtkWidget *textview_chat;     // Área de texto de "general" (broadcasts y avisos)
+     GHashTable *channel_views;    // canal → GtkTextView de su pestaña 
      GtkWidget *entry_message;     // Campo de texto para escribir mensajes
      GtkWidget *btn_send;          // Botón Enviar
  
      GtkWidget *btn_list_users;    // Botón "Listar usuarios"
      GtkWidget *combo_status;      // ComboBoxText para cambiar estado
      GtkWidget *btn_change_status; // Botón para confirmar cambio de estado
+     GtkWidget *check_binary;      // Ofrecer "chat-protocol-bin" al conectar
+ 
+     // Las líneas nuevas se juntan y se insertan una vez por cuadro
+     GHashTable *pending;          // GtkTextView → GString con las líneas por insertar
+     guint flush_tick;             // tick callback de la ventana (0 = ninguno)
+     int scrollback;               // líneas que guarda cada pestaña (0 = sin límite)
  
-     // Variables de conexión
+     // Variables de conexión. lws corre en el bucle de GLib, así que los
+     // callbacks y la interfaz comparten el hilo de GTK.
+     GMainLoop *lws_loop;          // bucle "prestado" a lws (contexto por defecto)
      struct lws_context *context;
      struct lws *wsi;
      char username[128];
      char server_ip[128];
      int  server_port;
+     int  binary;                  // el servidor aceptó "chat-protocol-bin"
+     GHashTable *user_names;       // id → nombre (solo binario)
+     GByteArray *rx;               // reensamblado de mensajes fragmentados
  
-     // Sincronización y estado
-     pthread_mutex_t lock_send_buffer;
-     char send_buffer[WS_BUFFER];
-     int  send_pending;
-     volatile int connected;
-     volatile int force_exit;
- } AppData;
+     // Copia local del directorio de usuarios, armada con las páginas de
+     // list_users y los deltas user_joined/user_left
+     GHashTable *directory;        // nombre → NULL
+     uint64_t dir_version;          // versión de la copia (0 = ninguna)
+     uint32_t dir_expect;           // cursor de la próxima página pedida (0 = ninguna)
+     int dir_complete;             // ya se recibió la última página
+     int dir_show;                 // mostrar la lista al completarla
  
- // Estructura para pasar mensaje a la función idle (actualizar GUI)
- typedef struct {
-     AppData *app;
-     char *msg;
- } IdleMsgData;
+     // Cola de salida: GByteArray con LWS_PRE bytes libres adelante, en orden
+     GQueue *tx;
+     size_t tx_bytes;              // bytes de mensaje encolados
+     int  connected;
+ } AppData;
  
  // ----------------- Funciones de ayuda -----------------
  
@@ -77,157 +156,601 @@
      strftime(buf, len, "%Y-%m-%dT%H:%M:%S", tm_info);
  }
  
- // Agregar texto al TextView (se llama desde el hilo principal)
- static void append_chat_text(AppData *app, const char *msg) {
-     GtkTextBuffer *buffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(app->textview_chat));
-     GtkTextIter end;
+ // Insertar de una vez lo juntado para una vista y descartar las líneas
+ // viejas. El recorte es por bloques: se deja pasar un octavo del tope y
+ // se vuelve a él con un solo delete.
+ static void flush_chat_view(AppData *app, GtkWidget *view, GString *text) {
+     if (!text->len) return;
+     GtkTextBuffer *buffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(view));
+     GtkTextIter start, end;
      gtk_text_buffer_get_end_iter(buffer, &end);
-     gtk_text_buffer_insert(buffer, &end, msg, -1);
-     gtk_text_buffer_insert(buffer, &end, "\n", 1);
+     gtk_text_buffer_insert(buffer, &end, text->str, text->len);
+     g_string_truncate(text, 0);
+ 
+     if (app->scrollback <= 0) return;
+     int lines = gtk_text_buffer_get_line_count(buffer) - 1;   // la última queda vacía
+     if (lines <= app->scrollback + app->scrollback / 8) return;
+     gtk_text_buffer_get_start_iter(buffer, &start);
+     gtk_text_buffer_get_iter_at_line(buffer, &end, lines - app->scrollback);
+     gtk_text_buffer_delete(buffer, &start, &end);
+ }
+ 
+ static gboolean flush_chat_tick(GtkWidget *widget, GdkFrameClock *clock, gpointer data) {
+     AppData *app = (AppData *)data;
+     GHashTableIter it;
+     gpointer view, text;
+     g_hash_table_iter_init(&it, app->pending);
+     while (g_hash_table_iter_next(&it, &view, &text)) flush_chat_view(app, view, text);
+     g_hash_table_remove_all(app->pending);
+     app->flush_tick = 0;
+     return G_SOURCE_REMOVE;
  }
  
- // Función idle que se programa con g_idle_add() para actualizar la GUI
- static gboolean update_chat_idle(gpointer data) {
-     IdleMsgData *idle_data = (IdleMsgData *)data;
-     append_chat_text(idle_data->app, idle_data->msg);
-     g_free(idle_data->msg);
-     g_free(idle_data);
-     return FALSE; // No se repite
+ static void pending_free(gpointer text) {
+     g_string_free(text, TRUE);
+ }
+ 
+ // Agregar una línea al TextView; aparece en el próximo cuadro
+ static void append_chat_text(AppData *app, GtkWidget *view, const char *msg) {
+     GString *text = g_hash_table_lookup(app->pending, view);
+     if (!text) {
+         text = g_string_new(NULL);
+         g_hash_table_insert(app->pending, view, text);
+     }
+     g_string_append(text, msg);
+     g_string_append_c(text, '\n');
+     if (!app->flush_tick)
+         app->flush_tick = gtk_widget_add_tick_callback(app->window_main, flush_chat_tick, app, NULL);
+     // Sin cuadros (ventana minimizada) no se deja crecer la espera
+     if (text->len > PENDING_MAX) flush_chat_view(app, view, text);
+ }
+
+ // Área de texto en un scroll, como la de "general"
+ static GtkWidget *new_chat_view(GtkWidget **scroll) {
+     GtkWidget *view = gtk_text_view_new();
+     gtk_text_view_set_editable(GTK_TEXT_VIEW(view), FALSE);
+     gtk_text_view_set_wrap_mode(GTK_TEXT_VIEW(view), GTK_WRAP_WORD_CHAR);
+     *scroll = gtk_scrolled_window_new(NULL, NULL);
+     gtk_container_add(GTK_CONTAINER(*scroll), view);
+     return view;
+ }
+
+ // Pestaña del canal; se crea la primera vez que llega algo de él.
+ // La página guarda el nombre del canal para saber a dónde enviar.
+ static GtkWidget *channel_view(AppData *app, const char *channel) {
+     GtkWidget *view = g_hash_table_lookup(app->channel_views, channel);
+     if (view) return view;
+     GtkWidget *scroll;
+     view = new_chat_view(&scroll);
+     g_object_set_data_full(G_OBJECT(scroll), "channel", g_strdup(channel), g_free);
+     char label[64];
+     snprintf(label, sizeof(label), "#%s", channel);
+     gtk_notebook_append_page(GTK_NOTEBOOK(app->notebook), scroll, gtk_label_new(label));
+     gtk_widget_show_all(scroll);
+     g_hash_table_insert(app->channel_views, g_strdup(channel), view);
+     return view;
+ }
+
+ static void channel_close(AppData *app, const char *channel) {
+     GtkWidget *view = g_hash_table_lookup(app->channel_views, channel);
+     if (!view) return;
+     g_hash_table_remove(app->pending, view);
+     GtkWidget *scroll = gtk_widget_get_parent(view);
+     gtk_notebook_remove_page(GTK_NOTEBOOK(app->notebook),
+                              gtk_notebook_page_num(GTK_NOTEBOOK(app->notebook), scroll));
+     g_hash_table_remove(app->channel_views, channel);
+ }
+
+ // Canal de la pestaña activa (NULL = "general")
+ static const char *current_channel(AppData *app) {
+     GtkNotebook *nb = GTK_NOTEBOOK(app->notebook);
+     GtkWidget *page = gtk_notebook_get_nth_page(nb, gtk_notebook_get_current_page(nb));
+     return page ? g_object_get_data(G_OBJECT(page), "channel") : NULL;
  }
  
- // Enviar un mensaje JSON al servidor (ya en formato string)
- static void send_json(AppData *app, const char *json_str) {
-     pthread_mutex_lock(&app->lock_send_buffer);
-     strncpy(app->send_buffer, json_str, sizeof(app->send_buffer) - 1);
-     app->send_pending = 1;
-     pthread_mutex_unlock(&app->lock_send_buffer);
+ static void show_message(AppData *app, const char *text);
+ 
+ // Encolar un mensaje ya codificado; sale cuando el socket acepte escribir.
+ // Devuelve -1 (y avisa) si es más largo de lo que acepta el servidor o si
+ // la cola está llena.
+ static int send_raw(AppData *app, const void *data, size_t len) {
+     if (len > MAX_MESSAGE_SIZE) {
+         show_message(app, "Mensaje demasiado largo; no se envió");
+         return -1;
+     }
+     if (app->tx_bytes + len > SEND_QUEUE_MAX) {
+         show_message(app, "Cola de envío llena; espera a que salgan los mensajes anteriores");
+         return -1;
+     }
+     GByteArray *frame = g_byte_array_sized_new(LWS_PRE + len);
+     g_byte_array_set_size(frame, LWS_PRE);
+     g_byte_array_append(frame, data, len);
+     g_queue_push_tail(app->tx, frame);
+     app->tx_bytes += len;
  
      if (app->wsi) {
          lws_callback_on_writable(app->wsi);
      }
+     return 0;
+ }
+ 
+ static void send_queue_clear(AppData *app) {
+     GByteArray *frame;
+     while ((frame = g_queue_pop_head(app->tx))) g_byte_array_unref(frame);
+     app->tx_bytes = 0;
  }
  
- // Construir y enviar un mensaje JSON a partir de cJSON
- static void send_cjson(AppData *app, cJSON *root) {
+ // --- Codificación binaria (ver el formato en server.c) ---
+ 
+ static void put_varint(GByteArray *out, uint64_t v) {
+     do {
+         guint8 b = v & 0x7F;
+         v >>= 7;
+         if (v) b |= 0x80;
+         g_byte_array_append(out, &b, 1);
+     } while (v);
+ }
+ 
+ // Usuario en línea (impar) o ausente (0)
+ static void put_user(GByteArray *out, const char *name) {
+     if (!name) {
+         put_varint(out, 0);
+         return;
+     }
+     size_t n = strlen(name);
+     put_varint(out, ((uint64_t)n << 1) | 1);
+     g_byte_array_append(out, (const guint8 *)name, n);
+ }
+ 
+ static void put_opt(GByteArray *out, const char *s) {
+     if (!s) {
+         put_varint(out, 0);
+         return;
+     }
+     size_t n = strlen(s);
+     put_varint(out, n + 1);
+     g_byte_array_append(out, (const guint8 *)s, n);
+ }
+ 
+ // Enviar un mensaje en el formato negociado con el servidor
+ static int send_chat(AppData *app, MsgType type, const char *target, const char *content) {
+     if (app->binary) {
+         GByteArray *body = g_byte_array_new();
+         guint8 t = (guint8)type;
+         g_byte_array_append(body, &t, 1);
+         uint64_t now = (uint64_t)time(NULL);
+         for (int i = 0; i < 8; i++) {
+             guint8 b = (guint8)(now >> (8 * i));
+             g_byte_array_append(body, &b, 1);
+         }
+         put_user(body, app->username);
+         put_user(body, target);
+         put_opt(body, content);
+ 
+         GByteArray *rec = g_byte_array_new();
+         put_varint(rec, body->len);
+         g_byte_array_append(rec, body->data, body->len);
+         int rc = send_raw(app, rec->data, rec->len);
+         g_byte_array_unref(rec);
+         g_byte_array_unref(body);
+         return rc;
+     }
+ 
+     cJSON *root = cJSON_CreateObject();
+     cJSON_AddStringToObject(root, "type", msg_names[type]);
+     cJSON_AddStringToObject(root, "sender", app->username);
+     if (target) cJSON_AddStringToObject(root, "target", target);
+     if (content) cJSON_AddStringToObject(root, "content", content);
+     else cJSON_AddItemToObject(root, "content", cJSON_CreateNull());
+     char timestamp[64];
+     get_timestamp(timestamp, sizeof(timestamp));
+     cJSON_AddStringToObject(root, "timestamp", timestamp);
      char *msg_str = cJSON_PrintUnformatted(root);
-     if (!msg_str) return;
-     send_json(app, msg_str);
-     free(msg_str);
+     int rc = -1;
+     if (msg_str) {
+         rc = send_raw(app, msg_str, strlen(msg_str));
+         free(msg_str);
+     }
+     cJSON_Delete(root);
+     return rc;
  }
  
- // Mostrar un mensaje en la GUI usando g_idle_add
+ // Mostrar un mensaje en la pestaña de un canal (NULL = "general"); con
+ // text NULL se cierra la pestaña
+ static void show_channel_message(AppData *app, const char *channel, const char *text) {
+     if (channel && !text) channel_close(app, channel);
+     else append_chat_text(app, channel ? channel_view(app, channel) : app->textview_chat, text);
+ }
+
+ // Mostrar un mensaje en la pestaña "general"
  static void show_message(AppData *app, const char *text) {
-     IdleMsgData *idle_data = g_new0(IdleMsgData, 1);
-     idle_data->app = app;
-     idle_data->msg = g_strdup(text);
-     g_idle_add(update_chat_idle, idle_data);
+     show_channel_message(app, NULL, text);
  }
  
  // ----------------- Parseo de mensajes recibidos -----------------
  
- // Manejar un mensaje JSON recibido del servidor
- static void handle_server_message(AppData *app, const char *json_str) {
-     cJSON *root = cJSON_Parse(json_str);
-     if (!root) {
-         show_message(app, " ");
-         return;
-     }
+ // Mensaje del servidor ya decodificado, sin importar el formato
+ typedef struct {
+     const char *type;
+     const char *sender, *target, *content;
+     const char *user, *status;       // status_update
+     const char *ip;                  // user_info_response
+     int has_info;                    // user_info_response trae ip/estado
+     const char **users;              // list_users_response / userList
+     size_t n_users;
+     int has_users;
+     const char **changes;            // status_batch: usuario, estado, usuario, ...
+     size_t n_changes;
+     int has_version;                 // list_users_response / user_joined / user_left
+     uint64_t version;
+     uint32_t cursor, next;            // list_users_response (next 0 = última página)
+ } ServerMsg;
  
-     cJSON *type_item   = cJSON_GetObjectItemCaseSensitive(root, "type");
-     cJSON *sender_item = cJSON_GetObjectItemCaseSensitive(root, "sender");
-     cJSON *content_item= cJSON_GetObjectItemCaseSensitive(root, "content");
-     if (!cJSON_IsString(type_item)) {
-         cJSON_Delete(root);
-         return;
+ // Todos los nombres en un solo mensaje (una sola actualización de la GUI)
+ static void show_user_list(AppData *app, const char *title, const char *const *users, size_t n) {
+     GString *text = g_string_new(title);
+     for (size_t i = 0; i < n; i++) g_string_append_printf(text, "\n%s", users[i]);
+     show_message(app, text->str);
+     g_string_free(text, TRUE);
+ }
+ 
+ static void show_directory(AppData *app) {
+     guint n = 0;
+     const char **users = (const char **)g_hash_table_get_keys_as_array(app->directory, &n);
+     char title[64];
+     snprintf(title, sizeof(title), "Usuarios conectados (%u):", n);
+     show_user_list(app, title, users, n);
+     g_free(users);
+ }
+ 
+ // Una página de list_users: la página 0 reinicia la copia (salvo que traiga
+ // la versión que ya tenemos: no cambió nada) y las siguientes se piden
+ // con el cursor
+ static void directory_page(AppData *app, const ServerMsg *m) {
+     uint64_t have = app->dir_version;
+     int same = m->cursor == 0 && have && m->version == have;
+     if (!same) {
+         if (m->cursor == 0) {
+             g_hash_table_remove_all(app->directory);
+             app->dir_complete = 0;
+         } else if (m->cursor != app->dir_expect) {
+             return;   // respuesta de una pasada anterior
+         }
+         for (size_t i = 0; i < m->n_users; i++) g_hash_table_add(app->directory, g_strdup(m->users[i]));
+         if (m->version > have) app->dir_version = m->version;
+         if (m->next) {
+             char query[32];
+             snprintf(query, sizeof(query), "cursor=%u", m->next);
+             app->dir_expect = m->next;
+             send_chat(app, MSG_LIST_USERS, NULL, query);
+             return;
+         }
+         app->dir_expect = 0;
+         app->dir_complete = 1;
      }
-     const char *type = type_item->valuestring;
+     if (app->dir_complete && app->dir_show) {
+         app->dir_show = 0;
+         show_directory(app);
+     }
+ }
+ 
+ // Mostrar en la GUI un mensaje recibido
+ static void show_server_message(AppData *app, const ServerMsg *m) {
+     const char *type = m->type;
+     char buff[256];
  
      if (strcmp(type, "register_success") == 0) {
-         cJSON *userList_item = cJSON_GetObjectItemCaseSensitive(root, "userList");
-         if (cJSON_IsArray(userList_item)) {
-             show_message(app, "Registro exitoso. Lista de usuarios:");
-             cJSON *user_elem = NULL;
-             cJSON_ArrayForEach(user_elem, userList_item) {
-                 if (cJSON_IsString(user_elem)) {
-                     show_message(app, user_elem->valuestring);
-                 }
-             }
-         } else {
-             if (cJSON_IsString(content_item))
-                 show_message(app, content_item->valuestring);
+         if (m->has_users) {
+             show_user_list(app, "Registro exitoso. Lista de usuarios:", m->users, m->n_users);
+         } else if (m->content) {
+             show_message(app, m->content);
          }
+         // Suscribirse a los cambios del directorio; la respuesta trae la
+         // primera página
+         send_chat(app, MSG_LIST_USERS, NULL, "subscribe=1");
      }
      else if (strcmp(type, "broadcast") == 0) {
-         if (cJSON_IsString(sender_item) && cJSON_IsString(content_item)) {
-             char buff[256];
-             snprintf(buff, sizeof(buff), "[%s (broadcast)]: %s",
-                      sender_item->valuestring, content_item->valuestring);
+         if (m->sender && m->content) {
+             snprintf(buff, sizeof(buff), "[%s (broadcast)]: %s", m->sender, m->content);
              show_message(app, buff);
          }
      }
      else if (strcmp(type, "private") == 0) {
-         if (cJSON_IsString(sender_item) && cJSON_IsString(content_item)) {
-             char buff[256];
-             snprintf(buff, sizeof(buff), "[%s (privado)]: %s",
-                      sender_item->valuestring, content_item->valuestring);
+         if (m->sender && m->content) {
+             snprintf(buff, sizeof(buff), "[%s (privado)]: %s", m->sender, m->content);
+             show_message(app, buff);
+         }
+     }
+     else if (strcmp(type, "channel_message") == 0) {
+         if (m->sender && m->target && m->content) {
+             snprintf(buff, sizeof(buff), "[%s]: %s", m->sender, m->content);
+             show_channel_message(app, m->target, buff);
+         }
+     }
+     else if (strcmp(type, "join") == 0) {
+         if (m->target) {
+             snprintf(buff, sizeof(buff), "Te uniste a #%s (%s)", m->target, m->content ? m->content : "");
+             show_channel_message(app, m->target, buff);
+         }
+     }
+     else if (strcmp(type, "leave") == 0) {
+         if (m->target) {
+             show_channel_message(app, m->target, NULL);
+             snprintf(buff, sizeof(buff), "Saliste de #%s", m->target);
              show_message(app, buff);
          }
      }
      else if (strcmp(type, "list_users_response") == 0) {
-         if (cJSON_IsArray(content_item)) {
-             show_message(app, "Usuarios conectados:");
-             cJSON *user_elem = NULL;
-             cJSON_ArrayForEach(user_elem, content_item) {
-                 if (cJSON_IsString(user_elem)) {
-                     show_message(app, user_elem->valuestring);
-                 }
-             }
+         if (m->has_version) directory_page(app, m);
+         else if (m->has_users) show_user_list(app, "Usuarios conectados:", m->users, m->n_users);
+     }
+     else if (strcmp(type, "user_joined") == 0 || strcmp(type, "user_left") == 0) {
+         const char *user = m->user ? m->user : m->content;
+         if (user) {
+             if (type[5] == 'j') g_hash_table_add(app->directory, g_strdup(user));
+             else g_hash_table_remove(app->directory, user);
          }
+         if (m->version > app->dir_version)
+             app->dir_version = m->version;
      }
      else if (strcmp(type, "status_update") == 0) {
-         if (cJSON_IsObject(content_item)) {
-             cJSON *user_it = cJSON_GetObjectItemCaseSensitive(content_item, "user");
-             cJSON *status_it = cJSON_GetObjectItemCaseSensitive(content_item, "status");
-             if (cJSON_IsString(user_it) && cJSON_IsString(status_it)) {
-                 char buff[256];
-                 snprintf(buff, sizeof(buff), "[server]: %s cambió su estado a %s",
-                          user_it->valuestring, status_it->valuestring);
-                 show_message(app, buff);
-             }
+         if (m->user && m->status) {
+             snprintf(buff, sizeof(buff), "[server]: %s cambió su estado a %s", m->user, m->status);
+             show_message(app, buff);
+         }
+     }
+     else if (strcmp(type, "status_batch") == 0) {
+         // Toda la tanda en una sola actualización de la GUI
+         if (m->n_changes) {
+             GString *text = g_string_new(NULL);
+             for (size_t i = 0; i < m->n_changes; i++)
+                 g_string_append_printf(text, "%s[server]: %s cambió su estado a %s", i ? "\n" : "",
+                                        m->changes[2 * i], m->changes[2 * i + 1]);
+             show_message(app, text->str);
+             g_string_free(text, TRUE);
          }
      }
      else if (strcmp(type, "error") == 0) {
-         if (cJSON_IsString(content_item)) {
-             char buff[256];
-             snprintf(buff, sizeof(buff), "[ERROR]: %s", content_item->valuestring);
+         if (m->content) {
+             snprintf(buff, sizeof(buff), "[ERROR]: %s", m->content);
              show_message(app, buff);
          }
      }
      else if (strcmp(type, "user_info_response") == 0) {
-         if (cJSON_IsObject(content_item)) {
-             cJSON *ip_item = cJSON_GetObjectItemCaseSensitive(content_item, "ip");
-             cJSON *st_item = cJSON_GetObjectItemCaseSensitive(content_item, "status");
-             if (cJSON_IsString(ip_item) && cJSON_IsString(st_item)) {
-                 char buff[256];
+         if (m->has_info) {
+             if (m->ip && m->status) {
                  snprintf(buff, sizeof(buff), "Info de %s: IP=%s, STATUS=%s",
-                          sender_item->valuestring, ip_item->valuestring, st_item->valuestring);
+                          m->sender, m->ip, m->status);
                  show_message(app, buff);
              }
-         } else if (cJSON_IsString(content_item)) {
-             show_message(app, content_item->valuestring);
+         } else if (m->content) {
+             show_message(app, m->content);
          }
      }
      else {
-         if (cJSON_IsString(content_item)) {
-             char buff[256];
-             snprintf(buff, sizeof(buff), "[%s]: %s", type, content_item->valuestring);
+         if (m->content) {
+             snprintf(buff, sizeof(buff), "[%s]: %s", type, m->content);
              show_message(app, buff);
          }
      }
+ }
+ 
+ static const char *json_string(const cJSON *obj, const char *key) {
+     cJSON *item = cJSON_GetObjectItemCaseSensitive(obj, key);
+     return cJSON_IsString(item) ? item->valuestring : NULL;
+ }
+ 
+ // Llena users con los strings de un arreglo JSON; hay que liberarlo
+ static void json_changes(const cJSON *array, ServerMsg *m) {
+     m->changes = g_new0(const char *, 2 * cJSON_GetArraySize(array) + 1);
+     cJSON *elem = NULL;
+     cJSON_ArrayForEach(elem, array) {
+         const char *user = json_string(elem, "user");
+         const char *status = json_string(elem, "status");
+         if (!user || !status) continue;
+         m->changes[2 * m->n_changes] = user;
+         m->changes[2 * m->n_changes + 1] = status;
+         m->n_changes++;
+     }
+ }
+
+ static void json_users(const cJSON *array, ServerMsg *m) {
+     m->has_users = 1;
+     m->users = g_new0(const char *, cJSON_GetArraySize(array) + 1);
+     cJSON *elem = NULL;
+     cJSON_ArrayForEach(elem, array) {
+         if (cJSON_IsString(elem)) m->users[m->n_users++] = elem->valuestring;
+     }
+ }
+ 
+ // Manejar un mensaje JSON recibido del servidor
+ static void handle_server_message(AppData *app, const char *json_str, size_t len) {
+     cJSON *root = cJSON_ParseWithLength(json_str, len);
+     if (!root) {
+         show_message(app, " ");
+         return;
+     }
  
+     ServerMsg m = { 0 };
+     m.type = json_string(root, "type");
+     if (!m.type) {
+         cJSON_Delete(root);
+         return;
+     }
+     m.sender = json_string(root, "sender");
+     m.target = json_string(root, "target");
+     m.content = json_string(root, "content");
+ 
+     cJSON *content_item = cJSON_GetObjectItemCaseSensitive(root, "content");
+     cJSON *version = cJSON_GetObjectItemCaseSensitive(root, "version");
+     if (cJSON_IsNumber(version)) {
+         m.has_version = 1;
+         m.version = (uint64_t)version->valuedouble;
+         cJSON *cursor = cJSON_GetObjectItemCaseSensitive(root, "cursor");
+         cJSON *next = cJSON_GetObjectItemCaseSensitive(root, "next");
+         if (cJSON_IsNumber(cursor)) m.cursor = (uint32_t)cursor->valuedouble;
+         if (cJSON_IsNumber(next)) m.next = (uint32_t)next->valuedouble;
+     }
+     cJSON *user_list = cJSON_GetObjectItemCaseSensitive(root, "userList");
+     if (strcmp(m.type, "status_batch") == 0) {
+         if (cJSON_IsArray(content_item)) json_changes(content_item, &m);
+     }
+     else if (cJSON_IsArray(user_list)) json_users(user_list, &m);
+     else if (cJSON_IsArray(content_item)) json_users(content_item, &m);
+     if (cJSON_IsObject(content_item)) {
+         m.user = json_string(content_item, "user");
+         m.status = json_string(content_item, "status");
+         m.ip = json_string(content_item, "ip");
+         m.has_info = 1;
+     }
+ 
+     show_server_message(app, &m);
+     g_free(m.users);
+     g_free(m.changes);
      cJSON_Delete(root);
  }
  
+ // --- Registros de "chat-protocol-bin" ---
+ 
+ typedef struct {
+     const guint8 *p, *end;
+     GPtrArray *strings;   // strings reservados al decodificar
+ } BinReader;
+ 
+ static int get_varint(BinReader *r, uint64_t *v) {
+     *v = 0;
+     for (int shift = 0; shift < 64 && r->p < r->end; shift += 7) {
+         guint8 b = *r->p++;
+         *v |= (uint64_t)(b & 0x7F) << shift;
+         if (!(b & 0x80)) return 0;
+     }
+     return -1;
+ }
+ 
+ static int get_bytes(BinReader *r, size_t n, const char **dst) {
+     if (n > (size_t)(r->end - r->p)) return -1;
+     char *s = g_strndup((const char *)r->p, n);
+     g_ptr_array_add(r->strings, s);
+     r->p += n;
+     *dst = s;
+     return 0;
+ }
+ 
+ static int get_str(BinReader *r, const char **dst) {
+     uint64_t n;
+     if (get_varint(r, &n) < 0) return -1;
+     return get_bytes(r, (size_t)n, dst);
+ }
+ 
+ static int get_opt(BinReader *r, const char **dst) {
+     uint64_t v;
+     *dst = NULL;
+     if (get_varint(r, &v) < 0) return -1;
+     return v ? get_bytes(r, (size_t)(v - 1), dst) : 0;
+ }
+ 
+ // Los ids se traducen con los nombres que anunció el servidor
+ static int get_user(AppData *app, BinReader *r, const char **dst) {
+     uint64_t v;
+     *dst = NULL;
+     if (get_varint(r, &v) < 0) return -1;
+     if (v & 1) return get_bytes(r, (size_t)(v >> 1), dst);
+     if (v >> 1 == SERVER_UID) {
+         *dst = "server";
+     } else if (v) {
+         *dst = g_hash_table_lookup(app->user_names, GUINT_TO_POINTER((guint)(v >> 1)));
+         if (!*dst) *dst = "?";
+     }
+     return 0;
+ }
+ 
+ static void handle_bin_record(AppData *app, const guint8 *rec, size_t len) {
+     if (len < 9 || rec[0] == MSG_UNKNOWN || rec[0] >= MSG_TYPE_COUNT) return;
+     BinReader r = { rec + 9, rec + len, g_ptr_array_new_with_free_func(g_free) };
+     MsgType type = rec[0];
+     ServerMsg m = { .type = msg_names[type] };
+     int ok = get_user(app, &r, &m.sender) == 0 && get_user(app, &r, &m.target) == 0;
+ 
+     switch (type) {
+         case MSG_LIST_USERS_RESPONSE: {
+             uint64_t n;
+             if (!ok || get_varint(&r, &n) < 0 || n > len) { ok = 0; break; }
+             m.users = g_new0(const char *, n + 1);
+             m.has_users = 1;
+             for (uint64_t i = 0; ok && i < n; i++) {
+                 uint64_t id;
+                 const char *name;
+                 ok = get_varint(&r, &id) == 0 && get_str(&r, &name) == 0;
+                 if (!ok) break;
+                 g_hash_table_replace(app->user_names, GUINT_TO_POINTER((guint)id), g_strdup(name));
+                 m.users[m.n_users++] = name;
+             }
+             // Servidores con directorio agregan versión, cursor y siguiente
+             uint64_t version, cursor, next;
+             if (ok && r.p < r.end && get_varint(&r, &version) == 0 && get_varint(&r, &cursor) == 0 &&
+                 get_varint(&r, &next) == 0) {
+                 m.has_version = 1;
+                 m.version = version;
+                 m.cursor = (uint32_t)cursor;
+                 m.next = (uint32_t)next;
+             }
+             break;
+         }
+         case MSG_USER_JOINED:
+         case MSG_USER_LEFT: {
+             uint64_t version;
+             ok = ok && get_user(app, &r, &m.user) == 0 && get_varint(&r, &version) == 0;
+             m.has_version = 1;
+             m.version = ok ? version : 0;
+             break;
+         }
+         case MSG_USER_INFO_RESPONSE:
+             if (!ok || r.p == r.end) { ok = 0; break; }
+             m.has_info = *r.p++;
+             if (m.has_info) ok = get_str(&r, &m.ip) == 0 && get_str(&r, &m.status) == 0;
+             else ok = get_opt(&r, &m.content) == 0;
+             break;
+         case MSG_STATUS_UPDATE:
+             ok = ok && get_user(app, &r, &m.user) == 0 && get_str(&r, &m.status) == 0;
+             break;
+         case MSG_STATUS_BATCH: {
+             uint64_t n;
+             if (!ok || get_varint(&r, &n) < 0 || n > len) { ok = 0; break; }
+             m.changes = g_new0(const char *, 2 * n + 1);
+             for (; ok && m.n_changes < n; m.n_changes++)
+                 ok = get_user(app, &r, &m.changes[2 * m.n_changes]) == 0 &&
+                      get_str(&r, &m.changes[2 * m.n_changes + 1]) == 0;
+             break;
+         }
+         case MSG_USER_ID: {
+             uint64_t id;
+             const char *name;
+             if (ok && get_varint(&r, &id) == 0 && get_str(&r, &name) == 0)
+                 g_hash_table_replace(app->user_names, GUINT_TO_POINTER((guint)id), g_strdup(name));
+             ok = 0;   // no se muestra
+             break;
+         }
+         default:
+             ok = ok && get_opt(&r, &m.content) == 0;
+     }
+ 
+     if (ok) show_server_message(app, &m);
+     g_free(m.users);
+     g_free(m.changes);
+     g_ptr_array_unref(r.strings);
+ }
+ 
+ // Un frame binario trae uno o más registros con su largo adelante
+ static void handle_bin_message(AppData *app, const guint8 *data, size_t len) {
+     BinReader r = { data, data + len, NULL };
+     while (r.p < r.end) {
+         uint64_t rec_len;
+         if (get_varint(&r, &rec_len) < 0 || rec_len > (uint64_t)(r.end - r.p)) return;
+         handle_bin_record(app, r.p, (size_t)rec_len);
+         r.p += rec_len;
+     }
+ }
+ 
  // ----------------- Callbacks de WebSockets -----------------
  
  static int ws_callback(struct lws *wsi, enum lws_callback_reasons reason,
@@ -236,56 +759,70 @@
      AppData *app = (AppData *)lws_context_user(lws_get_context(wsi));
      switch (reason) {
          case LWS_CALLBACK_CLIENT_ESTABLISHED: {
-             show_message(app, "Conexión establecida con el servidor WebSocket");
+             // El servidor elige de la lista que le ofrecimos
+             app->binary = lws_get_protocol(wsi)->id == FMT_BIN;
+             show_message(app, app->binary ? "Conexión establecida con el servidor WebSocket (binario)"
+                                           : "Conexión establecida con el servidor WebSocket");
  
              // Enviar mensaje de registro
-             cJSON *root = cJSON_CreateObject();
-             cJSON_AddStringToObject(root, "type", "register");
-             cJSON_AddStringToObject(root, "sender", app->username);
-             cJSON_AddItemToObject(root, "content", cJSON_CreateNull());
- 
-             char timestamp[64];
-             get_timestamp(timestamp, sizeof(timestamp));
-             cJSON_AddStringToObject(root, "timestamp", timestamp);
- 
-             send_cjson(app, root);
-             cJSON_Delete(root);
+             send_chat(app, MSG_REGISTER, NULL, NULL);
  
              app->connected = 1;
              break;
          }
          case LWS_CALLBACK_CLIENT_RECEIVE: {
-             if (in && len > 0) {
-                 char *msg_in = g_strndup((const char *)in, len);
-                 handle_server_message(app, msg_in);
-                 g_free(msg_in);
+             if (!in || len == 0) break;
+             // Los mensajes fragmentados se juntan antes de decodificarlos
+             int complete = lws_is_final_fragment(wsi) && !lws_remaining_packet_payload(wsi);
+             const guint8 *data = in;
+             if (!complete || app->rx->len) {
+                 if (app->rx->len + len > MAX_MESSAGE_SIZE) {
+                     g_byte_array_set_size(app->rx, 0);
+                     show_message(app, "Mensaje demasiado grande del servidor");
+                     return -1;
+                 }
+                 g_byte_array_append(app->rx, in, len);
+                 if (!complete) break;
+                 data = app->rx->data;
+                 len = app->rx->len;
              }
+             if (app->binary) handle_bin_message(app, data, len);
+             else handle_server_message(app, (const char *)data, len);
+             g_byte_array_set_size(app->rx, 0);
              break;
          }
          case LWS_CALLBACK_CLIENT_WRITEABLE: {
-             pthread_mutex_lock(&app->lock_send_buffer);
-             if (app->send_pending) {
-                 unsigned char buf[LWS_PRE + WS_BUFFER];
-                 size_t n = strlen(app->send_buffer);
-                 memcpy(&buf[LWS_PRE], app->send_buffer, n);
-                 int m = lws_write(wsi, &buf[LWS_PRE], n, LWS_WRITE_TEXT);
+             // Se vacía la cola mientras el socket acepte más; si se
+             // llena, se sigue en el próximo WRITEABLE
+             GByteArray *frame;
+             while ((frame = g_queue_pop_head(app->tx))) {
+                 size_t n = frame->len - LWS_PRE;
+                 app->tx_bytes -= n;
+                 int m = lws_write(wsi, frame->data + LWS_PRE, n,
+                                   app->binary ? LWS_WRITE_BINARY : LWS_WRITE_TEXT);
+                 g_byte_array_unref(frame);
                  if (m < (int)n) {
-                     show_message(app, "Error al enviar mensaje (parcial)");
+                     show_message(app, "Error al enviar mensaje");
+                     return -1;
+                 }
+                 if (!g_queue_is_empty(app->tx) && lws_send_pipe_choked(wsi)) {
+                     lws_callback_on_writable(wsi);
+                     break;
                  }
-                 app->send_pending = 0;
              }
-             pthread_mutex_unlock(&app->lock_send_buffer);
              break;
          }
          case LWS_CALLBACK_CLIENT_CONNECTION_ERROR: {
              show_message(app, "Error de conexión con el servidor");
-             app->force_exit = 1;
+             app->wsi = NULL;
+             send_queue_clear(app);
              break;
          }
          case LWS_CALLBACK_CLOSED: {
              show_message(app, "Conexión cerrada");
              app->connected = 0;
-             app->force_exit = 1;
+             app->wsi = NULL;
+             send_queue_clear(app);
              break;
          }
          default:
@@ -294,21 +831,43 @@
      return 0;
  }
  
- // ----------------- Hilo para ejecutar lws_service() -----------------
+ // ----------------- Funciones para la Interfaz (GTK) -----------------
  
- static void *ws_service_thread(void *arg) {
-     AppData *app = (AppData *)arg;
-     // Reducimos el tiempo de espera a 1 ms para mayor reactividad.
-     while (!app->force_exit) {
-         if (app->context) {
-             lws_service(app->context, 1);
-         }
-     }
-     return NULL;
- }
+ // El id de cada protocolo es su formato
+ static struct lws_protocols protocols[] = {
+     { "chat-protocol", ws_callback, 0, WS_BUFFER, FMT_JSON, NULL, 0 },
+     { "chat-protocol-bin", ws_callback, 0, WS_BUFFER, FMT_BIN, NULL, 0 },
+     { NULL, NULL, 0, 0, 0, NULL, 0 }
+ };
  
- // ----------------- Funciones para la Interfaz (GTK) -----------------
+ // permessage-deflate si el servidor la acepta; client_max_window_bits le
+ // permite al servidor pedir una ventana más chica para lo que enviamos
+ static const struct lws_extension exts[] = {
+     { "permessage-deflate", lws_extension_callback_pm_deflate,
+       "permessage-deflate; client_max_window_bits" },
+     { NULL, NULL, NULL }
+ };
  
+ // Lo aprendido de la conexión anterior no vale para la nueva: tras un
+ // reinicio el servidor vuelve a repartir los ids desde 2, la versión del
+ // directorio puede repetirse y los canales hay que volver a unirlos
+ static void session_reset(AppData *app) {
+     g_hash_table_remove_all(app->user_names);
+     g_hash_table_remove_all(app->directory);
+     app->dir_version = 0;
+     app->dir_expect = 0;
+     app->dir_complete = 0;
+     app->dir_show = 0;
+     guint n;
+     gpointer *channels = g_hash_table_get_keys_as_array(app->channel_views, &n);
+     for (guint i = 0; i < n; i++) {
+         char *channel = g_strdup(channels[i]);
+         channel_close(app, channel);
+         g_free(channel);
+     }
+     g_free(channels);
+ }
+
  // Botón "Conectar"
  static void on_button_connect_clicked(GtkButton *button, gpointer user_data) {
      AppData *app = (AppData *)user_data;
@@ -326,19 +885,41 @@
      strncpy(app->server_ip, ip, sizeof(app->server_ip)-1);
      app->server_port = atoi(port);
  
+     // Al reconectar se descarta el contexto anterior con su conexión
+     if (app->context) {
+         lws_context_destroy(app->context);
+         app->context = NULL;
+         app->wsi = NULL;
+         app->connected = 0;
+         send_queue_clear(app);
+         g_byte_array_set_size(app->rx, 0);
+         session_reset(app);
+     }
+ 
      struct lws_context_creation_info info;
      memset(&info, 0, sizeof(info));
      info.port = CONTEXT_PORT_NO_LISTEN;
-     info.protocols = (struct lws_protocols[]){
-         { "chat-protocol", ws_callback, 0, WS_BUFFER, 0, NULL, 0 },
-         { NULL, NULL, 0, 0, 0, NULL, 0 }
-     };
-     info.options = LWS_SERVER_OPTION_DO_SSL_GLOBAL_INIT;
+     info.protocols = protocols;
+     info.extensions = exts;
+     // Los sockets y timers de lws se registran como fuentes del bucle de
+     // GTK: sin tráfico el proceso duerme en vez de despertar cada 1 ms
+     info.options = LWS_SERVER_OPTION_DO_SSL_GLOBAL_INIT | LWS_SERVER_OPTION_GLIB;
+     info.foreign_loops = (void **)&app->lws_loop;
      info.user = app;
  
      app->context = lws_create_context(&info);
      if (!app->context) {
-         show_message(app, "Error al crear contexto libwebsockets");
+         // Si sin GLib el contexto sí se crea, lo que falta es el plugin
+         info.options &= ~LWS_SERVER_OPTION_GLIB;
+         info.foreign_loops = NULL;
+         struct lws_context *probe = lws_create_context(&info);
+         if (probe) {
+             lws_context_destroy(probe);
+             show_message(app, "Error al crear contexto libwebsockets: falta el soporte de GLib "
+                               "(instalar libwebsockets-evlib-glib o compilar lws con LWS_WITH_GLIB)");
+         } else {
+             show_message(app, "Error al crear contexto libwebsockets");
+         }
          return;
      }
  
@@ -349,7 +930,9 @@
      ccinfo.path = "/chat";
      ccinfo.host = lws_canonical_hostname(app->context);
      ccinfo.origin = "origin";
-     ccinfo.protocol = "chat-protocol";
+     // Con binario se ofrecen los dos; un servidor viejo elegirá JSON
+     ccinfo.protocol = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(app->check_binary))
+                       ? "chat-protocol-bin,chat-protocol" : "chat-protocol";
      ccinfo.pwsi = &app->wsi;
  
      if (!lws_client_connect_via_info(&ccinfo)) {
@@ -359,10 +942,6 @@
          return;
      }
  
-     pthread_t tid;
-     pthread_create(&tid, NULL, ws_service_thread, (void *)app);
-     pthread_detach(tid);
- 
      show_message(app, "Intentando conectar...");
  }
  
@@ -379,15 +958,7 @@
 
     // Comando para desconectar
     if (strncmp(msg_text, "/salir", 6) == 0) {
-        cJSON *root = cJSON_CreateObject();
-        cJSON_AddStringToObject(root, "type", "disconnect");
-        cJSON_AddStringToObject(root, "sender", app->username);
-        cJSON_AddStringToObject(root, "content", "Cierre de sesión");
-        char timestamp[64];
-        get_timestamp(timestamp, sizeof(timestamp));
-        cJSON_AddStringToObject(root, "timestamp", timestamp);
-        send_cjson(app, root);
-        cJSON_Delete(root);
+        send_chat(app, MSG_DISCONNECT, NULL, "Cierre de sesión");
         return;
     }
 
@@ -397,9 +968,12 @@
             "Comandos disponibles:\n"
             "/help o /ayuda - Muestra esta ayuda.\n"
             "/info <usuario> - Solicita información de un usuario.\n"
+            "/historial [desde] - Repite los mensajes recientes (desde un número o AAAA-MM-DDTHH:MM:SS).\n"
+            "/join <canal> - Se une a un canal y abre su pestaña.\n"
+            "/leave [canal] - Sale del canal (por defecto, el de la pestaña activa).\n"
             "/salir - Desconecta del chat.\n"
             "@<usuario> <mensaje> - Envía mensaje privado.\n"
-            "Cualquier otro mensaje se envía como broadcast.";
+            "Cualquier otro mensaje va al canal de la pestaña activa (en general, broadcast).";
         show_message(app, help_msg);
         gtk_entry_set_text(GTK_ENTRY(app->entry_message), "");
         return;
@@ -408,42 +982,36 @@
     // Comando para solicitar información de un usuario: /info <usuario>
     if (strncmp(msg_text, "/info ", 6) == 0) {
         const char *usuario_objetivo = msg_text + 6;  // omite "/info "
-        cJSON *root = cJSON_CreateObject();
-        cJSON_AddStringToObject(root, "type", "user_info");
-        cJSON_AddStringToObject(root, "sender", app->username);
-        cJSON_AddStringToObject(root, "target", usuario_objetivo);
-        char timestamp[64];
-        get_timestamp(timestamp, sizeof(timestamp));
-        cJSON_AddStringToObject(root, "timestamp", timestamp);
-        send_cjson(app, root);
-        cJSON_Delete(root);
+        send_chat(app, MSG_USER_INFO, usuario_objetivo, NULL);
+    } else if (strcmp(msg_text, "/historial") == 0) {
+        send_chat(app, MSG_HISTORY, NULL, NULL);
+    } else if (strncmp(msg_text, "/historial ", 11) == 0) {
+        send_chat(app, MSG_HISTORY, NULL, msg_text + 11);
+    } else if (strncmp(msg_text, "/join ", 6) == 0) {
+        send_chat(app, MSG_JOIN, msg_text + 6, NULL);
+    } else if (strcmp(msg_text, "/leave") == 0 || strncmp(msg_text, "/leave ", 7) == 0) {
+        const char *channel = msg_text[6] ? msg_text + 7 : current_channel(app);
+        if (!channel) {
+            show_message(app, "No se puede salir de general");
+            return;
+        }
+        send_chat(app, MSG_LEAVE, channel, NULL);
     } else {
         // Procesamiento normal de mensajes (broadcast o privado)
-        cJSON *root = cJSON_CreateObject();
-        if (msg_text[0] == '@') {
-            const char *space = strchr(msg_text, ' ');
-            if (space) {
-                size_t target_len = space - msg_text - 1; // omitir '@'
-                char target[128] = {0};
-                strncpy(target, msg_text + 1, target_len);
-                cJSON_AddStringToObject(root, "type", "private");
-                cJSON_AddStringToObject(root, "target", target);
-                const char *content = space + 1;
-                cJSON_AddStringToObject(root, "content", content);
-            } else {
-                cJSON_AddStringToObject(root, "type", "broadcast");
-                cJSON_AddStringToObject(root, "content", msg_text);
-            }
+        // Si no entró en la cola el texto queda en el campo para reintentar
+        const char *space = msg_text[0] == '@' ? strchr(msg_text, ' ') : NULL;
+        int rc;
+        if (space) {
+            size_t target_len = space - msg_text - 1; // omitir '@'
+            char target[128] = {0};
+            strncpy(target, msg_text + 1, MIN(target_len, sizeof(target) - 1));
+            rc = send_chat(app, MSG_PRIVATE, target, space + 1);
+        } else if (current_channel(app)) {
+            rc = send_chat(app, MSG_CHANNEL_MESSAGE, current_channel(app), msg_text);
         } else {
-            cJSON_AddStringToObject(root, "type", "broadcast");
-            cJSON_AddStringToObject(root, "content", msg_text);
+            rc = send_chat(app, MSG_BROADCAST, NULL, msg_text);
         }
-        cJSON_AddStringToObject(root, "sender", app->username);
-        char timestamp[64];
-        get_timestamp(timestamp, sizeof(timestamp));
-        cJSON_AddStringToObject(root, "timestamp", timestamp);
-        send_cjson(app, root);
-        cJSON_Delete(root);
+        if (rc < 0) return;
     }
     gtk_entry_set_text(GTK_ENTRY(app->entry_message), "");
 
@@ -456,11 +1024,16 @@
          show_message(app, "No estás conectado al servidor");
          return;
      }
-     cJSON *root = cJSON_CreateObject();
-     cJSON_AddStringToObject(root, "type", "list_users");
-     cJSON_AddStringToObject(root, "sender", app->username);
-     send_cjson(app, root);
-     cJSON_Delete(root);
+     // Con la copia del directorio completa solo se pregunta si cambió
+     uint64_t version = app->dir_version;
+     if (version) {
+         char query[40];
+         snprintf(query, sizeof(query), "version=%llu", (unsigned long long)version);
+         app->dir_show = 1;
+         send_chat(app, MSG_LIST_USERS, NULL, query);
+     } else {
+         send_chat(app, MSG_LIST_USERS, NULL, NULL);
+     }
  }
   
  // Botón "Cambiar estado"
@@ -476,17 +1049,7 @@
          return;
      }
   
-     cJSON *root = cJSON_CreateObject();
-     cJSON_AddStringToObject(root, "type", "change_status");
-     cJSON_AddStringToObject(root, "sender", app->username);
-     cJSON_AddStringToObject(root, "content", selected_status);
-  
-     char timestamp[64];
-     get_timestamp(timestamp, sizeof(timestamp));
-     cJSON_AddStringToObject(root, "timestamp", timestamp);
-  
-     send_cjson(app, root);
-     cJSON_Delete(root);
+     send_chat(app, MSG_CHANGE_STATUS, NULL, selected_status);
      g_free(selected_status);
  }
   
@@ -523,13 +1086,13 @@
      g_signal_connect(app->btn_connect, "clicked", G_CALLBACK(on_button_connect_clicked), app);
      gtk_grid_attach(GTK_GRID(grid), app->btn_connect, 6, 0, 1, 1);
   
-     app->textview_chat = gtk_text_view_new();
-     gtk_text_view_set_editable(GTK_TEXT_VIEW(app->textview_chat), FALSE);
-     gtk_text_view_set_wrap_mode(GTK_TEXT_VIEW(app->textview_chat), GTK_WRAP_WORD_CHAR);
-     GtkWidget *scroll_chat = gtk_scrolled_window_new(NULL, NULL);
-     gtk_container_add(GTK_CONTAINER(scroll_chat), app->textview_chat);
-     gtk_widget_set_size_request(scroll_chat, 680, 300);
-     gtk_grid_attach(GTK_GRID(grid), scroll_chat, 0, 1, 7, 1);
+     GtkWidget *scroll_chat;
+     app->textview_chat = new_chat_view(&scroll_chat);
+     app->notebook = gtk_notebook_new();
+     gtk_notebook_set_scrollable(GTK_NOTEBOOK(app->notebook), TRUE);
+     gtk_notebook_append_page(GTK_NOTEBOOK(app->notebook), scroll_chat, gtk_label_new("general"));
+     gtk_widget_set_size_request(app->notebook, 680, 300);
+     gtk_grid_attach(GTK_GRID(grid), app->notebook, 0, 1, 7, 1);
   
      app->entry_message = gtk_entry_new();
      gtk_grid_attach(GTK_GRID(grid), app->entry_message, 0, 2, 5, 1);
@@ -551,6 +1114,10 @@
      app->btn_change_status = gtk_button_new_with_label("Cambiar estado");
      g_signal_connect(app->btn_change_status, "clicked", G_CALLBACK(on_button_change_status_clicked), app);
      gtk_grid_attach(GTK_GRID(grid), app->btn_change_status, 3, 3, 1, 1);
+ 
+     app->check_binary = gtk_check_button_new_with_label("Protocolo binario");
+     gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(app->check_binary), TRUE);
+     gtk_grid_attach(GTK_GRID(grid), app->check_binary, 4, 3, 2, 1);
   
      gtk_widget_show_all(app->window_main);
  }
@@ -558,15 +1125,36 @@
  int main(int argc, char **argv) {
      AppData app;
      memset(&app, 0, sizeof(app));
-     pthread_mutex_init(&app.lock_send_buffer, NULL);
+     app.lws_loop = g_main_loop_new(NULL, FALSE);
+     app.user_names = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+     app.channel_views = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+     app.directory = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+     app.rx = g_byte_array_new();
+     app.tx = g_queue_new();
+     app.pending = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, pending_free);
+     app.scrollback = SCROLLBACK_DEFAULT;
   
      GtkApplication *gtk_app = gtk_application_new("com.ejemplo.chatclient", G_APPLICATION_DEFAULT_FLAGS);
      g_signal_connect(gtk_app, "activate", G_CALLBACK(activate), &app);
+     GOptionEntry options[] = {
+         { "scrollback", 0, 0, G_OPTION_ARG_INT, &app.scrollback,
+           "Líneas que guarda cada pestaña (0 = sin límite)", "N" },
+         { NULL }
+     };
+     g_application_add_main_option_entries(G_APPLICATION(gtk_app), options);
   
      int status = g_application_run(G_APPLICATION(gtk_app), argc, argv);
      g_object_unref(gtk_app);
   
-     pthread_mutex_destroy(&app.lock_send_buffer);
+     if (app.context) lws_context_destroy(app.context);
+     g_main_loop_unref(app.lws_loop);
+     g_hash_table_destroy(app.user_names);
+     g_hash_table_destroy(app.channel_views);
+     g_hash_table_destroy(app.directory);
+     g_byte_array_unref(app.rx);
+     send_queue_clear(&app);
+     g_queue_free(app.tx);
+     g_hash_table_destroy(app.pending);
      return status;
  }
  
\ No newline at end of file
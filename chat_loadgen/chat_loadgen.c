@@ -0,0 +1,781 @@
+/******************************************************************************
+ * Generador de carga para el servidor de chat
+ * ---------------------------------------------------------------------------
+ * Abre N conexiones desde un solo proceso, registra N usuarios distintos y
+ * envía una mezcla configurable de mensajes a una tasa objetivo. Cada
+ * broadcast y privado lleva en el contenido la marca "lg#<ns>#" con el
+ * instante de envío (CLOCK_MONOTONIC); al verla llegar en cualquier
+ * conexión se registra la latencia de entrega de punta a punta.
+ *
+ * Formatos:
+ *   json  "chat-protocol" de server.c
+ *   bin   "chat-protocol-bin" de server.c
+ *   raw   texto sobre TCP para "s erver_threads.c" (bucle epoll propio)
+ *
+ * Compilar:
+ *   gcc chat_loadgen.c -o chat_loadgen -O2 -lwebsockets -lm
+ *
+ * Ejecutar (contra un servidor local):
+ *   ./chat_loadgen -c 2000 -r 5000 -d 30 127.0.0.1 8080
+ *   ./chat_loadgen --proto raw -c 90 -r 500 127.0.0.1 9090
+ ******************************************************************************/
+
+ #define _GNU_SOURCE          // memmem
+ #include <stdio.h>
+ #include <stdlib.h>
+ #include <stdint.h>
+ #include <string.h>
+ #include <time.h>
+ #include <errno.h>
+ #include <fcntl.h>
+ #include <getopt.h>
+ #include <signal.h>
+ #include <unistd.h>
+ #include <arpa/inet.h>
+ #include <netinet/in.h>
+ #include <netinet/tcp.h>
+ #include <sys/epoll.h>
+ #include <sys/resource.h>
+ #include <sys/socket.h>
+ #include <libwebsockets.h>
+
+ #define NAME_LEN 32
+ #define MSG_MAX 4096            // mensaje saliente más grande
+ #define OUTQ_SLOTS 16           // mensajes pendientes por conexión (ws)
+ #define MARK "lg#"
+ #define MARK_TAIL 32            // bytes que se guardan entre lecturas (raw)
+
+ // Tipos de mensaje de la mezcla; los valores son los del protocolo binario
+ typedef enum {
+     MIX_BROADCAST,
+     MIX_PRIVATE,
+     MIX_LIST_USERS,
+     MIX_USER_INFO,
+     MIX_CHANGE_STATUS,
+     MIX_COUNT
+ } MixKind;
+
+ static const char *const mix_names[MIX_COUNT] = {
+     "broadcast", "private", "list_users", "user_info", "change_status"
+ };
+ static const uint8_t mix_bin_type[MIX_COUNT] = { 2, 3, 4, 5, 6 };
+ #define BIN_REGISTER 1
+ #define BIN_REGISTER_SUCCESS 9
+
+ typedef enum { PROTO_JSON, PROTO_BIN, PROTO_RAW } Proto;
+
+ static struct {
+     const char *host;
+     int port;
+     Proto proto;
+     int clients;
+     double rate;              // mensajes por segundo en total
+     int duration;             // segundos de tráfico
+     int size;                 // bytes de contenido de broadcast/privado
+     int ramp;                 // conexiones nuevas por segundo
+     int interval;             // segundos entre reportes
+     unsigned mix[MIX_COUNT];  // pesos
+ } cfg = { "127.0.0.1", 8080, PROTO_JSON, 100, 1000.0, 30, 64, 500, 1,
+           { 70, 20, 5, 3, 2 } };
+
+ // ----------------- Histograma de latencias -----------------
+ // Log-lineal en microsegundos: 64 sub-buckets por potencia de 2 (error
+ // relativo < 1.6%), sin reservar memoria al registrar.
+
+ #define HIST_SUB_BITS 6
+ #define HIST_SUB (1 << HIST_SUB_BITS)
+ #define HIST_BUCKETS (HIST_SUB * 40)
+
+ typedef struct {
+     uint64_t counts[HIST_BUCKETS];
+     uint64_t total;
+     uint64_t max;
+ } Hist;
+
+ static int hist_index(uint64_t v) {
+     if (v < HIST_SUB) return (int)v;
+     int e = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+     int idx = e * HIST_SUB + (int)(v >> e);
+     return idx < HIST_BUCKETS ? idx : HIST_BUCKETS - 1;
+ }
+
+ static uint64_t hist_value(int idx) {
+     if (idx < HIST_SUB) return (uint64_t)idx;
+     int e = idx / HIST_SUB - 1;
+     uint64_t sub = (uint64_t)(idx % HIST_SUB) + HIST_SUB;
+     return sub << e;
+ }
+
+ static void hist_add(Hist *h, uint64_t us) {
+     h->counts[hist_index(us)]++;
+     h->total++;
+     if (us > h->max) h->max = us;
+ }
+
+ static void hist_merge(Hist *dst, const Hist *src) {
+     for (int i = 0; i < HIST_BUCKETS; i++) dst->counts[i] += src->counts[i];
+     dst->total += src->total;
+     if (src->max > dst->max) dst->max = src->max;
+ }
+
+ // Percentil p (0-100) en milisegundos
+ static double hist_pct(const Hist *h, double p) {
+     if (!h->total) return 0.0;
+     uint64_t want = (uint64_t)(p / 100.0 * (double)h->total);
+     if (want >= h->total) want = h->total - 1;
+     uint64_t seen = 0;
+     for (int i = 0; i < HIST_BUCKETS; i++) {
+         seen += h->counts[i];
+         if (seen > want) return hist_value(i) / 1000.0;
+     }
+     return h->max / 1000.0;
+ }
+
+ // ----------------- Estado global -----------------
+
+ typedef struct Conn {
+     int idx;
+     char name[NAME_LEN];
+     int registered;
+     int closed;
+     // WebSocket
+     struct lws *wsi;
+     unsigned char *outq[OUTQ_SLOTS];   // LWS_PRE + payload, largo adelante
+     size_t outq_len[OUTQ_SLOTS];
+     int outq_head, outq_count;
+     // raw
+     int fd;
+     char *out;
+     size_t out_len, out_cap;
+     char tail[MARK_TAIL];
+     size_t tail_len;
+ } Conn;
+
+ static Conn *conns;
+ static int opened, connected, registered_count, failed, closed_count;
+ static uint64_t sent[MIX_COUNT], sent_total, local_drops;
+ static uint64_t frames_in, bytes_in, delivered;
+ static Hist hist_interval, hist_all;
+ static uint64_t t_start, t_traffic, t_last_report, t_last_tick;
+ static uint64_t sent_at_report, delivered_at_report;
+ static double tokens;
+ static volatile int force_exit;
+ static struct lws_context *context;
+
+ static uint64_t now_ns(void) {
+     struct timespec ts;
+     clock_gettime(CLOCK_MONOTONIC, &ts);
+     return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+ }
+
+ static void sigint_handler(int sig) {
+     (void)sig;
+     force_exit = 1;
+ }
+
+ // Busca marcas completas en buf y registra su latencia. Devuelve el
+ // offset de una marca incompleta al final (o len si no hay). Solo cuentan
+ // las marcas enviadas desde que arrancó el tráfico: el historial que el
+ // servidor repite al registrarse puede traer las de una corrida anterior.
+ static size_t scan_marks(const char *buf, size_t len, uint64_t now) {
+     const char *p = buf, *end = buf + len;
+     while ((p = memmem(p, (size_t)(end - p), MARK, sizeof(MARK) - 1))) {
+         const char *q = p + sizeof(MARK) - 1;
+         uint64_t sent_ns = 0;
+         while (q < end && *q >= '0' && *q <= '9') sent_ns = sent_ns * 10 + (uint64_t)(*q++ - '0');
+         if (q == end) return (size_t)(p - buf);
+         if (*q == '#' && t_traffic && sent_ns >= t_traffic && sent_ns <= now) {
+             hist_add(&hist_interval, (now - sent_ns) / 1000);
+             delivered++;
+         }
+         p = q;
+     }
+     return len;
+ }
+
+ // ----------------- Mensajes -----------------
+
+ static MixKind pick_kind(void) {
+     unsigned total = 0;
+     for (int i = 0; i < MIX_COUNT; i++) total += cfg.mix[i];
+     unsigned r = (unsigned)(rand() % total);
+     for (int i = 0; i < MIX_COUNT; i++) {
+         if (r < cfg.mix[i]) return (MixKind)i;
+         r -= cfg.mix[i];
+     }
+     return MIX_BROADCAST;
+ }
+
+ // Otro usuario registrado al azar (o el mismo si es el único)
+ static Conn *pick_peer(const Conn *self) {
+     for (int tries = 0; tries < 8; tries++) {
+         Conn *c = &conns[rand() % cfg.clients];
+         if (c != self && c->registered && !c->closed) return c;
+     }
+     return (Conn *)self;
+ }
+
+ // Contenido con la marca de tiempo, completado hasta cfg.size bytes
+ static size_t make_content(char *out, size_t cap) {
+     int n = snprintf(out, cap, MARK "%llu#", (unsigned long long)now_ns());
+     size_t len = (size_t)n;
+     while (len < (size_t)cfg.size && len + 1 < cap) out[len++] = 'x';
+     out[len] = '\0';
+     return len;
+ }
+
+ static size_t put_varint(unsigned char *p, uint64_t v) {
+     size_t n = 0;
+     do {
+         p[n] = v & 0x7F;
+         v >>= 7;
+         if (v) p[n] |= 0x80;
+         n++;
+     } while (v);
+     return n;
+ }
+
+ // Usuario en línea (impar) o ausente (0)
+ static size_t put_user(unsigned char *p, const char *name) {
+     if (!name) return put_varint(p, 0);
+     size_t len = strlen(name);
+     size_t n = put_varint(p, ((uint64_t)len << 1) | 1);
+     memcpy(p + n, name, len);
+     return n + len;
+ }
+
+ static size_t put_opt(unsigned char *p, const char *s) {
+     if (!s) return put_varint(p, 0);
+     size_t len = strlen(s);
+     size_t n = put_varint(p, len + 1);
+     memcpy(p + n, s, len);
+     return n + len;
+ }
+
+ // Registro binario completo (con su largo adelante)
+ static size_t bin_record(unsigned char *out, uint8_t type, const char *sender,
+                          const char *target, const char *content) {
+     unsigned char body[MSG_MAX];
+     size_t n = 0;
+     body[n++] = type;
+     uint64_t ts = (uint64_t)time(NULL);
+     for (int i = 0; i < 8; i++) body[n++] = (unsigned char)(ts >> (8 * i));
+     n += put_user(body + n, sender);
+     n += put_user(body + n, target);
+     n += put_opt(body + n, content);
+     size_t pre = put_varint(out, n);
+     memcpy(out + pre, body, n);
+     return pre + n;
+ }
+
+ // Arma en out el mensaje de tipo kind de c en el formato configurado
+ static size_t build_message(Conn *c, int reg, MixKind kind, unsigned char *out) {
+     char content[MSG_MAX / 2];
+     const char *target = NULL, *text = NULL;
+     static const char *const statuses[] = { "ACTIVO", "OCUPADO" };
+
+     if (reg) {
+         if (cfg.proto == PROTO_RAW) return (size_t)snprintf((char *)out, MSG_MAX, "%s", c->name) + 1;
+         if (cfg.proto == PROTO_BIN) return bin_record(out, BIN_REGISTER, c->name, NULL, NULL);
+         return (size_t)snprintf((char *)out, MSG_MAX,
+                                 "{\"type\":\"register\",\"sender\":\"%s\",\"content\":null}", c->name);
+     }
+     switch (kind) {
+         case MIX_BROADCAST:
+             make_content(content, sizeof(content));
+             text = content;
+             break;
+         case MIX_PRIVATE:
+             make_content(content, sizeof(content));
+             text = content;
+             target = pick_peer(c)->name;
+             break;
+         case MIX_USER_INFO:
+             target = pick_peer(c)->name;
+             break;
+         case MIX_CHANGE_STATUS:
+             text = statuses[rand() % 2];
+             break;
+         default:
+             break;
+     }
+
+     if (cfg.proto == PROTO_BIN) return bin_record(out, mix_bin_type[kind], c->name, target, text);
+     if (cfg.proto == PROTO_RAW) {
+         char *s = (char *)out;
+         switch (kind) {
+             case MIX_BROADCAST:     return (size_t)snprintf(s, MSG_MAX, "%s\n", text);
+             case MIX_PRIVATE:       return (size_t)snprintf(s, MSG_MAX, "@%s %s\n", target, text);
+             case MIX_LIST_USERS:    return (size_t)snprintf(s, MSG_MAX, "/usuarios\n");
+             case MIX_USER_INFO:     return (size_t)snprintf(s, MSG_MAX, "/info %s\n", target);
+             case MIX_CHANGE_STATUS: return (size_t)snprintf(s, MSG_MAX, "/estado %s\n", text);
+             default:                return 0;
+         }
+     }
+     // Los nombres y el contenido solo usan caracteres que no se escapan
+     int n = snprintf((char *)out, MSG_MAX, "{\"type\":\"%s\",\"sender\":\"%s\"", mix_names[kind], c->name);
+     if (target) n += snprintf((char *)out + n, MSG_MAX - n, ",\"target\":\"%s\"", target);
+     if (text) n += snprintf((char *)out + n, MSG_MAX - n, ",\"content\":\"%s\"", text);
+     n += snprintf((char *)out + n, MSG_MAX - n, "}");
+     return (size_t)n;
+ }
+
+ // ----------------- Modo WebSocket (lws) -----------------
+
+ static void ws_enqueue(Conn *c, const unsigned char *msg, size_t len) {
+     if (c->outq_count == OUTQ_SLOTS) {
+         local_drops++;
+         return;
+     }
+     unsigned char *buf = malloc(LWS_PRE + len);
+     if (!buf) return;
+     memcpy(buf + LWS_PRE, msg, len);
+     int slot = (c->outq_head + c->outq_count) % OUTQ_SLOTS;
+     c->outq[slot] = buf;
+     c->outq_len[slot] = len;
+     c->outq_count++;
+     lws_callback_on_writable(c->wsi);
+ }
+
+ static void ws_send(Conn *c, int reg, MixKind kind) {
+     unsigned char msg[MSG_MAX];
+     size_t len = build_message(c, reg, kind, msg);
+     if (len) ws_enqueue(c, msg, len);
+ }
+
+ static void ws_drop_queue(Conn *c) {
+     while (c->outq_count) {
+         free(c->outq[c->outq_head]);
+         c->outq_head = (c->outq_head + 1) % OUTQ_SLOTS;
+         c->outq_count--;
+     }
+ }
+
+ static int ws_callback(struct lws *wsi, enum lws_callback_reasons reason,
+                        void *user, void *in, size_t len) {
+     Conn *c = user;
+     switch (reason) {
+         case LWS_CALLBACK_CLIENT_ESTABLISHED:
+             connected++;
+             ws_send(c, 1, MIX_BROADCAST);
+             break;
+         case LWS_CALLBACK_CLIENT_RECEIVE:
+             frames_in++;
+             bytes_in += len;
+             scan_marks(in, len, now_ns());
+             if (!c->registered) {
+                 const unsigned char *b = in;
+                 int ok = cfg.proto == PROTO_BIN
+                          ? len > 1 && b[0] < 0x80 && b[1] == BIN_REGISTER_SUCCESS
+                          : memmem(in, len, "\"register_success\"", 18) != NULL;
+                 if (ok) {
+                     c->registered = 1;
+                     registered_count++;
+                 }
+             }
+             break;
+         case LWS_CALLBACK_CLIENT_WRITEABLE: {
+             if (!c->outq_count) break;
+             int slot = c->outq_head;
+             unsigned char *buf = c->outq[slot];
+             size_t n = c->outq_len[slot];
+             c->outq_head = (c->outq_head + 1) % OUTQ_SLOTS;
+             c->outq_count--;
+             int m = lws_write(wsi, buf + LWS_PRE, n,
+                               cfg.proto == PROTO_BIN ? LWS_WRITE_BINARY : LWS_WRITE_TEXT);
+             free(buf);
+             if (m < (int)n) return -1;
+             if (c->outq_count) lws_callback_on_writable(wsi);
+             break;
+         }
+         case LWS_CALLBACK_CLIENT_CONNECTION_ERROR:
+             failed++;
+             c->closed = 1;
+             c->wsi = NULL;
+             ws_drop_queue(c);
+             break;
+         case LWS_CALLBACK_CLIENT_CLOSED:
+             closed_count++;
+             c->closed = 1;
+             c->wsi = NULL;
+             ws_drop_queue(c);
+             break;
+         default:
+             break;
+     }
+     return 0;
+ }
+
+ static struct lws_protocols ws_protocols[] = {
+     { "chat-protocol", ws_callback, 0, 0, 0, NULL, 0 },
+     { "chat-protocol-bin", ws_callback, 0, 0, 0, NULL, 0 },
+     { NULL, NULL, 0, 0, 0, NULL, 0 }
+ };
+
+ static void ws_open(Conn *c) {
+     struct lws_client_connect_info cc;
+     memset(&cc, 0, sizeof(cc));
+     cc.context = context;
+     cc.address = cfg.host;
+     cc.port = cfg.port;
+     cc.path = "/chat";
+     cc.host = cfg.host;
+     cc.origin = cfg.host;
+     cc.protocol = cfg.proto == PROTO_BIN ? "chat-protocol-bin" : "chat-protocol";
+     cc.userdata = c;
+     cc.pwsi = &c->wsi;
+     if (!lws_client_connect_via_info(&cc)) {
+         failed++;
+         c->closed = 1;
+     }
+ }
+
+ // ----------------- Modo raw (epoll) -----------------
+
+ static int epfd = -1;
+
+ static void raw_close(Conn *c) {
+     if (c->fd < 0) return;
+     epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+     close(c->fd);
+     c->fd = -1;
+     c->closed = 1;
+     closed_count++;
+ }
+
+ static void raw_update_events(Conn *c) {
+     struct epoll_event ev = { .events = EPOLLIN | (c->out_len ? EPOLLOUT : 0), .data.ptr = c };
+     epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+ }
+
+ static void raw_flush(Conn *c) {
+     while (c->out_len) {
+         ssize_t n = send(c->fd, c->out, c->out_len, MSG_NOSIGNAL);
+         if (n < 0) {
+             if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+             raw_close(c);
+             return;
+         }
+         memmove(c->out, c->out + n, c->out_len - (size_t)n);
+         c->out_len -= (size_t)n;
+     }
+     raw_update_events(c);
+ }
+
+ static void raw_send(Conn *c, int reg, MixKind kind) {
+     unsigned char msg[MSG_MAX];
+     size_t len = build_message(c, reg, kind, msg);
+     if (!len || c->fd < 0) return;
+     if (c->out_len + len > 64 * 1024) {
+         local_drops++;
+         return;
+     }
+     if (c->out_len + len > c->out_cap) {
+         size_t cap = c->out_cap ? c->out_cap * 2 : 4096;
+         while (cap < c->out_len + len) cap *= 2;
+         char *out = realloc(c->out, cap);
+         if (!out) return;
+         c->out = out;
+         c->out_cap = cap;
+     }
+     memcpy(c->out + c->out_len, msg, len);
+     c->out_len += len;
+     raw_flush(c);
+ }
+
+ static void raw_open(Conn *c) {
+     c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+     if (c->fd < 0) {
+         failed++;
+         c->closed = 1;
+         return;
+     }
+     int one = 1;
+     setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+     struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons((uint16_t)cfg.port) };
+     inet_pton(AF_INET, cfg.host, &addr.sin_addr);
+     if (connect(c->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS) {
+         close(c->fd);
+         c->fd = -1;
+         failed++;
+         c->closed = 1;
+         return;
+     }
+     struct epoll_event ev = { .events = EPOLLOUT, .data.ptr = c };
+     epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+ }
+
+ static void raw_event(Conn *c, uint32_t events) {
+     if (!c->registered && (events & EPOLLOUT)) {
+         int err = 0;
+         socklen_t len = sizeof(err);
+         getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+         if (err) {
+             failed++;
+             raw_close(c);
+             return;
+         }
+         // El servidor raw no confirma el registro: con conectar y
+         // mandar el nombre ya cuenta
+         connected++;
+         c->registered = 1;
+         registered_count++;
+         raw_send(c, 1, MIX_BROADCAST);
+         return;
+     }
+     if (events & EPOLLIN) {
+         char buf[MARK_TAIL + 65536];
+         memcpy(buf, c->tail, c->tail_len);
+         ssize_t n = recv(c->fd, buf + c->tail_len, sizeof(buf) - c->tail_len, 0);
+         if (n <= 0) {
+             if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+             raw_close(c);
+             return;
+         }
+         frames_in++;
+         bytes_in += (uint64_t)n;
+         size_t total = c->tail_len + (size_t)n;
+         size_t keep = scan_marks(buf, total, now_ns());
+         c->tail_len = total - keep < MARK_TAIL ? total - keep : 0;
+         memcpy(c->tail, buf + keep, c->tail_len);
+     }
+     if (events & (EPOLLERR | EPOLLHUP)) {
+         raw_close(c);
+         return;
+     }
+     if (events & EPOLLOUT) raw_flush(c);
+ }
+
+ // ----------------- Reloj: apertura, tráfico y reportes -----------------
+
+ static void report(uint64_t now, int final) {
+     double secs = (now - t_last_report) / 1e9;
+     if (final) {
+         double traffic = t_traffic ? (now - t_traffic) / 1e9 : 0.0;
+         hist_merge(&hist_all, &hist_interval);
+         printf("\n== Resumen (%s, %d clientes, %.1f s de tráfico) ==\n",
+                cfg.proto == PROTO_RAW ? "raw" : cfg.proto == PROTO_BIN ? "bin" : "json",
+                cfg.clients, traffic);
+         printf("conexiones: %d abiertas, %d registradas, %d fallidas, %d cerradas\n",
+                connected, registered_count, failed, closed_count);
+         for (int i = 0; i < MIX_COUNT; i++)
+             printf("  %-14s %llu\n", mix_names[i], (unsigned long long)sent[i]);
+         printf("enviados: %llu (%.0f/s), descartados en el cliente: %llu\n",
+                (unsigned long long)sent_total, traffic > 0 ? sent_total / traffic : 0.0,
+                (unsigned long long)local_drops);
+         printf("recibidos: %llu frames, %.1f MB; entregas medidas: %llu (%.0f/s)\n",
+                (unsigned long long)frames_in, bytes_in / 1e6,
+                (unsigned long long)delivered, traffic > 0 ? delivered / traffic : 0.0);
+         printf("latencia: p50 %.2f ms, p99 %.2f ms, p999 %.2f ms, max %.2f ms\n",
+                hist_pct(&hist_all, 50), hist_pct(&hist_all, 99), hist_pct(&hist_all, 99.9),
+                hist_all.max / 1000.0);
+         return;
+     }
+     printf("t=%4.0fs conex=%d reg=%d env=%.0f/s entregas=%.0f/s p50=%.2fms p99=%.2fms p999=%.2fms\n",
+            (now - t_start) / 1e9, connected, registered_count,
+            (sent_total - sent_at_report) / secs, (delivered - delivered_at_report) / secs,
+            hist_pct(&hist_interval, 50), hist_pct(&hist_interval, 99), hist_pct(&hist_interval, 99.9));
+     fflush(stdout);
+     hist_merge(&hist_all, &hist_interval);
+     memset(&hist_interval, 0, sizeof(hist_interval));
+     sent_at_report = sent_total;
+     delivered_at_report = delivered;
+     t_last_report = now;
+ }
+
+ // Un paso del reloj: abre conexiones al ritmo de --ramp, genera los
+ // mensajes que tocan según --rate y reporta. Devuelve 1 al terminar.
+ static int tick(void) {
+     uint64_t now = now_ns();
+     double dt = (now - t_last_tick) / 1e9;
+     t_last_tick = now;
+
+     int want = (int)((now - t_start) / 1e9 * cfg.ramp) + 1;
+     while (opened < cfg.clients && opened < want) {
+         Conn *c = &conns[opened++];
+         if (cfg.proto == PROTO_RAW) raw_open(c);
+         else ws_open(c);
+     }
+
+     // El tráfico arranca cuando todas las conexiones terminaron de abrir
+     if (!t_traffic && opened == cfg.clients && registered_count + failed >= cfg.clients) {
+         t_traffic = now;
+         printf("%d usuarios registrados; comienza el tráfico\n", registered_count);
+     }
+     if (t_traffic && registered_count) {
+         tokens += cfg.rate * dt;
+         if (tokens > cfg.rate) tokens = cfg.rate;   // no acumular ráfagas largas
+         // misses acota la búsqueda si casi todas las conexiones cerraron
+         for (int misses = 0; tokens >= 1.0 && misses < 64; ) {
+             Conn *c = &conns[rand() % cfg.clients];
+             if (!c->registered || c->closed) {
+                 misses++;
+                 continue;
+             }
+             MixKind kind = pick_kind();
+             if (cfg.proto == PROTO_RAW) raw_send(c, 0, kind);
+             else ws_send(c, 0, kind);
+             sent[kind]++;
+             sent_total++;
+             tokens -= 1.0;
+         }
+     }
+
+     if (now - t_last_report >= (uint64_t)cfg.interval * 1000000000u) report(now, 0);
+     if (t_traffic && now - t_traffic >= (uint64_t)cfg.duration * 1000000000u) return 1;
+     return force_exit;
+ }
+
+ static lws_sorted_usec_list_t tick_sul;
+
+ static void ws_tick(lws_sorted_usec_list_t *sul) {
+     if (tick()) {
+         force_exit = 1;
+         lws_cancel_service(context);
+         return;
+     }
+     lws_sul_schedule(context, 0, sul, ws_tick, 1000);
+ }
+
+ static int run_ws(void) {
+     struct lws_context_creation_info info;
+     memset(&info, 0, sizeof(info));
+     info.port = CONTEXT_PORT_NO_LISTEN;
+     info.protocols = ws_protocols;
+     info.fd_limit_per_thread = (unsigned)cfg.clients + 64;
+     context = lws_create_context(&info);
+     if (!context) {
+         fprintf(stderr, "Error al crear el contexto de lws\n");
+         return 1;
+     }
+     lws_sul_schedule(context, 0, &tick_sul, ws_tick, 1000);
+     while (!force_exit) lws_service(context, 0);
+     report(now_ns(), 1);
+     lws_context_destroy(context);
+     return 0;
+ }
+
+ static int run_raw(void) {
+     epfd = epoll_create1(0);
+     if (epfd < 0) {
+         perror("epoll_create1");
+         return 1;
+     }
+     struct epoll_event events[256];
+     while (!tick()) {
+         int n = epoll_wait(epfd, events, 256, 1);
+         for (int i = 0; i < n; i++) raw_event(events[i].data.ptr, events[i].events);
+     }
+     report(now_ns(), 1);
+     for (int i = 0; i < cfg.clients; i++) raw_close(&conns[i]);
+     close(epfd);
+     return 0;
+ }
+
+ // ----------------- Opciones -----------------
+
+ static void usage(const char *prog) {
+     fprintf(stderr,
+             "Uso: %s [opciones] [host] [puerto]\n"
+             "  -c, --clients N      conexiones / usuarios (defecto 100)\n"
+             "  -r, --rate N         mensajes por segundo en total (defecto 1000)\n"
+             "  -d, --duration N     segundos de tráfico (defecto 30)\n"
+             "  -s, --size N         bytes de contenido por mensaje (defecto 64)\n"
+             "  -m, --mix LISTA      pesos, p. ej. broadcast=70,private=20,list_users=5,\n"
+             "                       user_info=3,change_status=2\n"
+             "  -p, --proto P        json | bin | raw (defecto json)\n"
+             "      --ramp N         conexiones nuevas por segundo (defecto 500)\n"
+             "      --interval N     segundos entre reportes (defecto 1)\n",
+             prog);
+ }
+
+ static int parse_mix(char *spec) {
+     unsigned mix[MIX_COUNT] = { 0 };
+     for (char *tok = strtok(spec, ","); tok; tok = strtok(NULL, ",")) {
+         char *eq = strchr(tok, '=');
+         if (!eq) return -1;
+         *eq = '\0';
+         int k;
+         for (k = 0; k < MIX_COUNT; k++)
+             if (strcmp(tok, mix_names[k]) == 0) break;
+         if (k == MIX_COUNT) return -1;
+         mix[k] = (unsigned)strtoul(eq + 1, NULL, 10);
+     }
+     unsigned total = 0;
+     for (int i = 0; i < MIX_COUNT; i++) total += mix[i];
+     if (!total) return -1;
+     memcpy(cfg.mix, mix, sizeof(mix));
+     return 0;
+ }
+
+ static int parse_args(int argc, char **argv) {
+     static const struct option opts[] = {
+         { "clients",  required_argument, NULL, 'c' },
+         { "rate",     required_argument, NULL, 'r' },
+         { "duration", required_argument, NULL, 'd' },
+         { "size",     required_argument, NULL, 's' },
+         { "mix",      required_argument, NULL, 'm' },
+         { "proto",    required_argument, NULL, 'p' },
+         { "ramp",     required_argument, NULL, 'R' },
+         { "interval", required_argument, NULL, 'i' },
+         { "help",     no_argument,       NULL, 'h' },
+         { NULL, 0, NULL, 0 }
+     };
+     int opt;
+     while ((opt = getopt_long(argc, argv, "c:r:d:s:m:p:h", opts, NULL)) != -1) {
+         switch (opt) {
+             case 'c': cfg.clients = atoi(optarg); if (cfg.clients < 1) return -1; break;
+             case 'r': cfg.rate = atof(optarg); if (cfg.rate <= 0) return -1; break;
+             case 'd': cfg.duration = atoi(optarg); if (cfg.duration < 1) return -1; break;
+             case 's':
+                 cfg.size = atoi(optarg);
+                 if (cfg.size < 0 || cfg.size > MSG_MAX / 2 - 1) return -1;
+                 break;
+             case 'm': if (parse_mix(optarg) < 0) return -1; break;
+             case 'p':
+                 if (strcmp(optarg, "json") == 0) cfg.proto = PROTO_JSON;
+                 else if (strcmp(optarg, "bin") == 0) cfg.proto = PROTO_BIN;
+                 else if (strcmp(optarg, "raw") == 0) cfg.proto = PROTO_RAW;
+                 else return -1;
+                 break;
+             case 'R': cfg.ramp = atoi(optarg); if (cfg.ramp < 1) return -1; break;
+             case 'i': cfg.interval = atoi(optarg); if (cfg.interval < 1) return -1; break;
+             default: return -1;
+         }
+     }
+     if (optind < argc) cfg.host = argv[optind++];
+     if (optind < argc) cfg.port = atoi(argv[optind++]);
+     return 0;
+ }
+
+ int main(int argc, char **argv) {
+     if (parse_args(argc, argv) < 0) {
+         usage(argv[0]);
+         return 1;
+     }
+     signal(SIGINT, sigint_handler);
+     signal(SIGPIPE, SIG_IGN);
+     lws_set_log_level(LLL_ERR, NULL);
+     srand((unsigned)time(NULL));
+
+     // Miles de conexiones necesitan más descriptores que el límite usual
+     struct rlimit rl;
+     if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < (rlim_t)cfg.clients + 64) {
+         rl.rlim_cur = rl.rlim_max;
+         setrlimit(RLIMIT_NOFILE, &rl);
+     }
+
+     conns = calloc((size_t)cfg.clients, sizeof(Conn));
+     if (!conns) return 1;
+     for (int i = 0; i < cfg.clients; i++) {
+         conns[i].idx = i;
+         conns[i].fd = -1;
+         snprintf(conns[i].name, NAME_LEN, "lg%d_%d", (int)getpid() % 100000, i);
+     }
+
+     t_start = t_last_report = t_last_tick = now_ns();
+     int rc = cfg.proto == PROTO_RAW ? run_raw() : run_ws();
+     for (int i = 0; i < cfg.clients; i++) free(conns[i].out);
+     free(conns);
+     return rc;
+ }
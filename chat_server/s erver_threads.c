@@ -1,32 +1,116 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <signal.h>
 #include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include <pthread.h>
 #include <time.h>
 
-#define MAX_CLIENTES 100
+// El motor io_uring usa la interfaz del kernel directamente (sin liburing);
+// hace falta un kernel con recv multishot y anillos de buffers (6.0+)
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+#if defined(IORING_RECV_MULTISHOT) && defined(__NR_io_uring_setup)
+#define HAY_IO_URING 1
+#endif
+
 #define NOMBRE_LEN 50
 #define MENSAJE_LEN 512
 #define TIMEOUT_INACTIVIDAD 60 // segundos
+#define SALIDA_MAX (256 * 1024) // bytes pendientes antes de cortar a un cliente lento
+#define EVENTOS_POR_VUELTA 256
+#define LECTURA_LEN 16384
+#define IOV_POR_ENVIO 64
+#define ENVIOS_ENLAZADOS 16     // io_uring: envíos por cadena a un mismo usuario
+#define LISTA_TROZO (32 * 1024) // /usuarios sale de a trozos de este tamaño
+
+// Protocolo: cada comando termina en '\n' (o en '\0', como manda el
+// nombre el generador de carga). Lo que llega sin terminar se guarda en la
+// entrada de la conexión hasta que llegue el resto; una línea de
+// MENSAJE_LEN bytes o más se descarta entera.
+
+// Un mensaje ya armado. Un broadcast arma uno solo y cada destinatario
+// encola una referencia.
+typedef struct {
+    int refs;
+    size_t len;
+    char datos[];
+} Bloque;
 
+// Cada conexión pertenece a un solo trabajador: solo ese hilo lee de ella
+// y solo ese hilo la cierra. Los demás pueden encolarle mensajes mientras
+// está en la lista de usuarios, y mandarlos después de soltar el lock
+// mientras tengan una referencia.
 typedef struct {
-    int socket_fd;
+    int socket_fd;       // -1 una vez cerrado (con mutex_salida)
     char nombre[NOMBRE_LEN];
     char ip[INET_ADDRSTRLEN];
     char estado[10]; // ACTIVO, OCUPADO, INACTIVO
     time_t ultima_actividad;
+    int registrado;      // ya mandó su nombre y está en usuarios
+    size_t indice;       // posición en usuarios
+    int refs;
+    char* entrada;       // línea a medio llegar (solo la toca el dueño)
+    size_t entrada_len;
+    int descartando;     // la línea actual es demasiado larga
+    char* lista;         // /usuarios armado y todavía sin encolar entero (solo el dueño)
+    size_t lista_len, lista_pos;
+    pthread_mutex_t mutex_salida;   // protege todo lo de abajo y socket_fd
+    Bloque** salida;     // cola circular de mensajes por mandar
+    size_t salida_inicio, salida_num, salida_cap;
+    size_t salida_enviado;          // bytes ya mandados del primero
+    size_t salida_bytes;
+    int por_vaciar;      // ya está en la lista de algún hilo
+    int enviando;        // io_uring: envíos en vuelo (una cadena)
+    int envio_fallido;   // io_uring: algún envío de la cadena falló
+    int cerrando;        // io_uring: se cierra cuando termine la cadena
+    struct EnvioUring* envio;       // io_uring: lo que lee el kernel
 } Usuario;
 
-Usuario* usuarios[MAX_CLIENTES];
+// Con io_uring el kernel lee los msghdr y los iovec después de que se
+// prepararon los envíos, así que viven en el usuario hasta que terminan.
+// Crecen según lo que haya en cola, no se reservan enteros.
+typedef struct EnvioUring {
+    struct msghdr msg[ENVIOS_ENLAZADOS];
+    struct iovec* iov;
+    size_t iov_cap;
+} EnvioUring;
+
+// Lista densa de los registrados; crece según haga falta
+Usuario** usuarios;
+size_t num_usuarios, cap_usuarios;
 pthread_mutex_t mutex_usuarios = PTHREAD_MUTEX_INITIALIZER;
 
+// Con epoll, un epoll por trabajador y el hilo principal reparte las
+// conexiones. Con io_uring, un anillo por trabajador y cada uno acepta por
+// su cuenta.
+typedef struct {
+    int epfd;
+    struct Anillo* anillo;   // NULL con epoll
+    pthread_t hilo;
+} Trabajador;
+
+Trabajador* trabajadores;
+int num_trabajadores;
+static __thread Trabajador* trabajador_actual;
+
 void actualizar_estado_por_inactividad() {
     time_t ahora = time(NULL);
     pthread_mutex_lock(&mutex_usuarios);
-    for (int i = 0; i < MAX_CLIENTES; i++) {
-        if (usuarios[i] && strcmp(usuarios[i]->estado, "INACTIVO") != 0) {
+    for (size_t i = 0; i < num_usuarios; i++) {
+        if (strcmp(usuarios[i]->estado, "INACTIVO") != 0) {
             double inactivo = difftime(ahora, usuarios[i]->ultima_actividad);
             if (inactivo > TIMEOUT_INACTIVIDAD) {
                 strcpy(usuarios[i]->estado, "INACTIVO");
@@ -44,175 +128,972 @@ void* monitor_inactividad(void* arg) {
     return NULL;
 }
 
-void enviar(int fd, const char* msg) {
-    send(fd, msg, strlen(msg), 0);
+Bloque* bloque_nuevo(const char* msg, size_t len) {
+    Bloque* b = malloc(sizeof(Bloque) + len);
+    if (!b) return NULL;
+    b->refs = 1;
+    b->len = len;
+    memcpy(b->datos, msg, len);
+    return b;
 }
 
-void broadcast(char* mensaje, int emisor_fd) {
-    pthread_mutex_lock(&mutex_usuarios);
-    for (int i = 0; i < MAX_CLIENTES; i++) {
-        if (usuarios[i] && usuarios[i]->socket_fd != emisor_fd) {
-            enviar(usuarios[i]->socket_fd, mensaje);
+void bloque_soltar(Bloque* b) {
+    if (__atomic_sub_fetch(&b->refs, 1, __ATOMIC_ACQ_REL) == 0) free(b);
+}
+
+void usuario_ref(Usuario* u) {
+    __atomic_fetch_add(&u->refs, 1, __ATOMIC_RELAXED);
+}
+
+void usuario_soltar(Usuario* u) {
+    if (__atomic_sub_fetch(&u->refs, 1, __ATOMIC_ACQ_REL) != 0) return;
+    pthread_mutex_destroy(&u->mutex_salida);
+    free(u->salida);
+    free(u->entrada);
+    free(u->envio);
+    free(u->lista);
+    free(u);
+}
+
+// Descarta los mensajes en cola; se llama con mutex_salida tomado
+void salida_limpiar(Usuario* u) {
+    while (u->salida_num) {
+        bloque_soltar(u->salida[u->salida_inicio]);
+        u->salida_inicio = (u->salida_inicio + 1) % u->salida_cap;
+        u->salida_num--;
+    }
+    u->salida_enviado = 0;
+    u->salida_bytes = 0;
+}
+
+// Arma los iovec de lo que está en cola (hasta max mensajes)
+int salida_iov(Usuario* u, struct iovec* iov, int max) {
+    int n = 0;
+    for (size_t i = 0; i < u->salida_num && n < max; i++, n++) {
+        Bloque* b = u->salida[(u->salida_inicio + i) % u->salida_cap];
+        size_t desde = i == 0 ? u->salida_enviado : 0;
+        iov[n].iov_base = b->datos + desde;
+        iov[n].iov_len = b->len - desde;
+    }
+    return n;
+}
+
+// Saca de la cola los bytes que el socket ya aceptó
+void salida_avanzar(Usuario* u, size_t enviado) {
+    u->salida_bytes -= enviado;
+    size_t resto = enviado + u->salida_enviado;
+    while (u->salida_num && resto >= u->salida[u->salida_inicio]->len) {
+        Bloque* b = u->salida[u->salida_inicio];
+        resto -= b->len;
+        bloque_soltar(b);
+        u->salida_inicio = (u->salida_inicio + 1) % u->salida_cap;
+        u->salida_num--;
+    }
+    u->salida_enviado = resto;
+}
+
+// Manda lo que entre en el socket, varios mensajes por llamada; se llama
+// con mutex_salida tomado. Nunca bloquea: lo que quede sale con EPOLLOUT.
+void vaciar_salida(Usuario* u) {
+    while (u->salida_num && u->socket_fd >= 0) {
+        struct iovec iov[IOV_POR_ENVIO];
+        int n = salida_iov(u, iov, IOV_POR_ENVIO);
+        // Si queda más de lo que entra en un envío, MSG_MORE evita que el
+        // kernel mande un segmento chico entre medio
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = n };
+        ssize_t enviado = sendmsg(u->socket_fd, &msg, MSG_NOSIGNAL | (u->salida_num > (size_t)n ? MSG_MORE : 0));
+        if (enviado < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) salida_limpiar(u); // el dueño verá el error
+            return;
         }
+        salida_avanzar(u, (size_t)enviado);
     }
-    pthread_mutex_unlock(&mutex_usuarios);
 }
 
-void mensaje_directo(char* destino, char* mensaje, char* origen) {
-    pthread_mutex_lock(&mutex_usuarios);
-    for (int i = 0; i < MAX_CLIENTES; i++) {
-        if (usuarios[i] && strcmp(usuarios[i]->nombre, destino) == 0) {
-            char buffer[NOMBRE_LEN + MENSAJE_LEN + 16];
-            snprintf(buffer, sizeof(buffer), "[Privado de %s]: %s\n", origen, mensaje);
-            enviar(usuarios[i]->socket_fd, buffer);
-            pthread_mutex_unlock(&mutex_usuarios);
+// ----------------- Anillos io_uring -----------------
+// Cada trabajador tiene su anillo: acepta con un accept multishot sobre el
+// socket de escucha compartido, recibe con un recv multishot por conexión
+// que toma buffers de un anillo de buffers registrado, y los envíos de una
+// vuelta (todos los destinatarios de un broadcast, por ejemplo) salen en
+// una sola llamada a io_uring_enter. Solo el hilo dueño toca su anillo.
+
+#ifdef HAY_IO_URING
+
+#define ANILLO_ENTRADAS 4096
+#define BUFFERS_RECV 256       // por trabajador, de LECTURA_LEN bytes
+#define GRUPO_RECV 0
+
+// Lo que terminó va en los 2 bits bajos de user_data; el resto es el Usuario
+enum { OP_ACEPTAR, OP_RECIBIR, OP_ENVIAR };
+
+typedef struct Anillo {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_array, sq_mask, sq_entradas;
+    unsigned *cq_head, *cq_tail, cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void* mapa;
+    size_t mapa_len;
+    unsigned sq_local;         // tail con lo preparado y todavía no publicado
+    unsigned sin_enviar;       // SQEs que el kernel todavía no tomó
+    struct io_uring_buf_ring* bufs;
+    char* buffers;
+    unsigned short bufs_tail;
+    int escucha_fd;
+} Anillo;
+
+int anillo_enter(Anillo* a, unsigned esperar) {
+    __atomic_store_n(a->sq_tail, a->sq_local, __ATOMIC_RELEASE);
+    int r = (int)syscall(__NR_io_uring_enter, a->fd, a->sin_enviar, esperar,
+                         esperar ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (r > 0) a->sin_enviar -= (unsigned)r;
+    return r;
+}
+
+// Completados tomados del anillo y todavía sin atender
+typedef struct {
+    uint64_t user_data;
+    int res;
+    unsigned flags;
+} Completado;
+
+#define LOTE_MAX (2 * EVENTOS_POR_VUELTA)
+
+static __thread Completado* lote;
+static __thread int lote_num, lote_cap;
+
+// Pasa al lote, sin atenderlos, todos los completados del anillo; el lote
+// crece si hace falta. Devuelve cuántos tomó.
+int anillo_apartar(Anillo* a) {
+    int n = 0;
+    unsigned head;
+    while ((head = *a->cq_head) != __atomic_load_n(a->cq_tail, __ATOMIC_ACQUIRE)) {
+        if (lote_num == lote_cap) {
+            Completado* nuevo = realloc(lote, (size_t)lote_cap * 2 * sizeof(Completado));
+            if (!nuevo) break;
+            lote = nuevo;
+            lote_cap *= 2;
+        }
+        struct io_uring_cqe* cqe = &a->cqes[head & a->cq_mask];
+        lote[lote_num++] = (Completado){ cqe->user_data, cqe->res, cqe->flags };
+        __atomic_store_n(a->cq_head, head + 1, __ATOMIC_RELEASE);
+        n++;
+    }
+    return n;
+}
+
+// Un SQE libre y en cero; si la cola está llena, primero la manda. Con
+// IORING_FEAT_NODROP, EBUSY quiere decir que la cola de completados
+// desbordó y el kernel no toma más SQEs hasta que se lea algo: los
+// completados pasan al lote (acá no se pueden atender, se está en medio de
+// un envío) y se reintenta. Solo devuelve NULL si no hay memoria.
+struct io_uring_sqe* anillo_sqe(Anillo* a) {
+    while (a->sq_local - __atomic_load_n(a->sq_head, __ATOMIC_ACQUIRE) >= a->sq_entradas) {
+        if (anillo_enter(a, 0) >= 0 || errno == EINTR || errno == EAGAIN) continue;
+        if (errno != EBUSY || !anillo_apartar(a)) return NULL;
+    }
+    struct io_uring_sqe* sqe = &a->sqes[a->sq_local & a->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    a->sq_local++;
+    a->sin_enviar++;
+    return sqe;
+}
+
+void anillo_devolver_buffer(Anillo* a, unsigned bid) {
+    struct io_uring_buf* b = &a->bufs->bufs[a->bufs_tail & (BUFFERS_RECV - 1)];
+    b->addr = (uintptr_t)(a->buffers + (size_t)bid * LECTURA_LEN);
+    b->len = LECTURA_LEN;
+    b->bid = (unsigned short)bid;
+    a->bufs_tail++;
+    __atomic_store_n(&a->bufs->tail, a->bufs_tail, __ATOMIC_RELEASE);
+}
+
+int anillo_aceptar(Anillo* a) {
+    struct io_uring_sqe* sqe = anillo_sqe(a);
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = a->escucha_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = OP_ACEPTAR;
+    return 0;
+}
+
+int anillo_recibir(Anillo* a, int fd, uint64_t user_data) {
+    struct io_uring_sqe* sqe = anillo_sqe(a);
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = GRUPO_RECV;
+    sqe->user_data = user_data;
+    return 0;
+}
+
+void anillo_destruir(Anillo* a) {
+    if (a->fd >= 0) close(a->fd);
+    if (a->mapa) munmap(a->mapa, a->mapa_len);
+    if (a->sqes) munmap(a->sqes, a->sq_entradas * sizeof(struct io_uring_sqe));
+    if (a->bufs) munmap(a->bufs, BUFFERS_RECV * sizeof(struct io_uring_buf));
+    free(a->buffers);
+    free(a);
+}
+
+// Comprueba que el kernel soporte recv multishot con buffers del anillo:
+// los kernels anteriores a 6.0 aceptan todo lo demás y fallan recién acá
+int anillo_probar(Anillo* a) {
+    int par[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, par) < 0) return -1;
+    int ok = anillo_recibir(a, par[0], OP_RECIBIR) == 0 && write(par[1], "x", 1) == 1;
+    int recibido = 0, terminado = 0;
+    if (ok) shutdown(par[1], SHUT_WR);
+    while (ok && !terminado) {
+        if (anillo_enter(a, 1) < 0 && errno != EINTR) break;
+        unsigned head = *a->cq_head;
+        while (head != __atomic_load_n(a->cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe* cqe = &a->cqes[head & a->cq_mask];
+            if (cqe->res == 1) recibido = 1;
+            if (cqe->flags & IORING_CQE_F_BUFFER) anillo_devolver_buffer(a, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+            if (!(cqe->flags & IORING_CQE_F_MORE)) terminado = 1;
+            __atomic_store_n(a->cq_head, ++head, __ATOMIC_RELEASE);
+        }
+    }
+    close(par[0]);
+    close(par[1]);
+    return recibido && terminado ? 0 : -1;
+}
+
+Anillo* anillo_crear(int escucha_fd) {
+    Anillo* a = calloc(1, sizeof(Anillo));
+    if (!a) return NULL;
+    a->escucha_fd = escucha_fd;
+    // Los multishot generan muchas CQE por SQE: la cola de completados más grande
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = ANILLO_ENTRADAS * 4;
+    a->fd = (int)syscall(__NR_io_uring_setup, ANILLO_ENTRADAS, &p);
+    if (a->fd < 0 || !(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP)) {
+        anillo_destruir(a);
+        return NULL;
+    }
+    size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    a->mapa_len = sq_len > cq_len ? sq_len : cq_len;
+    a->mapa = mmap(NULL, a->mapa_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, a->fd, IORING_OFF_SQ_RING);
+    a->sq_entradas = p.sq_entries;
+    a->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, a->fd, IORING_OFF_SQES);
+    if (a->mapa == MAP_FAILED || a->sqes == MAP_FAILED) {
+        if (a->mapa == MAP_FAILED) a->mapa = NULL;
+        if (a->sqes == MAP_FAILED) a->sqes = NULL;
+        anillo_destruir(a);
+        return NULL;
+    }
+    char* m = a->mapa;
+    a->sq_head = (unsigned*)(m + p.sq_off.head);
+    a->sq_tail = (unsigned*)(m + p.sq_off.tail);
+    a->sq_mask = *(unsigned*)(m + p.sq_off.ring_mask);
+    a->sq_array = (unsigned*)(m + p.sq_off.array);
+    a->cq_head = (unsigned*)(m + p.cq_off.head);
+    a->cq_tail = (unsigned*)(m + p.cq_off.tail);
+    a->cq_mask = *(unsigned*)(m + p.cq_off.ring_mask);
+    a->cqes = (struct io_uring_cqe*)(m + p.cq_off.cqes);
+    for (unsigned i = 0; i < p.sq_entries; i++) a->sq_array[i] = i;
+    a->sq_local = *a->sq_tail;
+
+    // Anillo de buffers para los recv: el kernel elige uno libre por cada
+    // recepción y lo devolvemos apenas se procesó
+    a->bufs = mmap(NULL, BUFFERS_RECV * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    a->buffers = malloc((size_t)BUFFERS_RECV * LECTURA_LEN);
+    if (a->bufs == MAP_FAILED) a->bufs = NULL;
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t)a->bufs;
+    reg.ring_entries = BUFFERS_RECV;
+    reg.bgid = GRUPO_RECV;
+    if (!a->bufs || !a->buffers || syscall(__NR_io_uring_register, a->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        anillo_destruir(a);
+        return NULL;
+    }
+    for (unsigned i = 0; i < BUFFERS_RECV; i++) anillo_devolver_buffer(a, i);
+    if (anillo_probar(a) < 0) {
+        anillo_destruir(a);
+        return NULL;
+    }
+    return a;
+}
+
+// Prepara el envío de lo que está en cola; se llama con mutex_salida
+// tomado. Si no entra en un sendmsg, van varios enlazados (IOSQE_IO_LINK)
+// para que el kernel los ejecute en orden. Si uno sale corto, el kernel
+// cancela el resto de la cadena, así que el flujo nunca se desordena: lo
+// que no salió se vuelve a mandar en la próxima. Hay una sola cadena en
+// vuelo por usuario; lo que se encole mientras tanto también va ahí.
+void anillo_enviar(Anillo* a, Usuario* u) {
+    if (u->enviando || u->socket_fd < 0 || !u->salida_num) return;
+    if (!u->envio && !(u->envio = calloc(1, sizeof(EnvioUring)))) return;
+    EnvioUring* e = u->envio;
+    size_t max = ENVIOS_ENLAZADOS * IOV_POR_ENVIO;
+    size_t quiero = u->salida_num < max ? u->salida_num : max;
+    if (e->iov_cap < quiero) {
+        struct iovec* iov = realloc(e->iov, quiero * sizeof(struct iovec));
+        if (!iov) return;
+        e->iov = iov;
+        e->iov_cap = quiero;
+    }
+    int n = salida_iov(u, e->iov, (int)quiero);
+    int envios = (n + IOV_POR_ENVIO - 1) / IOV_POR_ENVIO;
+    for (int k = 0; k < envios; k++) {
+        struct io_uring_sqe* sqe = anillo_sqe(a);
+        if (!sqe) {
+            // Sin lugar: la cadena queda más corta, el resto va en la próxima
+            if (k > 0) a->sqes[(a->sq_local - 1) & a->sq_mask].flags &= ~IOSQE_IO_LINK;
+            break;
+        }
+        memset(&e->msg[k], 0, sizeof(e->msg[k]));
+        e->msg[k].msg_iov = e->iov + k * IOV_POR_ENVIO;
+        e->msg[k].msg_iovlen = k == envios - 1 ? (size_t)(n - k * IOV_POR_ENVIO) : IOV_POR_ENVIO;
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = u->socket_fd;
+        sqe->addr = (uintptr_t)&e->msg[k];
+        sqe->len = 1;
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+        if (k < envios - 1) sqe->flags = IOSQE_IO_LINK;
+        sqe->user_data = (uintptr_t)u | OP_ENVIAR;
+        u->enviando++;
+        usuario_ref(u);
+    }
+}
+
+#else
+
+typedef struct Anillo Anillo;
+void anillo_enviar(Anillo* a, Usuario* u) { (void)a; (void)u; }
+
+#endif
+
+// Manda lo encolado con el motor del hilo; con mutex_salida tomado
+void salida_empujar(Usuario* u) {
+    if (trabajador_actual && trabajador_actual->anillo) {
+        anillo_enviar(trabajador_actual->anillo, u);
+    } else {
+        vaciar_salida(u);
+    }
+}
+
+// Usuarios con mensajes encolados por este hilo; se mandan todos juntos al
+// terminar la vuelta de epoll, fuera de mutex_usuarios
+static __thread Usuario** por_vaciar;
+static __thread size_t num_por_vaciar, cap_por_vaciar;
+
+void vaciar_pendientes() {
+    for (size_t i = 0; i < num_por_vaciar; i++) {
+        Usuario* u = por_vaciar[i];
+        pthread_mutex_lock(&u->mutex_salida);
+        u->por_vaciar = 0;
+        salida_empujar(u);
+        pthread_mutex_unlock(&u->mutex_salida);
+        usuario_soltar(u);
+    }
+    num_por_vaciar = 0;
+}
+
+// Solo agrega el mensaje a la cola del usuario: el envío se hace en
+// vaciar_pendientes, así que se puede llamar con mutex_usuarios tomado y un
+// cliente lento nunca frena al que manda. Si el cliente no lee y la cola
+// pasa de SALIDA_MAX, se corta la conexión (su trabajador la cierra).
+void encolar(Usuario* u, Bloque* b) {
+    pthread_mutex_lock(&u->mutex_salida);
+    if (u->socket_fd < 0) {
+        pthread_mutex_unlock(&u->mutex_salida);
+        return;
+    }
+    if (u->salida_bytes + b->len > SALIDA_MAX) {
+        shutdown(u->socket_fd, SHUT_RDWR);
+        pthread_mutex_unlock(&u->mutex_salida);
+        return;
+    }
+    if (u->salida_num == u->salida_cap) {
+        size_t cap = u->salida_cap ? u->salida_cap * 2 : 8;
+        Bloque** salida = malloc(cap * sizeof(Bloque*));
+        if (!salida) {
+            pthread_mutex_unlock(&u->mutex_salida);
             return;
         }
+        for (size_t i = 0; i < u->salida_num; i++) salida[i] = u->salida[(u->salida_inicio + i) % u->salida_cap];
+        free(u->salida);
+        u->salida = salida;
+        u->salida_inicio = 0;
+        u->salida_cap = cap;
+    }
+    __atomic_fetch_add(&b->refs, 1, __ATOMIC_RELAXED);
+    u->salida[(u->salida_inicio + u->salida_num) % u->salida_cap] = b;
+    u->salida_num++;
+    u->salida_bytes += b->len;
+    if (!u->por_vaciar) {
+        if (num_por_vaciar == cap_por_vaciar) {
+            size_t cap = cap_por_vaciar ? cap_por_vaciar * 2 : 64;
+            Usuario** lista = realloc(por_vaciar, cap * sizeof(Usuario*));
+            if (lista) {
+                por_vaciar = lista;
+                cap_por_vaciar = cap;
+            }
+        }
+        if (num_por_vaciar < cap_por_vaciar) {
+            u->por_vaciar = 1;
+            usuario_ref(u);
+            por_vaciar[num_por_vaciar++] = u;
+        } else {
+            salida_empujar(u);   // sin memoria para la lista: mandar ya
+        }
+    }
+    pthread_mutex_unlock(&u->mutex_salida);
+}
+
+void enviar(Usuario* u, const char* msg) {
+    Bloque* b = bloque_nuevo(msg, strlen(msg));
+    if (!b) return;
+    encolar(u, b);
+    bloque_soltar(b);
+}
+
+void broadcast(char* mensaje, Usuario* emisor) {
+    Bloque* b = bloque_nuevo(mensaje, strlen(mensaje));
+    if (!b) return;
+    pthread_mutex_lock(&mutex_usuarios);
+    for (size_t i = 0; i < num_usuarios; i++) {
+        if (usuarios[i] != emisor) {
+            encolar(usuarios[i], b);
+        }
     }
     pthread_mutex_unlock(&mutex_usuarios);
+    bloque_soltar(b);
 }
 
-void eliminar_usuario(int fd) {
+void mensaje_directo(char* destino, char* mensaje, char* origen) {
+    char buffer[NOMBRE_LEN + MENSAJE_LEN + 16];
+    snprintf(buffer, sizeof(buffer), "[Privado de %s]: %s\n", origen, mensaje);
     pthread_mutex_lock(&mutex_usuarios);
-    for (int i = 0; i < MAX_CLIENTES; i++) {
-        if (usuarios[i] && usuarios[i]->socket_fd == fd) {
-            close(fd);
-            free(usuarios[i]);
-            usuarios[i] = NULL;
+    for (size_t i = 0; i < num_usuarios; i++) {
+        if (strcmp(usuarios[i]->nombre, destino) == 0) {
+            enviar(usuarios[i], buffer);
             break;
         }
     }
     pthread_mutex_unlock(&mutex_usuarios);
 }
 
+void eliminar_usuario(Usuario* u) {
+    pthread_mutex_lock(&mutex_usuarios);
+    Usuario* ultimo = usuarios[--num_usuarios];
+    usuarios[u->indice] = ultimo;
+    ultimo->indice = u->indice;
+    u->registrado = 0;
+    pthread_mutex_unlock(&mutex_usuarios);
+}
+
 int nombre_duplicado(const char* nombre) {
-    for (int i = 0; i < MAX_CLIENTES; i++) {
-        if (usuarios[i] && strcmp(usuarios[i]->nombre, nombre) == 0) {
+    for (size_t i = 0; i < num_usuarios; i++) {
+        if (strcmp(usuarios[i]->nombre, nombre) == 0) {
             return 1;
         }
     }
     return 0;
 }
 
-void listar_usuarios(int fd) {
+// Comprueba el nombre y agrega al usuario en una sola toma del lock, para
+// que dos conexiones no puedan registrar el mismo nombre a la vez
+int agregar_usuario(Usuario* u) {
+    int rc = 0;
     pthread_mutex_lock(&mutex_usuarios);
-    enviar(fd, "Usuarios conectados:\n");
-    for (int i = 0; i < MAX_CLIENTES; i++) {
-        if (usuarios[i]) {
-            char buffer[128];
-            snprintf(buffer, sizeof(buffer), "- %s [%s]\n", usuarios[i]->nombre, usuarios[i]->estado);
-            enviar(fd, buffer);
+    if (nombre_duplicado(u->nombre)) {
+        rc = -1;
+    } else {
+        if (num_usuarios == cap_usuarios) {
+            size_t cap = cap_usuarios ? cap_usuarios * 2 : 256;
+            Usuario** lista = realloc(usuarios, cap * sizeof(Usuario*));
+            if (lista) {
+                usuarios = lista;
+                cap_usuarios = cap;
+            }
+        }
+        if (num_usuarios < cap_usuarios) {
+            u->indice = num_usuarios;
+            usuarios[num_usuarios++] = u;
+            u->registrado = 1;
+        } else {
+            rc = -1;
+        }
+    }
+    pthread_mutex_unlock(&mutex_usuarios);
+    return rc;
+}
+
+// Usuarios de este hilo con una lista a medio encolar
+static __thread Usuario** listando;
+static __thread size_t num_listando, cap_listando;
+
+// Encola el trozo siguiente de la lista de u si su salida tiene lugar.
+// Devuelve 1 si encoló algo y -1 si la lista terminó (o la conexión se
+// cerró); 0 si hay que esperar a que se vacíe la salida.
+int lista_continuar(Usuario* u) {
+    pthread_mutex_lock(&u->mutex_salida);
+    int cerrado = u->socket_fd < 0 || u->cerrando;
+    size_t pendiente = u->salida_bytes;
+    pthread_mutex_unlock(&u->mutex_salida);
+    if (!cerrado && pendiente >= LISTA_TROZO) return 0;
+    if (!cerrado) {
+        size_t n = u->lista_len - u->lista_pos;
+        if (n > LISTA_TROZO) n = LISTA_TROZO;
+        Bloque* b = bloque_nuevo(u->lista + u->lista_pos, n);
+        if (!b) return 0;
+        encolar(u, b);
+        bloque_soltar(b);
+        u->lista_pos += n;
+        if (u->lista_pos < u->lista_len) return 1;
+    }
+    free(u->lista);
+    u->lista = NULL;
+    return cerrado ? -1 : 1;
+}
+
+// Avanza las listas de este hilo; devuelve cuántos trozos encoló. Se
+// llama después de vaciar_pendientes, cuando las salidas ya se movieron.
+size_t listas_continuar() {
+    size_t encolados = 0;
+    for (size_t i = 0; i < num_listando;) {
+        Usuario* u = listando[i];
+        int rc = lista_continuar(u);
+        if (rc > 0) encolados++;
+        if (u->lista) {
+            i++;
+            continue;
+        }
+        listando[i] = listando[--num_listando];
+        usuario_soltar(u);
+    }
+    return encolados;
+}
+
+// La lista se arma entera al pedirla, pero sale de a LISTA_TROZO bytes a
+// medida que el cliente lee: con miles de usuarios no cabría de una vez en
+// SALIDA_MAX. Mientras sale una, otro /usuarios del mismo cliente se ignora.
+void listar_usuarios(Usuario* u) {
+    if (u->lista) return;
+    if (num_listando == cap_listando) {
+        size_t cap = cap_listando ? cap_listando * 2 : 16;
+        Usuario** lista = realloc(listando, cap * sizeof(Usuario*));
+        if (!lista) return;
+        listando = lista;
+        cap_listando = cap;
+    }
+    pthread_mutex_lock(&mutex_usuarios);
+    size_t cap = 32 + num_usuarios * (NOMBRE_LEN + 16);
+    char* lista = malloc(cap);
+    size_t len = 0;
+    if (lista) {
+        len = (size_t)snprintf(lista, cap, "Usuarios conectados:\n");
+        for (size_t i = 0; i < num_usuarios; i++) {
+            len += (size_t)snprintf(lista + len, cap - len, "- %s [%s]\n", usuarios[i]->nombre, usuarios[i]->estado);
         }
     }
     pthread_mutex_unlock(&mutex_usuarios);
+    if (!lista) return;
+    u->lista = lista;
+    u->lista_len = len;
+    u->lista_pos = 0;
+    usuario_ref(u);
+    listando[num_listando++] = u;
+    lista_continuar(u);
 }
 
-void info_usuario(int fd, char* nombre) {
+void info_usuario(Usuario* u, char* nombre) {
     pthread_mutex_lock(&mutex_usuarios);
-    for (int i = 0; i < MAX_CLIENTES; i++) {
-        if (usuarios[i] && strcmp(usuarios[i]->nombre, nombre) == 0) {
+    for (size_t i = 0; i < num_usuarios; i++) {
+        if (strcmp(usuarios[i]->nombre, nombre) == 0) {
             char buffer[128];
             snprintf(buffer, sizeof(buffer), "%s está en estado %s con IP %s\n", nombre, usuarios[i]->estado, usuarios[i]->ip);
-            enviar(fd, buffer);
+            enviar(u, buffer);
             pthread_mutex_unlock(&mutex_usuarios);
             return;
         }
     }
-    enviar(fd, "Usuario no encontrado.\n");
+    enviar(u, "Usuario no encontrado.\n");
     pthread_mutex_unlock(&mutex_usuarios);
 }
 
-void cambiar_estado(int fd, char* estado) {
+void cambiar_estado(Usuario* u, char* estado) {
     pthread_mutex_lock(&mutex_usuarios);
-    for (int i = 0; i < MAX_CLIENTES; i++) {
-        if (usuarios[i] && usuarios[i]->socket_fd == fd) {
-            strcpy(usuarios[i]->estado, estado);
-            usuarios[i]->ultima_actividad = time(NULL);
-            break;
+    snprintf(u->estado, sizeof(u->estado), "%s", estado);
+    u->ultima_actividad = time(NULL);
+    pthread_mutex_unlock(&mutex_usuarios);
+}
+
+// El primer mensaje de la conexión es el nombre. Devuelve -1 si hay que cerrarla.
+int registrar(Usuario* u, char* nombre) {
+    snprintf(u->nombre, NOMBRE_LEN, "%s", nombre);
+    if (u->nombre[0] == '\0' || agregar_usuario(u) < 0) {
+        enviar(u, "Nombre de usuario inválido o duplicado.\n");
+        return -1;
+    }
+    char msg[MENSAJE_LEN];
+    snprintf(msg, sizeof(msg), "%s se ha unido al chat.\n", u->nombre);
+    broadcast(msg, u);
+    return 0;
+}
+
+// Devuelve -1 si el cliente pidió salir
+int manejar_comando(Usuario* u, char* buffer) {
+    u->ultima_actividad = time(NULL);
+
+    if (strncmp(buffer, "/usuarios", 9) == 0) {
+        listar_usuarios(u);
+    } else if (strncmp(buffer, "/info ", 6) == 0) {
+        info_usuario(u, buffer + 6);
+    } else if (strncmp(buffer, "/estado ", 8) == 0) {
+        cambiar_estado(u, buffer + 8);
+    } else if (strncmp(buffer, "/salir", 6) == 0) {
+        return -1;
+    } else if (buffer[0] == '@') {
+        char* espacio = strchr(buffer, ' ');
+        if (espacio) {
+            *espacio = '\0';
+            char* destino = buffer + 1;
+            char* mensaje = espacio + 1;
+            mensaje_directo(destino, mensaje, u->nombre);
         }
+    } else {
+        char mensaje_final[NOMBRE_LEN + MENSAJE_LEN + 16];
+        snprintf(mensaje_final, sizeof(mensaje_final), "%s: %s\n", u->nombre, buffer);
+        broadcast(mensaje_final, u);
     }
-    pthread_mutex_unlock(&mutex_usuarios);
+    return 0;
 }
 
-void* manejar_cliente(void* arg) {
-    int cliente_fd = *((int*)arg);
-    free(arg);
+int manejar_linea(Usuario* u, char* linea, size_t len) {
+    if (len && linea[len - 1] == '\r') linea[--len] = '\0';
+    if (len == 0) return 0;
+    return u->registrado ? manejar_comando(u, linea) : registrar(u, linea);
+}
 
-    char buffer[MENSAJE_LEN];
-    char nombre[NOMBRE_LEN];
+// Separa los datos recibidos en líneas. Las completas se manejan sin
+// copiarlas; solo el pedazo final sin terminar pasa a u->entrada.
+int procesar_datos(Usuario* u, char* datos, size_t len) {
+    while (len) {
+        char* fin = memchr(datos, '\n', len);
+        char* nul = memchr(datos, '\0', fin ? (size_t)(fin - datos) : len);
+        if (nul) fin = nul;
+        size_t parte = fin ? (size_t)(fin - datos) : len;
 
-    int len = recv(cliente_fd, nombre, NOMBRE_LEN, 0);
-    if (len <= 0 || nombre_duplicado(nombre)) {
-        enviar(cliente_fd, "Nombre de usuario inválido o duplicado.\n");
-        close(cliente_fd);
-        return NULL;
+        if (!u->descartando && u->entrada_len + parte >= MENSAJE_LEN) {
+            u->descartando = 1;
+            u->entrada_len = 0;
+            enviar(u, "Mensaje demasiado largo.\n");
+        }
+        if (!fin) {
+            if (!u->descartando) {
+                if (!u->entrada && !(u->entrada = malloc(MENSAJE_LEN))) return -1;
+                memcpy(u->entrada + u->entrada_len, datos, parte);
+                u->entrada_len += parte;
+            }
+            return 0;
+        }
+
+        *fin = '\0';
+        int rc = 0;
+        if (u->descartando) {
+            u->descartando = 0;
+        } else if (u->entrada_len) {
+            memcpy(u->entrada + u->entrada_len, datos, parte + 1);
+            rc = manejar_linea(u, u->entrada, u->entrada_len + parte);
+            u->entrada_len = 0;
+        } else {
+            rc = manejar_linea(u, datos, parte);
+        }
+        if (rc < 0) return -1;
+        datos += parte + 1;
+        len -= parte + 1;
     }
+    return 0;
+}
 
-    Usuario* nuevo = (Usuario*)malloc(sizeof(Usuario));
-    nuevo->socket_fd = cliente_fd;
-    strncpy(nuevo->nombre, nombre, NOMBRE_LEN);
-    strcpy(nuevo->estado, "ACTIVO");
-    nuevo->ultima_actividad = time(NULL);
+// Con epoll por flanco hay que leer hasta EAGAIN: no vuelve a avisar por
+// lo que ya estaba en el socket. Devuelve -1 si hay que cerrar la conexión.
+int leer_cliente(Usuario* u) {
+    char buffer[LECTURA_LEN];
+    while (1) {
+        ssize_t len = recv(u->socket_fd, buffer, sizeof(buffer), 0);
+        if (len > 0) {
+            int rc = procesar_datos(u, buffer, (size_t)len);
+            // Lo encolado por esta lectura sale ya, en un envío por
+            // destinatario; esperar al final de la vuelta dejaría crecer
+            // las colas con un cliente que manda mucho de una vez
+            vaciar_pendientes();
+            if (rc < 0) return -1;
+            continue;
+        }
+        if (len < 0 && errno == EINTR) continue;
+        if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+        return -1;
+    }
+}
 
+void cerrar_cliente(Trabajador* t, Usuario* u) {
+    if (u->registrado) {
+        eliminar_usuario(u);
+        char msg[MENSAJE_LEN];
+        snprintf(msg, sizeof(msg), "%s ha salido del chat.\n", u->nombre);
+        broadcast(msg, u);
+    }
+    // Ya no está en la lista: nadie más le encola. Lo último que quedó
+    // (por ejemplo, el error de nombre duplicado) sale si el socket lo acepta.
+    if (t->anillo) {
+        vaciar_pendientes();
+        pthread_mutex_lock(&u->mutex_salida);
+        u->cerrando = 1;
+        shutdown(u->socket_fd, SHUT_RD);   // termina el recv multishot
+        // Con un envío en vuelo el socket se cierra cuando termine
+        if (!u->enviando) {
+            salida_limpiar(u);
+            close(u->socket_fd);
+            u->socket_fd = -1;
+        }
+        pthread_mutex_unlock(&u->mutex_salida);
+        usuario_soltar(u);
+        return;
+    }
+    epoll_ctl(t->epfd, EPOLL_CTL_DEL, u->socket_fd, NULL);
+    pthread_mutex_lock(&u->mutex_salida);
+    vaciar_salida(u);
+    salida_limpiar(u);
+    close(u->socket_fd);
+    u->socket_fd = -1;
+    pthread_mutex_unlock(&u->mutex_salida);
+    usuario_soltar(u);
+}
+
+Usuario* usuario_nuevo(int fd, const struct sockaddr_in* addr) {
+    Usuario* u = calloc(1, sizeof(Usuario));
+    if (!u) return NULL;
+    u->socket_fd = fd;
+    u->refs = 1;   // la del trabajador dueño
+    strcpy(u->estado, "ACTIVO");
+    u->ultima_actividad = time(NULL);
+    pthread_mutex_init(&u->mutex_salida, NULL);
+    inet_ntop(AF_INET, &addr->sin_addr, u->ip, sizeof(u->ip));
+    return u;
+}
+
+#ifdef HAY_IO_URING
+
+void uring_aceptado(Anillo* a, int fd) {
     struct sockaddr_in addr;
     socklen_t addr_len = sizeof(addr);
-    getpeername(cliente_fd, (struct sockaddr*)&addr, &addr_len);
-    inet_ntop(AF_INET, &addr.sin_addr, nuevo->ip, sizeof(nuevo->ip));
+    memset(&addr, 0, sizeof(addr));
+    getpeername(fd, (struct sockaddr*)&addr, &addr_len);
+    Usuario* u = usuario_nuevo(fd, &addr);
+    if (!u) {
+        close(fd);
+        return;
+    }
+    usuario_ref(u);   // la del recv multishot
+    if (anillo_recibir(a, fd, (uintptr_t)u | OP_RECIBIR) < 0) {
+        close(fd);
+        usuario_soltar(u);
+        usuario_soltar(u);
+    }
+}
 
-    pthread_mutex_lock(&mutex_usuarios);
-    for (int i = 0; i < MAX_CLIENTES; i++) {
-        if (usuarios[i] == NULL) {
-            usuarios[i] = nuevo;
+void uring_atender(Trabajador* t);
+
+void uring_recibido(Trabajador* t, Usuario* u, int res, unsigned flags) {
+    Anillo* a = t->anillo;
+    if (res > 0 && (flags & IORING_CQE_F_BUFFER)) {
+        unsigned bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        int rc = u->cerrando ? 0 : procesar_datos(u, a->buffers + (size_t)bid * LECTURA_LEN, (size_t)res);
+        anillo_devolver_buffer(a, bid);
+        // Los envíos de este pedazo salen ya, en una sola llamada para
+        // todos los destinatarios, como hace epoll después de cada recv
+        vaciar_pendientes();
+        uring_atender(t);
+        if (rc < 0) cerrar_cliente(t, u);
+    }
+    if (flags & IORING_CQE_F_MORE) return;
+    // El recv multishot terminó. Si fue por falta de buffers se vuelve a
+    // armar; si no, es el fin de la conexión.
+    if (res == -ENOBUFS && !u->cerrando && anillo_recibir(a, u->socket_fd, (uintptr_t)u | OP_RECIBIR) == 0) return;
+    if (!u->cerrando) cerrar_cliente(t, u);
+    usuario_soltar(u);
+}
+
+// Los envíos de una cadena terminan en orden; con el último se decide
+// qué sigue
+void uring_enviado(Anillo* a, Usuario* u, int res) {
+    pthread_mutex_lock(&u->mutex_salida);
+    u->enviando--;
+    if (res > 0 && !u->envio_fallido) {
+        salida_avanzar(u, (size_t)res);
+    } else if (res != -ECANCELED) {
+        u->envio_fallido = 1;
+    }
+    if (u->enviando) {
+        pthread_mutex_unlock(&u->mutex_salida);
+        usuario_soltar(u);
+        return;
+    }
+    // Después de un error no se manda nada más; el dueño lo verá en el recv
+    if (u->envio_fallido) {
+        salida_limpiar(u);
+        if (u->socket_fd >= 0 && !u->cerrando) shutdown(u->socket_fd, SHUT_RDWR);
+    }
+    if (u->cerrando && (u->envio_fallido || !u->salida_num)) {
+        salida_limpiar(u);
+        close(u->socket_fd);
+        u->socket_fd = -1;
+    } else {
+        anillo_enviar(a, u);
+    }
+    pthread_mutex_unlock(&u->mutex_salida);
+    usuario_soltar(u);
+}
+
+void uring_completado(Trabajador* t, const Completado* c) {
+    Anillo* a = t->anillo;
+    Usuario* u = (Usuario*)(uintptr_t)(c->user_data & ~(uint64_t)3);
+    switch (c->user_data & 3) {
+        case OP_ACEPTAR:
+            if (c->res >= 0) {
+                uring_aceptado(a, c->res);
+            } else if (c->res == -EMFILE || c->res == -ENFILE) {
+                usleep(10000);
+            }
+            if (!(c->flags & IORING_CQE_F_MORE)) anillo_aceptar(a);
+            break;
+        case OP_RECIBIR:
+            uring_recibido(t, u, c->res, c->flags);
             break;
+        case OP_ENVIAR:
+            uring_enviado(a, u, c->res);
+            break;
+    }
+}
+
+// Manda lo preparado y toma lo que haya terminado. Los envíos se atienden
+// en el momento; lo demás queda en el lote. Así una cadena terminada deja
+// lugar a la siguiente antes de seguir con la entrada que el recv multishot
+// ya leyó por adelantado, y las colas de salida solo crecen por clientes
+// que de verdad no leen.
+void uring_atender(Trabajador* t) {
+    Anillo* a = t->anillo;
+    anillo_enter(a, 0);
+    // La cabeza se vuelve a leer en cada vuelta: un envío atendido acá
+    // puede pedir un SQE y anillo_sqe mover la cola de completados
+    unsigned head;
+    while ((head = *a->cq_head) != __atomic_load_n(a->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe* cqe = &a->cqes[head & a->cq_mask];
+        Completado c = { cqe->user_data, cqe->res, cqe->flags };
+        if ((c.user_data & 3) != OP_ENVIAR) {
+            if (lote_num >= LOTE_MAX) break;
+            lote[lote_num++] = c;
         }
+        __atomic_store_n(a->cq_head, ++head, __ATOMIC_RELEASE);
+        if ((c.user_data & 3) == OP_ENVIAR) uring_completado(t, &c);
     }
-    pthread_mutex_unlock(&mutex_usuarios);
+}
 
-    char msg[MENSAJE_LEN];
-    snprintf(msg, sizeof(msg), "%s se ha unido al chat.\n", nombre);
-    broadcast(msg, cliente_fd);
-
-    while ((len = recv(cliente_fd, buffer, MENSAJE_LEN, 0)) > 0) {
-        buffer[len] = '\0';
-        nuevo->ultima_actividad = time(NULL);
-
-        if (strncmp(buffer, "/usuarios", 9) == 0) {
-            listar_usuarios(cliente_fd);
-        } else if (strncmp(buffer, "/info ", 6) == 0) {
-            info_usuario(cliente_fd, buffer + 6);
-        } else if (strncmp(buffer, "/estado ", 8) == 0) {
-            cambiar_estado(cliente_fd, buffer + 8);
-        } else if (strncmp(buffer, "/salir", 6) == 0) {
+void* trabajador_uring(Trabajador* t) {
+    Anillo* a = t->anillo;
+    lote_cap = LOTE_MAX;
+    lote = malloc(lote_cap * sizeof(Completado));
+    if (!lote || anillo_aceptar(a) < 0) return NULL;
+    while (1) {
+        // Una sola llamada manda todo lo preparado en la vuelta anterior
+        // (los envíos de cada broadcast) y espera lo siguiente. No espera si
+        // quedaron completados apartados por anillo_sqe. Con EBUSY la cola
+        // de completados desbordó: hay que leerla igual.
+        if (anillo_enter(a, lote_num ? 0 : 1) < 0 &&
+            errno != EINTR && errno != EBUSY && errno != EAGAIN) {
+            perror("io_uring_enter");
             break;
-        } else if (buffer[0] == '@') {
-            char* espacio = strchr(buffer, ' ');
-            if (espacio) {
-                *espacio = '\0';
-                char* destino = buffer + 1;
-                char* mensaje = espacio + 1;
-                mensaje_directo(destino, mensaje, nombre);
-            }
-        } else {
-            char mensaje_final[NOMBRE_LEN + MENSAJE_LEN + 16];
-            snprintf(mensaje_final, sizeof(mensaje_final), "%s: %s", nombre, buffer);
-            broadcast(mensaje_final, cliente_fd);
         }
+        uring_atender(t);
+        // Copia: atender uno puede hacer crecer (y mover) el lote
+        for (int i = 0; i < lote_num; i++) {
+            Completado c = lote[i];
+            uring_completado(t, &c);
+        }
+        lote_num = 0;
+        vaciar_pendientes();
+        if (listas_continuar()) vaciar_pendientes();
     }
+    return NULL;
+}
 
-    snprintf(msg, sizeof(msg), "%s ha salido del chat.\n", nombre);
-    broadcast(msg, cliente_fd);
-    eliminar_usuario(cliente_fd);
+#endif
+
+void* trabajador(void* arg) {
+    Trabajador* t = arg;
+    trabajador_actual = t;
+#ifdef HAY_IO_URING
+    if (t->anillo) return trabajador_uring(t);
+#endif
+    struct epoll_event eventos[EVENTOS_POR_VUELTA];
+    while (1) {
+        int n = epoll_wait(t->epfd, eventos, EVENTOS_POR_VUELTA, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            Usuario* u = eventos[i].data.ptr;
+            uint32_t ev = eventos[i].events;
+            if (ev & EPOLLOUT) {
+                pthread_mutex_lock(&u->mutex_salida);
+                vaciar_salida(u);
+                pthread_mutex_unlock(&u->mutex_salida);
+            }
+            if ((ev & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) && leer_cliente(u) < 0) {
+                cerrar_cliente(t, u);
+            }
+        }
+        // Las listas siguen mientras el socket acepte; cuando se llene,
+        // EPOLLOUT despierta al hilo para el trozo siguiente
+        do {
+            vaciar_pendientes();
+        } while (listas_continuar());
+    }
     return NULL;
 }
 
+// Con decenas de miles de conexiones el límite por defecto (1024) no alcanza
+void subir_limite_descriptores() {
+    struct rlimit lim;
+    if (getrlimit(RLIMIT_NOFILE, &lim) == 0 && lim.rlim_cur < lim.rlim_max) {
+        lim.rlim_cur = lim.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &lim);
+    }
+}
+
 int main(int argc, char* argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Uso: %s <puerto>\n", argv[0]);
+    if (argc < 2 || argc > 4 || (argc == 4 && strcmp(argv[3], "epoll") != 0 && strcmp(argv[3], "uring") != 0)) {
+        fprintf(stderr, "Uso: %s <puerto> [hilos] [epoll|uring]\n", argv[0]);
         exit(1);
     }
 
     int puerto = atoi(argv[1]);
-    int servidor_fd = socket(AF_INET, SOCK_STREAM, 0);
+    num_trabajadores = argc >= 3 ? atoi(argv[2]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_trabajadores < 1) num_trabajadores = 1;
+    int usar_uring = argc == 4 && strcmp(argv[3], "uring") == 0;
+
+    signal(SIGPIPE, SIG_IGN);
+    subir_limite_descriptores();
+
+    int servidor_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
     if (servidor_fd < 0) {
         perror("socket");
         exit(1);
@@ -231,30 +1112,83 @@ int main(int argc, char* argv[]) {
         exit(1);
     }
 
-    if (listen(servidor_fd, 10) < 0) {
+    if (listen(servidor_fd, SOMAXCONN) < 0) {
         perror("listen");
         exit(1);
     }
 
+    trabajadores = calloc(num_trabajadores, sizeof(Trabajador));
+    if (!trabajadores) exit(1);
+#ifdef HAY_IO_URING
+    // Si algún anillo no se puede crear, todos usan epoll
+    for (int i = 0; usar_uring && i < num_trabajadores; i++) {
+        trabajadores[i].anillo = anillo_crear(servidor_fd);
+        if (!trabajadores[i].anillo) {
+            for (int j = 0; j < i; j++) {
+                anillo_destruir(trabajadores[j].anillo);
+                trabajadores[j].anillo = NULL;
+            }
+            usar_uring = 0;
+        }
+    }
+#else
+    usar_uring = 0;
+#endif
+    if (argc == 4 && strcmp(argv[3], "uring") == 0 && !usar_uring) {
+        fprintf(stderr, "io_uring no disponible en este kernel; se usa epoll\n");
+    }
+    for (int i = 0; i < num_trabajadores; i++) {
+        if (!usar_uring) {
+            trabajadores[i].epfd = epoll_create1(EPOLL_CLOEXEC);
+            if (trabajadores[i].epfd < 0) {
+                perror("epoll_create1");
+                exit(1);
+            }
+        }
+        pthread_create(&trabajadores[i].hilo, NULL, trabajador, &trabajadores[i]);
+    }
+
     pthread_t monitor;
     pthread_create(&monitor, NULL, monitor_inactividad, NULL);
 
-    printf("Servidor escuchando en el puerto %d...\n", puerto);
+    printf("Servidor escuchando en el puerto %d con %d hilos (%s)...\n", puerto, num_trabajadores,
+           usar_uring ? "io_uring" : "epoll");
 
+    if (usar_uring) {
+        // Cada trabajador acepta por su cuenta
+        for (int i = 0; i < num_trabajadores; i++) pthread_join(trabajadores[i].hilo, NULL);
+        close(servidor_fd);
+        return 1;
+    }
+
+    // Este hilo solo acepta y reparte en ronda entre los trabajadores
+    int siguiente = 0;
     while (1) {
         struct sockaddr_in cliente_addr;
         socklen_t cliente_len = sizeof(cliente_addr);
-        int* cliente_fd = malloc(sizeof(int));
-        *cliente_fd = accept(servidor_fd, (struct sockaddr*)&cliente_addr, &cliente_len);
-        if (*cliente_fd < 0) {
+        int cliente_fd = accept4(servidor_fd, (struct sockaddr*)&cliente_addr, &cliente_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (cliente_fd < 0) {
             perror("accept");
-            free(cliente_fd);
+            // Sin descriptores libres: esperar a que se cierre alguno
+            if (errno == EMFILE || errno == ENFILE) usleep(10000);
+            continue;
+        }
+
+        Usuario* nuevo = usuario_nuevo(cliente_fd, &cliente_addr);
+        if (!nuevo) {
+            close(cliente_fd);
             continue;
         }
 
-        pthread_t tid;
-        pthread_create(&tid, NULL, manejar_cliente, cliente_fd);
-        pthread_detach(tid);
+        Trabajador* t = &trabajadores[siguiente];
+        siguiente = (siguiente + 1) % num_trabajadores;
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = nuevo };
+        if (epoll_ctl(t->epfd, EPOLL_CTL_ADD, cliente_fd, &ev) < 0) {
+            perror("epoll_ctl");
+            close(cliente_fd);
+            pthread_mutex_destroy(&nuevo->mutex_salida);
+            free(nuevo);
+        }
     }
 
     close(servidor_fd);
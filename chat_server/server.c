@@ -4,13 +4,24 @@
 
  #include <stdio.h>
  #include <stdlib.h>
+ #include <stdint.h>
+ #include <stddef.h>
  #include <string.h>
+ #include <ctype.h>
  #include <time.h>
  #include <pthread.h>
  #include <signal.h>
  #include <arpa/inet.h>
  #include <unistd.h>
  #include <errno.h>
+ #include <getopt.h>
+ #include <fcntl.h>
+ #include <sys/uio.h>
+ #include <sys/mman.h>
+ #include <sys/stat.h>
+ #include <dirent.h>
+ #include <netinet/in.h>
+ #include <linux/tcp.h>      // struct tcp_info con tcpi_bytes_acked
  #include <libwebsockets.h>
  #include <cjson/cJSON.h>
 
@@ -19,340 +30,4064 @@
  
 void get_timestamp(char *buffer, size_t len);
 
+ #define BUFFER_SIZE 2048
+ #define MAX_MESSAGE_SIZE (64 * 1024)   // mensaje entrante reensamblado
+ #define MAX_STATUS_LEN 10
+ #define INACTIVITY_TIMEOUT 60
+ 
+ #define STATUS_ACTIVE   "ACTIVO"
+ #define STATUS_BUSY     "OCUPADO"
+ #define STATUS_INACTIVE "INACTIVO"
+
+ #define CHANNEL_NAME_MAX 32            // incluye el '\0'
+ #define CLIENT_MAX_CHANNELS 16         // canales por cliente
+ #define GLOBAL_CHANNEL "general"       // el de los broadcasts: todos están
+
+ void get_timestamp(char *buffer, size_t len);  // ← Esta línea soluciona el warning
+
+ // Qué hacer cuando la cola de salida de un cliente lento se llena
+ typedef enum {
+     SLOW_DROP_OLDEST,   // descartar el mensaje más viejo en cola
+     SLOW_DROP_NEWEST,   // descartar el mensaje nuevo
+     SLOW_DISCONNECT     // cerrar la conexión
+ } SlowPolicy;
+
+ // Niveles de la bitácora; LOG_LVL_BODY incluye el texto de los mensajes
+ typedef enum {
+     LOG_LVL_ERROR,
+     LOG_LVL_INFO,
+     LOG_LVL_BODY
+ } LogLevel;
+
+ // Configuración del servidor (línea de comandos)
+ static struct {
+     int port;
+     size_t queue_max;         // mensajes máximos en cola por cliente
+     SlowPolicy slow_policy;
+     int threads;              // hilos de servicio (shards)
+     LogLevel log_level;
+     const char *log_path;
+     size_t log_max_bytes;     // rotar al superar este tamaño (0 = nunca)
+     long log_rotate_secs;     // rotar cada tantos segundos (0 = nunca)
+     int log_stdout;           // copiar también a la consola
+     int deflate;              // ofrecer permessage-deflate
+     int deflate_window;       // bits de ventana del compresor (9-15)
+     int deflate_mem;          // memLevel de zlib (1-9)
+     int deflate_level;        // nivel de compresión (1-9)
+     int metrics;              // servir /metrics y llevar los contadores
+     size_t history;           // broadcasts guardados para repetir (0 = nada)
+     size_t history_bytes;     // tope de memoria del historial (todos los shards)
+     const char *store_dir;    // almacén de mensajes (NULL = apagado)
+     size_t store_segment;     // bytes por segmento
+     long store_fsync_ms;      // fdatasync a lo sumo cada tantos ms (0 = cada tanda)
+     long presence_ms;         // juntar cambios de estado tantos ms (0 = uno por cambio)
+ } cfg = { 8080, 256, SLOW_DROP_OLDEST, 1,
+           LOG_LVL_BODY, "servidor.log", 10 * 1024 * 1024, 0, 1,
+           1, 11, 4, 6, 1, 100, 4 * 1024 * 1024,
+           NULL, 64 * 1024 * 1024, 100, 250 };
+
+ // ----------------- Bitácora asíncrona -----------------
+ // Los hilos productores formatean la línea directo en un slot de un anillo
+ // MPMC acotado (sin locks, con número de secuencia por slot). Un hilo
+ // escritor junta los slots listos y los vuelca con un solo writev sobre un
+ // descriptor que queda abierto. Si el anillo está lleno la línea se
+ // descarta y se cuenta: el loop de servicio nunca se bloquea por disco.
+
+ #define LOG_RING_SIZE 4096       // potencia de 2
+ #define LOG_LINE_MAX 1152
+ #define LOG_BATCH 64             // líneas por writev
+
+ typedef struct {
+     size_t seq;
+     size_t len;
+     char line[LOG_LINE_MAX];
+ } LogSlot;
+
+ static struct {
+     LogSlot *slots;
+     size_t head;                 // siguiente posición a reservar (productores)
+     size_t tail;                 // siguiente posición a escribir (escritor)
+     unsigned long dropped;
+     int fd;
+     size_t file_size;
+     time_t opened_at;
+     pthread_t thread;
+     volatile int stop;
+ } logq = { .fd = -1 };
+
+ static void log_vwrite(LogLevel level, const char *format, va_list args) {
+     if (level > cfg.log_level) return;
+     if (!logq.slots) {
+         vfprintf(stderr, format, args);
+         fputc('\n', stderr);
+         return;
+     }
+     size_t pos = __atomic_load_n(&logq.head, __ATOMIC_RELAXED);
+     LogSlot *slot;
+     for (;;) {
+         slot = &logq.slots[pos & (LOG_RING_SIZE - 1)];
+         size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+         intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+         if (diff == 0) {
+             if (__atomic_compare_exchange_n(&logq.head, &pos, pos + 1, 1,
+                                             __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                 break;
+         } else if (diff < 0) {
+             __atomic_fetch_add(&logq.dropped, 1, __ATOMIC_RELAXED);
+             return;
+         } else {
+             pos = __atomic_load_n(&logq.head, __ATOMIC_RELAXED);
+         }
+     }
+ 
+     char timestamp[64];
+     get_timestamp(timestamp, sizeof(timestamp));
+     int n = snprintf(slot->line, LOG_LINE_MAX, "[%s] ", timestamp);
+     int m = vsnprintf(slot->line + n, LOG_LINE_MAX - n - 1, format, args);
+     if (m < 0) m = 0;
+     if (m > LOG_LINE_MAX - n - 2) m = LOG_LINE_MAX - n - 2;
+     slot->line[n + m] = '\n';
+     slot->len = n + m + 1;
+     __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+ }
+ 
+ void log_msg(LogLevel level, const char *format, ...) {
+     va_list args;
+     va_start(args, format);
+     log_vwrite(level, format, args);
+     va_end(args);
+ }
+ 
  void log_action(const char *format, ...) {
-    char timestamp[64];
-
-    // Preparar el mensaje
-    char message[1024];
-    va_list args;
-    va_start(args, format);
-    vsnprintf(message, sizeof(message), format, args);
-    va_end(args);
-
-    // Imprimir en consola
-    printf("[%s] %s\n", timestamp, message);
-    fflush(stdout);
-
-    // Guardar en archivo
-    FILE *log_file = fopen("servidor.log", "a");
-    if (log_file) {
-        fprintf(log_file, "[%s] %s\n", timestamp, message);
-        fclose(log_file);
-    }
-}
+     va_list args;
+     va_start(args, format);
+     log_vwrite(LOG_LVL_INFO, format, args);
+     va_end(args);
+ }
+ 
+ static int log_open(void) {
+     logq.fd = open(cfg.log_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+     if (logq.fd < 0) return -1;
+     off_t size = lseek(logq.fd, 0, SEEK_END);
+     logq.file_size = size > 0 ? (size_t)size : 0;
+     logq.opened_at = time(NULL);
+     return 0;
+ }
+ 
+ // Renombra el archivo actual con la fecha y abre uno nuevo
+ static void log_rotate(void) {
+     char stamp[32], rotated[512];
+     time_t now = time(NULL);
+     struct tm tm_info;
+     localtime_r(&now, &tm_info);
+     strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm_info);
+     snprintf(rotated, sizeof(rotated), "%s.%s", cfg.log_path, stamp);
+     close(logq.fd);
+     rename(cfg.log_path, rotated);
+     if (log_open() < 0) logq.fd = -1;
+ }
+ 
+ // Escribe en lote las líneas listas. Devuelve cuántas escribió.
+ static size_t log_drain(void) {
+     struct iovec iov[LOG_BATCH];
+     size_t n = 0, bytes = 0;
+     while (n < LOG_BATCH) {
+         LogSlot *slot = &logq.slots[(logq.tail + n) & (LOG_RING_SIZE - 1)];
+         if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != logq.tail + n + 1) break;
+         iov[n].iov_base = slot->line;
+         iov[n].iov_len = slot->len;
+         bytes += slot->len;
+         n++;
+     }
+     if (!n) return 0;
+ 
+     if (logq.fd >= 0) {
+         if (writev(logq.fd, iov, (int)n) > 0) logq.file_size += bytes;
+     }
+     if (cfg.log_stdout) writev(STDOUT_FILENO, iov, (int)n);
+ 
+     // Devolver los slots a los productores para la siguiente vuelta
+     for (size_t i = 0; i < n; i++) {
+         LogSlot *slot = &logq.slots[(logq.tail + i) & (LOG_RING_SIZE - 1)];
+         __atomic_store_n(&slot->seq, logq.tail + i + LOG_RING_SIZE, __ATOMIC_RELEASE);
+     }
+     logq.tail += n;
+ 
+     if (logq.fd >= 0 &&
+         ((cfg.log_max_bytes && logq.file_size >= cfg.log_max_bytes) ||
+          (cfg.log_rotate_secs && time(NULL) - logq.opened_at >= cfg.log_rotate_secs)))
+         log_rotate();
+     return n;
+ }
+ 
+ static void *log_writer(void *arg) {
+     (void)arg;
+     unsigned long reported = 0;
+     for (;;) {
+         int stopping = logq.stop;
+         size_t n = log_drain();
+         unsigned long dropped = __atomic_load_n(&logq.dropped, __ATOMIC_RELAXED);
+         if (dropped != reported && logq.fd >= 0) {
+             char line[128];
+             int len = snprintf(line, sizeof(line), "[log] %lu líneas descartadas por anillo lleno\n",
+                                dropped - reported);
+             write(logq.fd, line, len);
+             reported = dropped;
+         }
+         if (!n) {
+             if (stopping) break;
+             usleep(5000);
+         }
+     }
+     return NULL;
+ }
+ 
+ static int log_init(void) {
+     logq.slots = calloc(LOG_RING_SIZE, sizeof(LogSlot));
+     if (!logq.slots) return -1;
+     for (size_t i = 0; i < LOG_RING_SIZE; i++) logq.slots[i].seq = i;
+     if (log_open() < 0) perror(cfg.log_path);
+     if (pthread_create(&logq.thread, NULL, log_writer, NULL) != 0) {
+         free(logq.slots);
+         logq.slots = NULL;
+         return -1;
+     }
+     return 0;
+ }
+ 
+ static void log_shutdown(void) {
+     if (!logq.slots) return;
+     logq.stop = 1;
+     pthread_join(logq.thread, NULL);
+     if (logq.fd >= 0) close(logq.fd);
+ }
+
+ // Frame serializado una sola vez y compartido por referencia entre todas
+ // las colas que lo envían; se libera cuando el último destinatario lo
+ // escribió. buf tiene LWS_PRE bytes de cabecera antes del payload.
+ // Los frames binarios llevan después del payload los uid que usan con su
+ // nombre (uid de 4 bytes + nombre terminado en '\0', binds_len bytes en
+ // total) para anunciárselos a quien todavía no los conozca.
+ typedef struct {
+     int refs;                 // se modifica con atómicos
+     size_t len;               // largo del payload
+     size_t binds_len;         // bytes de uid + nombre después del payload
+     uint32_t bind_uid;        // en un MSG_USER_ID, el uid que anuncia
+     unsigned char buf[];
+ } Frame;
+
+ // Cola FIFO acotada (anillo de cfg.queue_max entradas)
+ typedef struct {
+     Frame **items;
+     size_t head;
+     size_t count;
+ } OutQueue;
+
+ // Temporizador intrusivo para la rueda de cada shard (lista doble circular)
+ typedef struct Timer {
+     struct Timer *next, *prev;
+     uint64_t expires;         // en ticks de la rueda (segundos)
+     void (*cb)(struct Timer *);
+ } Timer;
+ 
+ // Subprotocolo negociado por la conexión; el valor es el id del protocolo
+ // en protocols[].
+ typedef enum {
+     FMT_JSON,   // "chat-protocol": frames de texto JSON
+     FMT_BIN,    // "chat-protocol-bin": registros binarios
+     FMT_COUNT
+ } WireFormat;
+ 
+ typedef struct Client {
+     struct lws *wsi;
+     char name[50];
+     char ip[INET_ADDRSTRLEN];
+     char status[MAX_STATUS_LEN];
+     time_t last_activity;
+     int registered;        // ya envió "register" con éxito
+     uint32_t name_hash;    // hash de name, cacheado para la tabla
+     size_t list_idx;       // posición en registry.list
+     struct Shard *shard;   // hilo de servicio dueño de la conexión
+     size_t shard_idx;      // posición en shard->members.items
+     int refs;              // la conexión + buzones + búsquedas en curso
+     int closed;            // la conexión ya se cerró (la escribe el dueño)
+     OutQueue outq;         // solo la toca el hilo del shard dueño
+     Timer idle_timer;      // vence cuando el cliente pasa a INACTIVO
+     int close_pending;     // cerrar cuando la cola quede vacía
+     int kill;              // cerrar ya (política SLOW_DISCONNECT)
+     unsigned long dropped; // mensajes descartados por cola llena
+     char *rx;              // reensamblado de mensajes fragmentados
+     size_t rx_len, rx_cap;
+     WireFormat fmt;
+     uint32_t uid;          // id del usuario en el protocolo binario
+     uint64_t wire_acked;   // tcpi_bytes_acked ya contado en el shard
+     uint64_t rx_started;   // llegada del primer fragmento (métricas)
+     struct {
+         struct Channel *ch;
+         size_t idx;        // posición en ch->shard[shard->id]
+     } chans[CLIENT_MAX_CHANNELS];   // solo los toca el hilo del shard dueño
+     int nchans;
+     int presence_queued;   // en presence.pending (bajo presence.lock)
+     char presence_prev[MAX_STATUS_LEN];   // estado ya anunciado a los demás
+     // uid cuyo nombre ya se le anunció (bit por uid; solo clientes
+     // binarios y solo el hilo del shard dueño)
+     unsigned char *uid_known;
+     size_t uid_known_len;
+ } Client;
+
+ // Conjunto compacto de clientes: agregar y sacar (intercambiando con el
+ // último) son O(1) y recorrerlo no salta huecos. Cada cliente guarda su
+ // posición. count se publica con store atómico para que otros shards
+ // puedan ver si está vacío sin lock.
+ typedef struct {
+     Client **items;
+     size_t count, cap;
+ } MemberSet;
+ 
+ // ----------------- Registro de clientes -----------------
+ // Tabla hash de direccionamiento abierto (sondeo lineal) indexada por nombre,
+ // con un índice secundario por wsi y un arreglo compacto para recorrer a
+ // todos los clientes. Los Client* son estables: la tabla solo guarda punteros.
+ 
+ #define REGISTRY_MIN_CAP 64
+ 
+ // Directorio: los registrados en orden de uid, para paginar list_users con
+ // un cursor estable (el último uid visto). Los uid solo crecen, así que
+ // agregar es al final; sacar deja un hueco (c = NULL) que se compacta
+ // cuando los huecos pasan a ser la mitad.
+ typedef struct {
+     uint32_t uid;
+     Client *c;          // NULL = se fue
+ } DirEntry;
+ 
+ typedef struct {
+     Client **by_name;   // slots indexados por nombre (NULL = vacío)
+     Client **by_wsi;    // slots indexados por wsi
+     size_t cap;         // potencia de 2, compartida por ambos índices
+     Client **list;      // clientes registrados, sin huecos
+     size_t count;
+     size_t list_cap;
+     size_t conns;       // conexiones en by_wsi (registradas o no)
+     DirEntry *dir;      // registrados en orden de uid, con huecos
+     size_t dir_len, dir_cap;
+     uint64_t version;   // cambia con cada alta o baja de usuario
+     unsigned name_seq;  // impar mientras se modifica by_name (ver client_lookup)
+ } ClientRegistry;
+ 
+ static ClientRegistry registry;
+ pthread_mutex_t clients_mutex = PTHREAD_MUTEX_INITIALIZER;
+ static volatile int force_exit = 0;
+ static struct lws_context *context;
+ static int fmt_clients[FMT_COUNT];   // conexiones abiertas por formato
+ 
+ // La marca de tiempo solo cambia una vez por segundo: cada hilo guarda la
+ // última formateada y evita localtime_r + strftime en cada mensaje.
+ static __thread time_t ts_cached_sec = -1;
+ static __thread char ts_cached[32];
+ 
+ static const char *timestamp_at(time_t now) {
+     if (now != ts_cached_sec) {
+         struct tm tm_info;
+         localtime_r(&now, &tm_info);
+         strftime(ts_cached, sizeof(ts_cached), "%Y-%m-%dT%H:%M:%S", &tm_info);
+         ts_cached_sec = now;
+     }
+     return ts_cached;
+ }
+ 
+ void get_timestamp(char *buffer, size_t len) {
+     snprintf(buffer, len, "%s", timestamp_at(time(NULL)));
+ }
+ 
+ static uint32_t hash_name(const char *name) {
+     uint32_t h = 2166136261u;  // FNV-1a
+     while (*name) {
+         h ^= (unsigned char)*name++;
+         h *= 16777619u;
+     }
+     return h;
+ }
+ 
+ static uint32_t hash_wsi(const struct lws *wsi) {
+     uint64_t x = (uint64_t)(uintptr_t)wsi;
+     x ^= x >> 33;
+     x *= 0xff51afd7ed558ccdULL;
+     x ^= x >> 33;
+     return (uint32_t)x;
+ }
+ 
+ static size_t home_by_name(const Client *c, size_t mask) { return c->name_hash & mask; }
+ static size_t home_by_wsi(const Client *c, size_t mask) { return hash_wsi(c->wsi) & mask; }
+ 
+ // Los slots se escriben con stores atómicos porque client_lookup lee
+ // by_name sin lock
+ static void index_insert(Client **slots, size_t mask, Client *c, size_t home) {
+     size_t i = home;
+     while (slots[i]) i = (i + 1) & mask;
+     __atomic_store_n(&slots[i], c, __ATOMIC_RELAXED);
+ }
+ 
+ // Borrado con corrimiento hacia atrás: no deja lápidas, así las búsquedas
+ // siguen terminando en el primer slot vacío.
+ static void index_erase(Client **slots, size_t mask, Client *c,
+                         size_t (*home_of)(const Client *, size_t)) {
+     size_t i = home_of(c, mask);
+     while (slots[i] && slots[i] != c) i = (i + 1) & mask;
+     if (!slots[i]) return;
+     size_t j = i;
+     for (;;) {
+         j = (j + 1) & mask;
+         if (!slots[j]) break;
+         size_t k = home_of(slots[j], mask);
+         // Mover slots[j] a i solo si su posición ideal no está en (i, j]
+         if ((i <= j) ? (k <= i || k > j) : (k <= i && k > j)) {
+             __atomic_store_n(&slots[i], slots[j], __ATOMIC_RELAXED);
+             i = j;
+         }
+     }
+     __atomic_store_n(&slots[i], NULL, __ATOMIC_RELAXED);
+ }
+ 
+ // Cada modificación de by_name va entre estas dos: los lectores sin lock
+ // descartan lo que leyeron si name_seq cambió o era impar
+ static void name_write_begin(void) {
+     __atomic_store_n(&registry.name_seq, registry.name_seq + 1, __ATOMIC_RELAXED);
+     __atomic_thread_fence(__ATOMIC_RELEASE);
+ }
+ 
+ static void name_write_end(void) {
+     __atomic_store_n(&registry.name_seq, registry.name_seq + 1, __ATOMIC_RELEASE);
+ }
+ 
+ static void epoch_retire(void *ptr, void (*free_fn)(void *));
+ 
+ static int registry_grow(size_t new_cap) {
+     Client **by_name = calloc(new_cap, sizeof(Client *));
+     Client **by_wsi = calloc(new_cap, sizeof(Client *));
+     if (!by_name || !by_wsi) {
+         free(by_name);
+         free(by_wsi);
+         return -1;
+     }
+     size_t mask = new_cap - 1;
+     for (size_t i = 0; i < registry.count; i++) {
+         Client *c = registry.list[i];
+         index_insert(by_name, mask, c, home_by_name(c, mask));
+     }
+     for (size_t i = 0; i < registry.cap; i++) {
+         Client *c = registry.by_wsi[i];
+         if (c) index_insert(by_wsi, mask, c, home_by_wsi(c, mask));
+     }
+     // Un lector sin lock puede estar recorriendo el arreglo viejo; el
+     // nuevo se publica antes que cap, así que cap nunca excede al arreglo
+     name_write_begin();
+     Client **old = registry.by_name;
+     __atomic_store_n(&registry.by_name, by_name, __ATOMIC_RELAXED);
+     __atomic_store_n(&registry.cap, new_cap, __ATOMIC_RELEASE);
+     name_write_end();
+     if (old) epoch_retire(old, free);
+     free(registry.by_wsi);
+     registry.by_wsi = by_wsi;
+     return 0;
+ }
+ 
+ // Agrega una conexión nueva al índice por wsi. Llamar con clients_mutex tomado.
+ static int registry_attach(Client *c) {
+     // Factor de carga máximo 0.5 para que el sondeo lineal siga siendo corto
+     if ((registry.conns + 1) * 2 > registry.cap) {
+         size_t cap = registry.cap ? registry.cap * 2 : REGISTRY_MIN_CAP;
+         if (registry_grow(cap) < 0) return -1;
+     }
+     size_t mask = registry.cap - 1;
+     index_insert(registry.by_wsi, mask, c, home_by_wsi(c, mask));
+     registry.conns++;
+     return 0;
+ }
+ 
+ // Inserta por nombre y en la lista. Llamar con clients_mutex tomado y con
+ // el cliente ya en el índice por wsi (así la tabla tiene espacio).
+ static int registry_insert(Client *c) {
+     // Lugar en el directorio para dir_append, que ya no puede fallar
+     if (registry.dir_len == registry.dir_cap) {
+         size_t dir_cap = registry.dir_cap ? registry.dir_cap * 2 : REGISTRY_MIN_CAP;
+         DirEntry *dir = realloc(registry.dir, dir_cap * sizeof(DirEntry));
+         if (!dir) return -1;
+         registry.dir = dir;
+         registry.dir_cap = dir_cap;
+     }
+     if (registry.count == registry.list_cap) {
+         size_t list_cap = registry.list_cap ? registry.list_cap * 2 : REGISTRY_MIN_CAP;
+         Client **list = realloc(registry.list, list_cap * sizeof(Client *));
+         if (!list) return -1;
+         registry.list = list;
+         registry.list_cap = list_cap;
+     }
+     size_t mask = registry.cap - 1;
+     c->name_hash = hash_name(c->name);
+     name_write_begin();
+     index_insert(registry.by_name, mask, c, home_by_name(c, mask));
+     name_write_end();
+     c->list_idx = registry.count;
+     registry.list[registry.count++] = c;
+     c->registered = 1;
+     return 0;
+ }
+ 
+ // Primera posición del directorio con uid >= uid
+ static size_t dir_lower_bound(uint32_t uid) {
+     size_t a = 0, b = registry.dir_len;
+     while (a < b) {
+         size_t mid = a + (b - a) / 2;
+         if (registry.dir[mid].uid < uid) a = mid + 1;
+         else b = mid;
+     }
+     return a;
+ }
+ 
+ // Con el uid ya asignado (el mayor hasta ahora)
+ static void dir_append(Client *c) {
+     registry.dir[registry.dir_len++] = (DirEntry){ c->uid, c };
+     registry.version++;
+ }
+ 
+ static void dir_remove(Client *c) {
+     size_t i = dir_lower_bound(c->uid);
+     if (i < registry.dir_len && registry.dir[i].c == c) registry.dir[i].c = NULL;
+     while (registry.dir_len && !registry.dir[registry.dir_len - 1].c) registry.dir_len--;
+     if (registry.dir_len > REGISTRY_MIN_CAP && registry.count * 2 < registry.dir_len) {
+         size_t k = 0;
+         for (size_t j = 0; j < registry.dir_len; j++)
+             if (registry.dir[j].c) registry.dir[k++] = registry.dir[j];
+         registry.dir_len = k;
+     }
+     registry.version++;
+ }
+ 
+ // Quita de ambos índices; en la lista el último ocupa el hueco.
+ static void registry_remove(Client *c) {
+     size_t mask = registry.cap - 1;
+     if (c->registered) {
+         name_write_begin();
+         index_erase(registry.by_name, mask, c, home_by_name);
+         name_write_end();
+         Client *last = registry.list[--registry.count];
+         registry.list[c->list_idx] = last;
+         last->list_idx = c->list_idx;
+         c->registered = 0;
+         dir_remove(c);
+     }
+     index_erase(registry.by_wsi, mask, c, home_by_wsi);
+     registry.conns--;
+ }
+ 
+ static Client *registry_find_wsi(const struct lws *wsi) {
+     if (!registry.cap) return NULL;
+     size_t mask = registry.cap - 1;
+     size_t i = hash_wsi(wsi) & mask;
+     while (registry.by_wsi[i]) {
+         if (registry.by_wsi[i]->wsi == wsi) return registry.by_wsi[i];
+         i = (i + 1) & mask;
+     }
+     return NULL;
+ }
+ 
+ // Recorre de atrás hacia adelante: es seguro quitar el cliente actual dentro
+ // del cuerpo, porque el que ocupa su hueco ya fue visitado.
+ #define REGISTRY_FOREACH(c) \
+     for (size_t _ri = registry.count; _ri-- > 0 && ((c) = registry.list[_ri], 1); )
+ 
+ // Contadores con un solo escritor (el hilo dueño): sin read-modify-write
+ // atómico; el store atómico evita que quien los suma lea un valor partido
+ static void stat_add(uint64_t *p, uint64_t v) {
+     __atomic_store_n(p, *p + v, __ATOMIC_RELAXED);
+ }
+ 
+ // ----------------- Pools de memoria -----------------
+ // Los Client, los frames, los MailItem y los nodos de cJSON salen de pools
+ // por tamaño en vez de ir a malloc cada vez. Cada clase reparte bloques de
+ // un tamaño fijo cortados de slabs de POOL_SLAB bytes; los bloques libres
+ // vuelven a la caché del hilo que los suelta (un frame se codifica en un
+ // shard y se libera en otro) y, cuando esa caché se llena, la mitad pasa
+ // al depósito global, de donde la toman los hilos que se quedaron sin.
+ // Los slabs no se devuelven al sistema: la memoria queda en el pico de uso,
+ // que es lo que muestran las métricas. Lo más grande que la última clase
+ // va directo a malloc.
+ 
+ #define POOL_CLASSES 7
+ #define POOL_CACHE 64              // bloques por clase en cada hilo
+ #define POOL_SLAB (64 * 1024)
+ 
+ static const size_t pool_sizes[POOL_CLASSES] = { 64, 128, 256, 512, 1024, 4096, 16384 };
+ 
+ // Cabecera de cada bloque: la clase mientras está en uso, el siguiente
+ // mientras está libre
+ typedef union PoolBlock {
+     union PoolBlock *next;
+     struct {
+         unsigned cls;              // POOL_CLASSES = vino de malloc
+         size_t size;               // solo en los de malloc
+     } used;
+     max_align_t align;
+ } PoolBlock;
+ 
+ typedef struct PoolCache {
+     struct PoolCache *next;        // en pools.caches
+     PoolBlock *free[POOL_CLASSES];
+     unsigned count[POOL_CLASSES];
+     uint64_t hits[POOL_CLASSES];   // de la caché o del depósito (stat_add)
+     uint64_t misses[POOL_CLASSES]; // hubo que cortar un slab nuevo o ir a malloc
+ } PoolCache;
+ 
+ static struct {
+     pthread_mutex_t lock;          // protege depot, depot_count y caches
+     PoolBlock *depot[POOL_CLASSES];
+     size_t depot_count[POOL_CLASSES];
+     PoolCache *caches;             // una por hilo, nunca se liberan
+     size_t slab_bytes;             // atómico: memoria tomada en slabs
+     size_t large_bytes;            // atómico: bloques grandes en uso
+     size_t large_peak;
+ } pools = { .lock = PTHREAD_MUTEX_INITIALIZER };
+ 
+ static __thread PoolCache *pool_cache;
+ 
+ static PoolCache *pool_thread_cache(void) {
+     if (pool_cache) return pool_cache;
+     PoolCache *pc = calloc(1, sizeof(PoolCache));
+     if (!pc) return NULL;
+     pthread_mutex_lock(&pools.lock);
+     pc->next = pools.caches;
+     pools.caches = pc;
+     pthread_mutex_unlock(&pools.lock);
+     return pool_cache = pc;
+ }
+ 
+ static int pool_class(size_t size) {
+     for (int k = 0; k < POOL_CLASSES; k++)
+         if (size <= pool_sizes[k]) return k;
+     return POOL_CLASSES;
+ }
+ 
+ // Llena la caché de la clase k desde el depósito o, si está vacío, con un
+ // slab nuevo. Devuelve 1 si hubo que cortar un slab, -1 sin memoria.
+ static int pool_refill(PoolCache *pc, int k) {
+     size_t bsize = sizeof(PoolBlock) + pool_sizes[k];
+     pthread_mutex_lock(&pools.lock);
+     unsigned n = 0;
+     while (pools.depot[k] && n < POOL_CACHE / 2) {
+         PoolBlock *b = pools.depot[k];
+         pools.depot[k] = b->next;
+         b->next = pc->free[k];
+         pc->free[k] = b;
+         n++;
+     }
+     pools.depot_count[k] -= n;
+     pthread_mutex_unlock(&pools.lock);
+     pc->count[k] += n;
+     if (n) return 0;
+     size_t per_slab = POOL_SLAB / bsize;
+     char *slab = malloc(per_slab * bsize);
+     if (!slab) return -1;
+     __atomic_fetch_add(&pools.slab_bytes, per_slab * bsize, __ATOMIC_RELAXED);
+     for (size_t i = 0; i < per_slab; i++) {
+         PoolBlock *b = (PoolBlock *)(slab + i * bsize);
+         b->next = pc->free[k];
+         pc->free[k] = b;
+     }
+     pc->count[k] += per_slab;
+     return 1;
+ }
+ 
+ static void *pool_alloc(size_t size) {
+     int k = pool_class(size);
+     PoolCache *pc = k < POOL_CLASSES ? pool_thread_cache() : NULL;
+     if (!pc) {
+         PoolBlock *b = malloc(sizeof(PoolBlock) + size);
+         if (!b) return NULL;
+         b->used.cls = POOL_CLASSES;
+         b->used.size = size;
+         size_t in_use = __atomic_add_fetch(&pools.large_bytes, size, __ATOMIC_RELAXED);
+         size_t peak = __atomic_load_n(&pools.large_peak, __ATOMIC_RELAXED);
+         while (in_use > peak && !__atomic_compare_exchange_n(&pools.large_peak, &peak, in_use, 1,
+                                                               __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+         return b + 1;
+     }
+     if (!pc->free[k]) {
+         int rc = pool_refill(pc, k);
+         if (rc < 0) return NULL;
+         stat_add(rc ? &pc->misses[k] : &pc->hits[k], 1);
+     } else {
+         stat_add(&pc->hits[k], 1);
+     }
+     PoolBlock *b = pc->free[k];
+     pc->free[k] = b->next;
+     pc->count[k]--;
+     b->used.cls = (unsigned)k;
+     return b + 1;
+ }
+ 
+ static void *pool_calloc(size_t n, size_t size) {
+     if (size && n > SIZE_MAX / size) return NULL;
+     void *p = pool_alloc(n * size);
+     if (p) memset(p, 0, n * size);
+     return p;
+ }
+ 
+ static void pool_free(void *p) {
+     if (!p) return;
+     PoolBlock *b = (PoolBlock *)p - 1;
+     int k = (int)b->used.cls;
+     PoolCache *pc = k < POOL_CLASSES ? pool_thread_cache() : NULL;
+     if (!pc) {
+         if (k < POOL_CLASSES) {
+             // Sin caché (no hubo memoria para crearla): directo al depósito
+             pthread_mutex_lock(&pools.lock);
+             b->next = pools.depot[k];
+             pools.depot[k] = b;
+             pools.depot_count[k]++;
+             pthread_mutex_unlock(&pools.lock);
+             return;
+         }
+         __atomic_fetch_sub(&pools.large_bytes, b->used.size, __ATOMIC_RELAXED);
+         free(b);
+         return;
+     }
+     b->next = pc->free[k];
+     pc->free[k] = b;
+     if (++pc->count[k] < POOL_CACHE) return;
+     // Caché llena: la mitad al depósito, en una sola toma del lock
+     PoolBlock *head = pc->free[k], *tail = head;
+     for (unsigned i = 1; i < POOL_CACHE / 2; i++) tail = tail->next;
+     pc->free[k] = tail->next;
+     pc->count[k] -= POOL_CACHE / 2;
+     pthread_mutex_lock(&pools.lock);
+     tail->next = pools.depot[k];
+     pools.depot[k] = head;
+     pools.depot_count[k] += POOL_CACHE / 2;
+     pthread_mutex_unlock(&pools.lock);
+ }
+ 
+ // cJSON reserva varios nodos chicos por mensaje; con esto salen del pool
+ static void pool_init(void) {
+     cJSON_Hooks hooks = { pool_alloc, pool_free };
+     cJSON_InitHooks(&hooks);
+ }
+ 
+ // ----------------- Frames compartidos -----------------
+ 
+ // Frame con espacio para len bytes de payload y binds bytes de uid con
+ // nombre, sin inicializar
+ static Frame *frame_alloc(size_t len, size_t binds) {
+     Frame *f = pool_alloc(sizeof(Frame) + LWS_PRE + len + binds);
+     if (!f) return NULL;
+     f->refs = 1;
+     f->len = len;
+     f->binds_len = binds;
+     f->bind_uid = 0;
+     return f;
+ }
+ 
+ static Frame *frame_new(const char *payload, size_t len) {
+     Frame *f = frame_alloc(len, 0);
+     if (f) memcpy(f->buf + LWS_PRE, payload, len);
+     return f;
+ }
+ 
+ // Copia para otro shard, con los uid que usa
+ static Frame *frame_copy(const Frame *src) {
+     Frame *f = frame_alloc(src->len, src->binds_len);
+     if (!f) return NULL;
+     memcpy(f->buf + LWS_PRE, src->buf + LWS_PRE, src->len + src->binds_len);
+     f->bind_uid = src->bind_uid;
+     return f;
+ }
+ 
+ static Frame *frame_ref(Frame *f) {
+     __atomic_fetch_add(&f->refs, 1, __ATOMIC_RELAXED);
+     return f;
+ }
+ 
+ static void frame_unref(Frame *f) {
+     if (__atomic_sub_fetch(&f->refs, 1, __ATOMIC_ACQ_REL) == 0) pool_free(f);
+ }
+ 
+ // ----------------- Shards (hilos de servicio) -----------------
+ // Con --threads N, lws reparte las conexiones entre N hilos de servicio
+ // (count_threads; lws admite a lo sumo LWS_MAX_SMP, y main baja N a lo que
+ // lws creó). Cada shard es dueño de sus conexiones: sus colas, su
+ // lista de miembros y los lws_write solo se tocan desde su hilo. Lo que
+ // otro hilo quiera entregarle pasa por el buzón del shard.
+ //
+ // lws_write escribe la cabecera WebSocket dentro de los LWS_PRE bytes del
+ // frame, así que un mismo Frame nunca se comparte entre shards: cada shard
+ // recibe su propia copia (una por shard, no una por destinatario).
+ //
+ // Un mensaje viaja como un frame por formato (frame[fmt], NULL si nadie lo
+ // usa) y cada miembro recibe el de su subprotocolo.
+ 
+ typedef struct MailItem {
+     struct MailItem *next;
+     Frame *frame[FMT_COUNT];
+     Client *target;      // NULL = a todos los miembros del shard
+     struct Channel *channel;   // reparto a todos: NULL = todos, si no solo el canal
+     Client *exclude;     // solo para el reparto a todos
+     uint64_t seq;        // > 0: broadcast que entra al historial
+ } MailItem;
+ 
+ // Historial de broadcasts: cada shard guarda sus propias copias de los
+ // frames ya serializados (las mismas que repartió a sus miembros), así que
+ // repetirlos es encolar referencias sin volver a codificar.
+ typedef struct {
+     uint64_t seq;
+     time_t ts;
+     Frame *frame[FMT_COUNT];
+     size_t bytes;
+ } HistEntry;
+ 
+ typedef struct {
+     HistEntry *items;    // anillo de cfg.history entradas
+     size_t head, count;
+     size_t bytes;        // payload retenido
+ } History;
+ 
+ // Rueda de temporizadores jerárquica: WHEEL_LEVELS niveles de WHEEL_SLOTS
+ // ranuras; el nivel n cubre 64^(n+1) ticks. Armar y cancelar son O(1); cada
+ // tick solo mira una ranura del nivel 0 y, cada 64 ticks, redistribuye una
+ // ranura del nivel siguiente.
+ #define WHEEL_BITS 6
+ #define WHEEL_SLOTS (1 << WHEEL_BITS)
+ #define WHEEL_LEVELS 3
+ 
+ typedef struct {
+     Timer slots[WHEEL_LEVELS][WHEEL_SLOTS];   // centinelas de cada lista
+     uint64_t now;                             // último tick procesado
+     lws_sorted_usec_list_t sul;               // dispara wheel_tick cada segundo
+ } TimerWheel;
+ 
+ typedef struct Shard {
+     int id;
+     MemberSet members;   // registrados en este shard (el canal global)
+     pthread_mutex_t mb_lock;
+     MailItem *mb_head, *mb_tail;
+     struct lws *wake_wsi; // una conexión del shard, para despertarlo (bajo mb_lock)
+     TimerWheel wheel;    // solo la toca el hilo del shard
+     // Tráfico de salida; los escribe el dueño y los lee el shard 0
+     uint64_t tx_payload; // bytes de payload entregados a lws_write
+     uint64_t tx_wire;    // bytes confirmados por TCP (con cabeceras)
+     uint64_t tx_cpu_ns;  // CPU del hilo dentro de lws_write
+     Timer stats_timer;
+     struct Metrics *metrics;   // NULL con --no-metrics
+     History history;     // solo lo toca el hilo del shard
+     uint64_t epoch;      // época << 1 | 1 mientras el hilo lee sin lock, si no 0
+ } Shard;
+ 
+ static Shard *shards;
+ static __thread Shard *cur_shard;   // NULL fuera de los hilos de servicio
+ 
+ // ----------------- Reclamación por épocas -----------------
+ // client_lookup lee la tabla por nombre sin clients_mutex. Mientras lee,
+ // el hilo anota en su shard la época global. Lo que deja de ser alcanzable
+ // desde la tabla (un Client al soltar la última referencia, el arreglo
+ // viejo al crecer) se retira con la época del momento y se libera recién
+ // cuando la época avanzó dos veces: para entonces ya no queda ningún
+ // lector que lo haya podido ver. La época avanza cuando todos los hilos
+ // que están leyendo ya vieron la actual; cada shard lo intenta en cada
+ // tick de su rueda.
+ 
+ typedef struct Retired {
+     struct Retired *next;
+     uint64_t epoch;
+     void *ptr;
+     void (*free_fn)(void *);
+ } Retired;
+ 
+ static struct {
+     uint64_t global;         // atómico
+     pthread_mutex_t lock;    // protege limbo
+     Retired *limbo;          // los más nuevos primero
+ } epoch = { .global = 1, .lock = PTHREAD_MUTEX_INITIALIZER };
+ 
+ // Solo desde los hilos de servicio; las lecturas no pueden anidarse
+ static void epoch_enter(void) {
+     uint64_t e = __atomic_load_n(&epoch.global, __ATOMIC_RELAXED);
+     __atomic_store_n(&cur_shard->epoch, e << 1 | 1, __ATOMIC_RELAXED);
+     // Lo que se lea después no puede adelantarse a la marca
+     __atomic_thread_fence(__ATOMIC_SEQ_CST);
+ }
+ 
+ static void epoch_exit(void) {
+     __atomic_store_n(&cur_shard->epoch, 0, __ATOMIC_RELEASE);
+ }
+ 
+ // Llamar cuando ptr ya no es alcanzable para un lector nuevo
+ static void epoch_retire(void *ptr, void (*free_fn)(void *)) {
+     Retired *r = malloc(sizeof(Retired));
+     if (!r) return;   // sin memoria: se pierde, liberarlo ya no es seguro
+     r->ptr = ptr;
+     r->free_fn = free_fn;
+     pthread_mutex_lock(&epoch.lock);
+     r->epoch = __atomic_load_n(&epoch.global, __ATOMIC_SEQ_CST);
+     r->next = epoch.limbo;
+     epoch.limbo = r;
+     pthread_mutex_unlock(&epoch.lock);
+ }
+ 
+ static void epoch_reclaim(void) {
+     uint64_t g = __atomic_load_n(&epoch.global, __ATOMIC_SEQ_CST);
+     int behind = 0;
+     for (int i = 0; i < cfg.threads; i++) {
+         uint64_t v = __atomic_load_n(&shards[i].epoch, __ATOMIC_SEQ_CST);
+         if ((v & 1) && v >> 1 != g) behind = 1;
+     }
+     if (!behind && __atomic_compare_exchange_n(&epoch.global, &g, g + 1, 0, __ATOMIC_SEQ_CST,
+                                                __ATOMIC_SEQ_CST))
+         g++;
+     // La lista está ordenada por época: se corta donde empiezan las viejas
+     pthread_mutex_lock(&epoch.lock);
+     Retired **pp = &epoch.limbo;
+     while (*pp && (*pp)->epoch + 2 > g) pp = &(*pp)->next;
+     Retired *done = *pp;
+     *pp = NULL;
+     pthread_mutex_unlock(&epoch.lock);
+     while (done) {
+         Retired *next = done->next;
+         done->free_fn(done->ptr);
+         free(done);
+         done = next;
+     }
+ }
+ 
+ // ----------------- Métricas -----------------
+ // Cada shard lleva sus propios contadores y solo su hilo los escribe, con
+ // stores relajados: ni locks ni instrucciones atómicas de lectura-escritura
+ // en el camino caliente. /metrics los suma al responder. Cada bloque va en
+ // memoria propia alineada a la línea de caché para que los hilos no se
+ // invaliden la caché entre sí.
+ 
+ #define METRIC_TYPES 32      // >= MSG_TYPE_COUNT
+ #define METRIC_BUCKETS 14
+ 
+ // Límite superior de cada bucket de los histogramas, en nanosegundos
+ static const uint64_t metric_bounds[METRIC_BUCKETS] = {
+     10000, 25000, 50000, 100000, 250000, 500000, 1000000,
+     2500000, 5000000, 10000000, 25000000, 50000000, 100000000, 250000000
+ };
+ 
+ typedef struct {
+     uint64_t buckets[METRIC_BUCKETS + 1];   // el último es +Inf
+     uint64_t count;
+     uint64_t sum_ns;
+ } Histogram;
+ 
+ typedef struct Metrics {
+     uint64_t received[METRIC_TYPES];    // mensajes entrantes por tipo
+     Histogram dispatch[METRIC_TYPES];   // de la llegada al fin del manejo
+     Histogram fanout;                   // duración de cada broadcast
+     uint64_t queued;                    // frames en las colas de salida
+     uint64_t dropped;                   // frames descartados por colas llenas
+     uint64_t lock_acquired;             // clients_mutex
+     uint64_t lock_contended;
+     uint64_t lock_wait_ns;
+ } __attribute__((aligned(64))) Metrics;
+ 
+ static uint64_t mono_ns(void) {
+     struct timespec ts;
+     clock_gettime(CLOCK_MONOTONIC, &ts);
+     return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+ }
+ 
+ static void hist_observe(Histogram *h, uint64_t ns) {
+     int i = 0;
+     while (i < METRIC_BUCKETS && ns > metric_bounds[i]) i++;
+     stat_add(&h->buckets[i], 1);
+     stat_add(&h->count, 1);
+     stat_add(&h->sum_ns, ns);
+ }
+ 
+ static Metrics *metrics_self(void) {
+     return cur_shard ? cur_shard->metrics : NULL;
+ }
+ 
+ // Toma clients_mutex; el tiempo de espera solo se mide si estaba ocupado
+ static void clients_lock(void) {
+     Metrics *mx = metrics_self();
+     if (!mx) {
+         pthread_mutex_lock(&clients_mutex);
+         return;
+     }
+     stat_add(&mx->lock_acquired, 1);
+     if (pthread_mutex_trylock(&clients_mutex) == 0) return;
+     uint64_t t0 = mono_ns();
+     pthread_mutex_lock(&clients_mutex);
+     stat_add(&mx->lock_contended, 1);
+     stat_add(&mx->lock_wait_ns, mono_ns() - t0);
+ }
+ 
+ // ----------------- Rueda de temporizadores -----------------
+ // Reemplaza al hilo inactivity_monitor y a un hilo por cliente: cada shard
+ // avanza su rueda desde su propio loop con lws_sul, así la cantidad de
+ // hilos no depende de la cantidad de usuarios.
+ 
+ static void timer_unlink(Timer *t) {
+     if (!t->next) return;
+     t->prev->next = t->next;
+     t->next->prev = t->prev;
+     t->next = t->prev = NULL;
+ }
+ 
+ static int timer_armed(const Timer *t) { return t->next != NULL; }
+ 
+ static void wheel_place(TimerWheel *w, Timer *t) {
+     // delta 0 solo ocurre al redistribuir: cae en la ranura que se procesa
+     // en este mismo tick
+     uint64_t delta = t->expires > w->now ? t->expires - w->now : 0;
+     int level = 0;
+     while (level < WHEEL_LEVELS - 1 && delta >= ((uint64_t)1 << (WHEEL_BITS * (level + 1))))
+         level++;
+     uint64_t max_delta = ((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+     uint64_t when = delta > max_delta ? w->now + max_delta : w->now + delta;
+     Timer *head = &w->slots[level][(when >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+     t->next = head;
+     t->prev = head->prev;
+     head->prev->next = t;
+     head->prev = t;
+ }
+ 
+ // Arma (o rearma) t para dentro de secs segundos. O(1).
+ static void timer_arm(TimerWheel *w, Timer *t, uint64_t secs, void (*cb)(Timer *)) {
+     timer_unlink(t);
+     t->cb = cb;
+     t->expires = w->now + (secs ? secs : 1);
+     wheel_place(w, t);
+ }
+ 
+ static void wheel_init(TimerWheel *w) {
+     for (int l = 0; l < WHEEL_LEVELS; l++)
+         for (int i = 0; i < WHEEL_SLOTS; i++)
+             w->slots[l][i].next = w->slots[l][i].prev = &w->slots[l][i];
+     w->now = (uint64_t)time(NULL);
+ }
+ 
+ // Mueve los temporizadores de una ranura de nivel superior a donde les
+ // toca ahora que faltan menos ticks.
+ static void wheel_cascade(TimerWheel *w, int level) {
+     Timer *head = &w->slots[level][(w->now >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+     Timer pending = { &pending, &pending, 0, NULL };
+     if (head->next == head) return;
+     pending.next = head->next;
+     pending.prev = head->prev;
+     pending.next->prev = &pending;
+     pending.prev->next = &pending;
+     head->next = head->prev = head;
+     while (pending.next != &pending) {
+         Timer *t = pending.next;
+         timer_unlink(t);
+         wheel_place(w, t);
+     }
+ }
+ 
+ static void wheel_advance(TimerWheel *w, uint64_t until) {
+     while (w->now < until) {
+         w->now++;
+         for (int l = 1; l < WHEEL_LEVELS; l++) {
+             if (w->now & (((uint64_t)1 << (WHEEL_BITS * l)) - 1)) break;
+             wheel_cascade(w, l);
+         }
+         Timer *head = &w->slots[0][w->now & (WHEEL_SLOTS - 1)];
+         while (head->next != head) {
+             Timer *t = head->next;
+             timer_unlink(t);
+             if (t->expires > w->now) wheel_place(w, t);
+             else t->cb(t);
+         }
+     }
+ }
+ 
+ static int member_add(MemberSet *s, Client *c, size_t *idx) {
+     if (s->count == s->cap) {
+         size_t cap = s->cap ? s->cap * 2 : 8;
+         Client **items = realloc(s->items, cap * sizeof(Client *));
+         if (!items) return -1;
+         s->items = items;
+         s->cap = cap;
+     }
+     *idx = s->count;
+     s->items[s->count] = c;
+     __atomic_store_n(&s->count, s->count + 1, __ATOMIC_RELAXED);
+     return 0;
+ }
+
+ // Saca la posición idx; devuelve el cliente que pasó a ocuparla (NULL si
+ // era la última) para que el llamador le corrija la posición.
+ static Client *member_remove(MemberSet *s, size_t idx) {
+     size_t last = s->count - 1;
+     Client *moved = idx != last ? s->items[last] : NULL;
+     s->items[idx] = s->items[last];
+     __atomic_store_n(&s->count, last, __ATOMIC_RELAXED);
+     return moved;
+ }
+
+ static int shard_add_member(Shard *sh, Client *c) {
+     return member_add(&sh->members, c, &c->shard_idx);
+ }
+ 
+ static void shard_remove_member(Shard *sh, Client *c) {
+     Client *moved = member_remove(&sh->members, c->shard_idx);
+     if (moved) moved->shard_idx = c->shard_idx;
+ }
+
+ // ----------------- Canales -----------------
+ // Un canal tiene un MemberSet por shard y cada shard solo toca el suyo,
+ // desde su hilo (unirse, salir y repartir pasan en el hilo del cliente o
+ // en el drenado de su buzón). Un mensaje al canal se reparte solo a los
+ // shards con miembros, así que el costo es proporcional a los miembros y
+ // no a los conectados. El canal global "general" no es un Channel: son
+ // los broadcasts de siempre, con shard->members.
+ //
+ // Los canales no se liberan (a lo sumo CHANNEL_MAX): así un Channel* que
+ // viaja en un buzón sigue siendo válido aunque el canal quede vacío.
+
+ #define CHANNEL_MAX 4096
+ #define CHANNEL_BUCKETS 1024
+
+ typedef struct Channel {
+     struct Channel *next;       // cadena del bucket
+     char name[CHANNEL_NAME_MAX];
+     uint32_t hash;
+     int members;                // en todos los shards (atómico)
+     MemberSet *shard;           // cfg.threads conjuntos
+ } Channel;
+
+ static struct {
+     pthread_mutex_t lock;
+     Channel *buckets[CHANNEL_BUCKETS];
+     size_t count;
+ } channels = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+ // Letras, dígitos, '-' y '_'
+ static int channel_name_ok(const char *name) {
+     size_t n = 0;
+     for (; name[n]; n++)
+         if (n + 1 >= CHANNEL_NAME_MAX || !(isalnum((unsigned char)name[n]) || name[n] == '-' || name[n] == '_'))
+             return 0;
+     return n > 0;
+ }
+
+ // NULL si no existe (y create es 0), si ya hay CHANNEL_MAX o sin memoria
+ static Channel *channel_get(const char *name, int create) {
+     uint32_t h = hash_name(name);
+     pthread_mutex_lock(&channels.lock);
+     Channel *ch = channels.buckets[h % CHANNEL_BUCKETS];
+     while (ch && (ch->hash != h || strcmp(ch->name, name) != 0)) ch = ch->next;
+     if (!ch && create && channels.count < CHANNEL_MAX && (ch = calloc(1, sizeof(Channel)))) {
+         ch->shard = calloc((size_t)cfg.threads, sizeof(MemberSet));
+         if (ch->shard) {
+             strncpy(ch->name, name, sizeof(ch->name) - 1);
+             ch->hash = h;
+             ch->next = channels.buckets[h % CHANNEL_BUCKETS];
+             channels.buckets[h % CHANNEL_BUCKETS] = ch;
+             channels.count++;
+         } else {
+             free(ch);
+             ch = NULL;
+         }
+     }
+     pthread_mutex_unlock(&channels.lock);
+     return ch;
+ }
+
+ // Posición del canal en c->chans, -1 si no es miembro
+ static int client_channel(const Client *c, const Channel *ch) {
+     for (int k = 0; k < c->nchans; k++)
+         if (c->chans[k].ch == ch) return k;
+     return -1;
+ }
+
+ // Igual, por nombre: los mensajes al canal no pasan por la tabla global
+ static int client_channel_named(const Client *c, const char *name) {
+     for (int k = 0; k < c->nchans; k++)
+         if (strcmp(c->chans[k].ch->name, name) == 0) return k;
+     return -1;
+ }
+
+ // Devuelve 1 si ya era miembro, -1 sin memoria y -2 con demasiados canales
+ static int channel_join(Client *c, Channel *ch) {
+     if (client_channel(c, ch) >= 0) return 1;
+     if (c->nchans == CLIENT_MAX_CHANNELS) return -2;
+     if (member_add(&ch->shard[c->shard->id], c, &c->chans[c->nchans].idx) < 0) return -1;
+     c->chans[c->nchans++].ch = ch;
+     __atomic_add_fetch(&ch->members, 1, __ATOMIC_RELAXED);
+     return 0;
+ }
+
+ static void channel_drop(Client *c, int k) {
+     Channel *ch = c->chans[k].ch;
+     Client *moved = member_remove(&ch->shard[c->shard->id], c->chans[k].idx);
+     if (moved) moved->chans[client_channel(moved, ch)].idx = c->chans[k].idx;
+     c->chans[k] = c->chans[--c->nchans];
+     __atomic_sub_fetch(&ch->members, 1, __ATOMIC_RELAXED);
+ }
+
+ static void channel_leave_all(Client *c) {
+     while (c->nchans) channel_drop(c, c->nchans - 1);
+ }
+ 
+ Client* find_client_by_name(const char *name);
+ 
+ // Los ids no se reutilizan: un cliente binario puede conservar el nombre
+ // de un id viejo sin riesgo de confundirlo con otro usuario.
+ #define SERVER_UID 1
+ static uint32_t next_uid = SERVER_UID + 1;
+ 
+ // Devuelve -2 si el nombre ya está en uso. Verificar e insertar bajo el
+ // mismo lock evita que dos shards registren el mismo nombre a la vez.
+ // Se llama desde el hilo del shard dueño del cliente; en *version queda
+ // la versión del directorio que incluye al cliente.
+ int add_client(Client *new_client, uint64_t *version) {
+     clients_lock();
+     int rc = -2;
+     if (!find_client_by_name(new_client->name)) {
+         rc = shard_add_member(new_client->shard, new_client);
+         if (rc == 0 && (rc = registry_insert(new_client)) < 0)
+             shard_remove_member(new_client->shard, new_client);
+     }
+     if (rc == 0) {
+         new_client->uid = next_uid++;
+         dir_append(new_client);
+         *version = registry.version;
+         log_action("Cliente registrado: %s (%s)", new_client->name, new_client->ip);
+     }
+     pthread_mutex_unlock(&clients_mutex);
+     return rc;
+ }
+ 
+ // ----------------- Colas de salida -----------------
+ 
+ static Client *client_new(struct lws *wsi) {
+     Client *c = pool_calloc(1, sizeof(Client));
+     if (!c) return NULL;
+     c->outq.items = pool_calloc(cfg.queue_max, sizeof(Frame *));
+     if (!c->outq.items) {
+         pool_free(c);
+         return NULL;
+     }
+     c->wsi = wsi;
+     c->refs = 1;
+     c->shard = cur_shard;
+     return c;
+ }
+ 
+ static void client_free(void *p) {
+     Client *c = p;
+     for (size_t i = 0; i < c->outq.count; i++)
+         frame_unref(c->outq.items[(c->outq.head + i) % cfg.queue_max]);
+     pool_free(c->outq.items);
+     free(c->rx);
+     free(c->uid_known);
+     pool_free(c);
+ }
+ 
+ static Client *client_ref(Client *c) {
+     __atomic_fetch_add(&c->refs, 1, __ATOMIC_RELAXED);
+     return c;
+ }
+ 
+ static void client_unref(Client *c) {
+     if (__atomic_sub_fetch(&c->refs, 1, __ATOMIC_ACQ_REL) == 0) epoch_retire(c, client_free);
+ }
+ 
+ // Como client_ref, pero falla si el cliente ya soltó su última referencia
+ // (solo lo puede ver un lector sin lock, antes de que se libere)
+ static Client *client_tryref(Client *c) {
+     int refs = __atomic_load_n(&c->refs, __ATOMIC_RELAXED);
+     do {
+         if (!refs) return NULL;
+     } while (!__atomic_compare_exchange_n(&c->refs, &refs, refs + 1, 1, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+     return c;
+ }
+ 
+ static int uid_known(const Client *c, uint32_t uid) {
+     return uid / 8 < c->uid_known_len && (c->uid_known[uid / 8] >> (uid % 8) & 1);
+ }
+ 
+ static void uid_forget(Client *c, uint32_t uid) {
+     if (uid / 8 < c->uid_known_len) c->uid_known[uid / 8] &= ~(1u << (uid % 8));
+ }
+ 
+ // Sin memoria no se marca: el anuncio se repite la próxima vez
+ static void uid_learn(Client *c, uint32_t uid) {
+     if (uid / 8 >= c->uid_known_len) {
+         size_t len = c->uid_known_len ? c->uid_known_len : 64;
+         while (uid / 8 >= len) len *= 2;
+         unsigned char *bits = realloc(c->uid_known, len);
+         if (!bits) return;
+         memset(bits + c->uid_known_len, 0, len - c->uid_known_len);
+         c->uid_known = bits;
+         c->uid_known_len = len;
+     }
+     c->uid_known[uid / 8] |= 1u << (uid % 8);
+ }
+ 
+ // Encola una referencia al frame (sin copiar el payload) aplicando la
+ // política de consumidor lento si la cola ya está llena. Devuelve 0 si
+ // quedó encolado.
+ static int queue_push(Client *c, Frame *f) {
+     OutQueue *q = &c->outq;
+     if (c->kill || c->closed) return -1;
+     if (q->count == cfg.queue_max) {
+         c->dropped++;
+         if (c->shard->metrics) stat_add(&c->shard->metrics->dropped, 1);
+         switch (cfg.slow_policy) {
+             case SLOW_DROP_OLDEST: {
+                 Frame *old = q->items[q->head];
+                 // Si se pierde un anuncio hay que repetirlo la próxima vez
+                 if (old->bind_uid) uid_forget(c, old->bind_uid);
+                 frame_unref(old);
+                 q->head = (q->head + 1) % cfg.queue_max;
+                 q->count--;
+                 if (c->shard->metrics) stat_add(&c->shard->metrics->queued, -1);
+                 break;
+             }
+             case SLOW_DROP_NEWEST:
+                 return -1;
+             case SLOW_DISCONNECT:
+                 c->kill = 1;
+                 lws_callback_on_writable(c->wsi);
+                 return -1;
+         }
+     }
+     q->items[(q->head + q->count) % cfg.queue_max] = frame_ref(f);
+     q->count++;
+     if (c->shard->metrics) stat_add(&c->shard->metrics->queued, 1);
+     lws_callback_on_writable(c->wsi);
+     return 0;
+ }
+ 
+ static Frame *bind_frame(uint32_t uid, const char *name);
+ 
+ // Encola f y, antes, un MSG_USER_ID por cada uid que f usa y c todavía no
+ // conoce. Solo desde el hilo del shard dueño de c.
+ static void client_enqueue(Client *c, Frame *f) {
+     const unsigned char *p = f->buf + LWS_PRE + f->len, *end = p + f->binds_len;
+     while (c->fmt == FMT_BIN && p < end) {
+         uint32_t uid;
+         memcpy(&uid, p, sizeof(uid));
+         const char *name = (const char *)p + sizeof(uid);
+         p += sizeof(uid) + strlen(name) + 1;
+         if (uid_known(c, uid)) continue;
+         Frame *bind = bind_frame(uid, name);
+         if (!bind) continue;
+         if (queue_push(c, bind) == 0) uid_learn(c, uid);
+         frame_unref(bind);
+     }
+     queue_push(c, f);
+ }
+ 
+ static int client_flush_queue(Client *c) {
+     for (;;) {
+         if (c->kill) {
+             log_msg(LOG_LVL_ERROR, "Cliente %s desconectado por cola llena (%lu descartados)", c->name, c->dropped);
+             lws_close_reason(c->wsi, LWS_CLOSE_STATUS_POLICY_VIOLATION, NULL, 0);
+             return -1;
+         }
+         if (!c->outq.count) return c->close_pending ? -1 : 0;
+         Frame *f = c->outq.items[c->outq.head];
+         c->outq.head = (c->outq.head + 1) % cfg.queue_max;
+         c->outq.count--;
+         if (c->shard->metrics) stat_add(&c->shard->metrics->queued, -1);
+ 
+         int n = lws_write(c->wsi, f->buf + LWS_PRE, f->len,
+                           c->fmt == FMT_BIN ? LWS_WRITE_BINARY : LWS_WRITE_TEXT);
+         size_t len = f->len;
+         frame_unref(f);
+         if (n < (int)len) return -1;
+         stat_add(&c->shard->tx_payload, len);
+         if (lws_send_pipe_choked(c->wsi)) {
+             lws_callback_on_writable(c->wsi);
+             return 0;
+         }
+     }
+ }
+ 
+ static uint64_t thread_cpu_ns(void) {
+     struct timespec ts;
+     clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+     return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+ }
+ 
+ // Vacía la cola mientras el socket acepte datos. Devuelve -1 si hay que
+ // cerrar la conexión. Con deflate activo se mide la CPU de la tanda, que
+ // es donde lws comprime.
+ static int client_flush(Client *c) {
+     if (!cfg.deflate) return client_flush_queue(c);
+     uint64_t t0 = thread_cpu_ns();
+     int rc = client_flush_queue(c);
+     stat_add(&c->shard->tx_cpu_ns, thread_cpu_ns() - t0);
+     return rc;
+ }
+ 
+ // Suma al shard los bytes que TCP confirmó desde la última muestra. Solo
+ // desde el hilo dueño, mientras el socket sigue abierto.
+ static void tx_sample(Client *c) {
+     struct tcp_info ti;
+     socklen_t len = sizeof(ti);
+     int fd = lws_get_socket_fd(c->wsi);
+     if (fd < 0 || getsockopt(fd, IPPROTO_TCP, TCP_INFO, &ti, &len) < 0) return;
+     if (ti.tcpi_bytes_acked > c->wire_acked) {
+         stat_add(&c->shard->tx_wire, ti.tcpi_bytes_acked - c->wire_acked);
+         c->wire_acked = ti.tcpi_bytes_acked;
+     }
+ }
+ 
+ // ----------------- Historial de broadcasts -----------------
+ 
+ static uint64_t history_seq;   // último número asignado (atómico)
+ 
+ static void history_pop(History *h) {
+     HistEntry *e = &h->items[h->head];
+     for (int i = 0; i < FMT_COUNT; i++)
+         if (e->frame[i]) frame_unref(e->frame[i]);
+     h->bytes -= e->bytes;
+     h->head = (h->head + 1) % cfg.history;
+     h->count--;
+ }
+ 
+ // Guarda una referencia a los frames del shard; descarta los más viejos
+ // hasta respetar el tope de entradas y la parte del tope de bytes que le
+ // toca a este shard.
+ static void history_push(Shard *sh, Frame *const fs[FMT_COUNT], uint64_t seq, time_t ts) {
+     History *h = &sh->history;
+     if (!h->items) return;
+     size_t cap = cfg.history_bytes / cfg.threads, bytes = 0;
+     for (int i = 0; i < FMT_COUNT; i++)
+         if (fs[i]) bytes += fs[i]->len;
+     if (bytes > cap) return;
+     while (h->count && (h->count == cfg.history || h->bytes + bytes > cap)) history_pop(h);
+     HistEntry *e = &h->items[(h->head + h->count) % cfg.history];
+     e->seq = seq;
+     e->ts = ts;
+     e->bytes = bytes;
+     for (int i = 0; i < FMT_COUNT; i++) e->frame[i] = fs[i] ? frame_ref(fs[i]) : NULL;
+     h->count++;
+     h->bytes += bytes;
+ }
+ 
+ // Encola a c los broadcasts con número mayor que since_seq y hora desde
+ // since_ts. Si no entran todos en la cola van los más recientes. Solo
+ // desde el hilo dueño de c.
+ static void history_replay(Client *c, uint64_t since_seq, time_t since_ts) {
+     History *h = &c->shard->history;
+     size_t match = 0;
+     for (size_t i = 0; i < h->count; i++) {
+         const HistEntry *e = &h->items[(h->head + i) % cfg.history];
+         if (e->seq > since_seq && e->ts >= since_ts && e->frame[c->fmt]) match++;
+     }
+     size_t room = cfg.queue_max - c->outq.count;
+     size_t skip = match > room ? match - room : 0;
+     for (size_t i = 0; i < h->count; i++) {
+         const HistEntry *e = &h->items[(h->head + i) % cfg.history];
+         if (e->seq <= since_seq || e->ts < since_ts || !e->frame[c->fmt]) continue;
+         if (skip) skip--;
+         else client_enqueue(c, e->frame[c->fmt]);
+     }
+ }
+ 
+ // "since" es un número de secuencia o una marca de tiempo como las del
+ // servidor (AAAA-MM-DDTHH:MM:SS, hora local)
+ static int history_since(const char *s, uint64_t *seq, time_t *ts) {
+     char *end;
+     if (*s >= '0' && *s <= '9') {
+         unsigned long long v = strtoull(s, &end, 10);
+         if (*end == '\0') {
+             *seq = v;
+             return 0;
+         }
+     }
+     struct tm tm_info = { 0 };
+     int n = 0;
+     if (sscanf(s, "%d-%d-%dT%d:%d:%d%n", &tm_info.tm_year, &tm_info.tm_mon, &tm_info.tm_mday,
+                &tm_info.tm_hour, &tm_info.tm_min, &tm_info.tm_sec, &n) != 6 || s[n])
+         return -1;
+     tm_info.tm_year -= 1900;
+     tm_info.tm_mon -= 1;
+     tm_info.tm_isdst = -1;
+     *ts = mktime(&tm_info);
+     return *ts == (time_t)-1 ? -1 : 0;
+ }
+ 
+ // ----------------- Buzones entre shards -----------------
+ 
+ static void shard_post(Shard *sh, Frame *const fs[FMT_COUNT], Client *target, Channel *ch,
+                        Client *exclude, uint64_t seq) {
+     MailItem *item = pool_alloc(sizeof(MailItem));
+     if (!item) return;
+     item->next = NULL;
+     for (int i = 0; i < FMT_COUNT; i++) item->frame[i] = fs[i] ? frame_ref(fs[i]) : NULL;
+     item->target = target ? client_ref(target) : NULL;
+     item->channel = ch;
+     item->exclude = exclude;
+     item->seq = seq;
+     pthread_mutex_lock(&sh->mb_lock);
+     int was_empty = !sh->mb_head;
+     if (sh->mb_tail) sh->mb_tail->next = item;
+     else sh->mb_head = item;
+     sh->mb_tail = item;
+     // Despierta solo al hilo del shard: la señal va al pt del wsi, y el
+     // hilo vacía su buzón en LWS_CALLBACK_EVENT_WAIT_CANCELLED. Con mb_lock
+     // tomado el wsi no puede cerrarse en el medio. Un shard sin conexiones
+     // no tiene wsi; ahí no queda otra que despertar a todos.
+     if (was_empty) {
+         if (sh->wake_wsi) lws_cancel_service_pt(sh->wake_wsi);
+         else lws_cancel_service(context);
+     }
+     pthread_mutex_unlock(&sh->mb_lock);
+ }
+
+ // Desde el hilo del shard, al abrirse y al cerrarse sus conexiones
+ static void shard_wake_attach(Shard *sh, struct lws *wsi) {
+     pthread_mutex_lock(&sh->mb_lock);
+     if (!sh->wake_wsi) sh->wake_wsi = wsi;
+     pthread_mutex_unlock(&sh->mb_lock);
+ }
+
+ static void shard_wake_detach(Shard *sh, struct lws *wsi) {
+     pthread_mutex_lock(&sh->mb_lock);
+     if (sh->wake_wsi == wsi) {
+         // Otro miembro del shard; members solo lo toca este mismo hilo
+         sh->wake_wsi = NULL;
+         for (size_t i = 0; i < sh->members.count && !sh->wake_wsi; i++)
+             if (sh->members.items[i]->wsi != wsi) sh->wake_wsi = sh->members.items[i]->wsi;
+     }
+     pthread_mutex_unlock(&sh->mb_lock);
+ }
+ 
+ // Los miembros del canal ch en este shard; NULL es el canal global
+ static MemberSet *shard_set(Shard *sh, Channel *ch) {
+     return ch ? &ch->shard[sh->id] : &sh->members;
+ }
+
+ static void shard_fanout(Shard *sh, Channel *ch, Frame *const fs[FMT_COUNT], Client *exclude) {
+     const MemberSet *set = shard_set(sh, ch);
+     for (size_t i = 0; i < set->count; i++) {
+         Client *c = set->items[i];
+         if (c != exclude && fs[c->fmt]) client_enqueue(c, fs[c->fmt]);
+     }
+ }
+ 
+ static void shard_drain_mailbox(Shard *sh) {
+     pthread_mutex_lock(&sh->mb_lock);
+     MailItem *item = sh->mb_head;
+     sh->mb_head = sh->mb_tail = NULL;
+     pthread_mutex_unlock(&sh->mb_lock);
+     while (item) {
+         MailItem *next = item->next;
+         if (item->target) {
+             Frame *f = item->frame[item->target->fmt];
+             if (f) client_enqueue(item->target, f);
+             client_unref(item->target);
+         } else {
+             shard_fanout(sh, item->channel, item->frame, item->exclude);
+             if (item->seq) history_push(sh, item->frame, item->seq, time(NULL));
+         }
+         for (int i = 0; i < FMT_COUNT; i++)
+             if (item->frame[i]) frame_unref(item->frame[i]);
+         pool_free(item);
+         item = next;
+     }
+ }
+ 
+ // Entrega a un cliente desde cualquier hilo; f debe estar en el formato
+ // del cliente.
+ static void deliver_frame(Client *c, Frame *f) {
+     if (c->shard == cur_shard) {
+         client_enqueue(c, f);
+         return;
+     }
+     Frame *fs[FMT_COUNT] = { NULL };
+     fs[c->fmt] = f;
+     shard_post(c->shard, fs, c, NULL, NULL, 0);
+ }
+ 
+ // Reparte a los miembros de ch (NULL: a todos los registrados) menos
+ // exclude: el shard actual encola directo y los demás reciben su copia de
+ // los frames por el buzón; a los shards sin miembros del canal no se les
+ // manda nada. Con seq > 0 cada shard guarda su copia en el historial.
+ static void broadcast_frames(Frame *const fs[FMT_COUNT], Channel *ch, Client *exclude, uint64_t seq) {
+     int used = 0;   // los frames originales ya quedaron asignados a un shard
+     if (cur_shard) {
+         shard_fanout(cur_shard, ch, fs, exclude);
+         if (seq) history_push(cur_shard, fs, seq, time(NULL));
+         used = 1;
+     }
+     for (int i = 0; i < cfg.threads; i++) {
+         Shard *sh = &shards[i];
+         if (sh == cur_shard) continue;
+         if (ch && !__atomic_load_n(&ch->shard[i].count, __ATOMIC_RELAXED)) continue;
+         if (!used) {
+             shard_post(sh, fs, NULL, ch, exclude, seq);
+             used = 1;
+             continue;
+         }
+         Frame *copy[FMT_COUNT] = { NULL };
+         for (int k = 0; k < FMT_COUNT; k++)
+             if (fs[k]) copy[k] = frame_copy(fs[k]);
+         shard_post(sh, copy, NULL, ch, exclude, seq);
+         for (int k = 0; k < FMT_COUNT; k++)
+             if (copy[k]) frame_unref(copy[k]);
+     }
+ }
+ 
+ static void directory_left(Client *c, uint64_t version);
+ 
+ void remove_client(struct lws *wsi) {
+     clients_lock();
+     Client *curr = registry_find_wsi(wsi);
+     uint64_t version = 0;   // > 0: estaba registrado
+     if (curr) {
+         if (curr->registered) {
+             shard_remove_member(curr->shard, curr);
+             registry_remove(curr);
+             version = registry.version;
+         } else {
+             registry_remove(curr);
+         }
+         channel_leave_all(curr);
+         timer_unlink(&curr->idle_timer);
+         if (curr->name[0]) log_action("Cliente eliminado: %s (%s)", curr->name, curr->ip);
+     }
+     pthread_mutex_unlock(&clients_mutex);
+     if (version) directory_left(curr, version);
+     if (curr) {
+         __atomic_fetch_sub(&fmt_clients[curr->fmt], 1, __ATOMIC_RELAXED);
+         __atomic_store_n(&curr->closed, 1, __ATOMIC_RELEASE);
+         client_unref(curr);
+     }
+ }
+ 
+ // Búsqueda sin lock; llamar con clients_mutex tomado
+ Client* find_client_by_name(const char *name) {
+     if (!registry.cap) return NULL;
+     uint32_t h = hash_name(name);
+     size_t mask = registry.cap - 1;
+     size_t i = h & mask;
+     while (registry.by_name[i]) {
+         Client *c = registry.by_name[i];
+         if (c->name_hash == h && strcmp(c->name, name) == 0)
+             return c;
+         i = (i + 1) & mask;
+     }
+     return NULL;
+ }
+ 
+ // Sondeo de by_name para client_lookup: puede ver la tabla a medio
+ // modificar, por eso el resultado solo vale si name_seq no cambió
+ static Client *name_probe(const char *name, uint32_t h) {
+     size_t cap = __atomic_load_n(&registry.cap, __ATOMIC_ACQUIRE);
+     Client **slots = __atomic_load_n(&registry.by_name, __ATOMIC_RELAXED);
+     if (!cap) return NULL;
+     size_t mask = cap - 1;
+     size_t i = h & mask;
+     for (size_t n = 0; n <= mask; n++, i = (i + 1) & mask) {
+         Client *c = __atomic_load_n(&slots[i], __ATOMIC_RELAXED);
+         if (!c) break;
+         if (c->name_hash == h && strcmp(c->name, name) == 0) return c;
+     }
+     return NULL;
+ }
+ 
+ // Busca por nombre y devuelve el cliente con una referencia tomada (o NULL).
+ // El llamador debe soltarla con client_unref. En los hilos de servicio no
+ // toma clients_mutex: lee la tabla como un seqlock (si un escritor la
+ // cambió mientras tanto, repite) y la época evita que el Client o el
+ // arreglo que se está leyendo se liberen en el medio.
+ static Client *client_lookup(const char *name) {
+     Client *c;
+     if (!cur_shard) {
+         clients_lock();
+         c = find_client_by_name(name);
+         if (c) client_ref(c);
+         pthread_mutex_unlock(&clients_mutex);
+         return c;
+     }
+     uint32_t h = hash_name(name);
+     epoch_enter();
+     for (;;) {
+         unsigned seq = __atomic_load_n(&registry.name_seq, __ATOMIC_ACQUIRE);
+         if (seq & 1) continue;
+         c = name_probe(name, h);
+         __atomic_thread_fence(__ATOMIC_ACQUIRE);
+         if (__atomic_load_n(&registry.name_seq, __ATOMIC_RELAXED) == seq) break;
+     }
+     if (c) c = client_tryref(c);
+     epoch_exit();
+     return c;
+ }
+ 
+ 
+ // ----------------- Tipos de mensaje -----------------
+ // El valor de cada tipo es también su byte en el protocolo binario, así
+ // que no se reordenan.
+ 
+ typedef enum {
+     MSG_UNKNOWN,
+     MSG_REGISTER,
+     MSG_BROADCAST,
+     MSG_PRIVATE,
+     MSG_LIST_USERS,
+     MSG_USER_INFO,
+     MSG_CHANGE_STATUS,
+     MSG_DISCONNECT,
+     // Solo del servidor al cliente
+     MSG_ERROR,
+     MSG_REGISTER_SUCCESS,
+     MSG_LIST_USERS_RESPONSE,
+     MSG_USER_INFO_RESPONSE,
+     MSG_STATUS_UPDATE,
+     MSG_USER_DISCONNECTED,
+     MSG_USER_ID,             // asocia un id a un nombre (solo binario)
+     MSG_HISTORY,             // del cliente: repetir broadcasts recientes
+     MSG_JOIN,                // unirse a un canal (target); el servidor confirma
+     MSG_LEAVE,               // salir de un canal; el servidor confirma
+     MSG_CHANNEL_MESSAGE,     // mensaje a los miembros del canal target
+     MSG_STATUS_BATCH,        // varios cambios de estado juntos
+     MSG_USER_JOINED,         // altas y bajas del directorio, a los suscriptos
+     MSG_USER_LEFT,
+     MSG_TYPE_COUNT
+ } MsgType;
+ 
+ _Static_assert(MSG_TYPE_COUNT <= METRIC_TYPES, "METRIC_TYPES es chico");
+ 
+ static const char *const msg_names[MSG_TYPE_COUNT] = {
+     [MSG_REGISTER]            = "register",
+     [MSG_BROADCAST]           = "broadcast",
+     [MSG_PRIVATE]             = "private",
+     [MSG_LIST_USERS]          = "list_users",
+     [MSG_USER_INFO]           = "user_info",
+     [MSG_CHANGE_STATUS]       = "change_status",
+     [MSG_DISCONNECT]          = "disconnect",
+     [MSG_ERROR]               = "error",
+     [MSG_REGISTER_SUCCESS]    = "register_success",
+     [MSG_LIST_USERS_RESPONSE] = "list_users_response",
+     [MSG_USER_INFO_RESPONSE]  = "user_info_response",
+     [MSG_STATUS_UPDATE]       = "status_update",
+     [MSG_USER_DISCONNECTED]   = "user_disconnected",
+     [MSG_HISTORY]             = "history",
+     [MSG_JOIN]                = "join",
+     [MSG_LEAVE]               = "leave",
+     [MSG_CHANNEL_MESSAGE]     = "channel_message",
+     [MSG_STATUS_BATCH]        = "status_batch",
+     [MSG_USER_JOINED]         = "user_joined",
+     [MSG_USER_LEFT]           = "user_left",
+ };
+ 
+ // Tipos que un cliente puede mandar
+ static int msg_inbound(unsigned type) {
+     return (type >= MSG_REGISTER && type <= MSG_DISCONNECT) ||
+            (type >= MSG_HISTORY && type <= MSG_CHANNEL_MESSAGE);
+ }
+ 
+ typedef struct {
+     char user[50];
+     uint32_t uid;
+     char status[MAX_STATUS_LEN];
+ } StatusChange;
+ 
+ // Una página del directorio: las posiciones [start, end) de registry.dir,
+ // con count usuarios (sin contar huecos). Llamar con clients_mutex tomado.
+ typedef struct {
+     size_t start, end, count;
+     uint32_t cursor;     // el pedido: se listan los uid > cursor
+     uint32_t next;       // cursor de la página siguiente (0 = no hay)
+ } DirPage;
+ 
+ // Mensaje saliente, independiente del formato. Cada formato lo codifica
+ // a lo sumo una vez por envío, sin importar cuántos destinatarios tenga.
+ typedef struct {
+     MsgType type;
+     const char *sender, *target, *content;
+     uint32_t sender_uid, target_uid;   // 0: el nombre va en línea
+     const char *user, *status;         // status_update / user_id
+     uint32_t user_uid;
+     const Client *info;                // user_info_response (NULL: no existe)
+     const StatusChange *changes;       // status_batch
+     size_t nchanges;
+     const DirPage *page;               // list_users_response
+     uint64_t version;                  // del directorio (list_users_response y deltas)
+     uint64_t seq;                      // número en el historial (0 = no entra)
+     time_t ts;                         // hora del mensaje (0 = ahora)
+ } OutMsg;
+ 
+ // ----------------- Escritor de frames -----------------
+ // Las respuestas se escriben directo en el payload del Frame, sin armar
+ // árboles de cJSON. Cada mensaje se genera dos veces con el mismo código:
+ // la primera solo cuenta bytes (out == NULL) y la segunda escribe en un
+ // frame del tamaño exacto.
+ 
+ typedef struct {
+     char *out;        // NULL: solo se cuentan bytes
+     size_t len;
+     char last;        // último carácter escrito, para decidir las comas
+     time_t now;       // misma marca de tiempo en las dos pasadas
+     const char *ts;
+ } FrameWriter;
+ 
+ static void fw_put(FrameWriter *w, const void *s, size_t n) {
+     if (!n) return;
+     if (w->out) memcpy(w->out + w->len, s, n);
+     w->len += n;
+     w->last = ((const char *)s)[n - 1];
+ }
+ 
+ // --- JSON ---
+ // La salida es idéntica byte a byte a la de cJSON_PrintUnformatted, que es
+ // lo que espera el cliente.
+ 
+ static void jw_sep(FrameWriter *w) {
+     if (w->len && w->last != '{' && w->last != '[' && w->last != ':')
+         fw_put(w, ",", 1);
+ }
+ 
+ // Mismos escapes que cJSON: comillas, barra invertida, los cinco de
+ // control con nombre y \u00XX para el resto; lo demás pasa tal cual.
+ static void jw_string(FrameWriter *w, const char *s) {
+     static const char hex[] = "0123456789abcdef";
+     fw_put(w, "\"", 1);
+     const char *run = s;
+     for (; *s; s++) {
+         unsigned char ch = (unsigned char)*s;
+         if (ch >= 0x20 && ch != '"' && ch != '\\') continue;
+         fw_put(w, run, (size_t)(s - run));
+         char esc[6] = { '\\', 0 };
+         size_t n = 2;
+         switch (ch) {
+             case '"':  esc[1] = '"'; break;
+             case '\\': esc[1] = '\\'; break;
+             case '\b': esc[1] = 'b'; break;
+             case '\f': esc[1] = 'f'; break;
+             case '\n': esc[1] = 'n'; break;
+             case '\r': esc[1] = 'r'; break;
+             case '\t': esc[1] = 't'; break;
+             default:
+                 memcpy(esc + 1, "u00", 3);
+                 esc[4] = hex[ch >> 4];
+                 esc[5] = hex[ch & 0xF];
+                 n = 6;
+         }
+         fw_put(w, esc, n);
+         run = s + 1;
+     }
+     fw_put(w, run, (size_t)(s - run));
+     fw_put(w, "\"", 1);
+ }
+ 
+ static void jw_key(FrameWriter *w, const char *key) {
+     jw_sep(w);
+     jw_string(w, key);
+     fw_put(w, ":", 1);
+ }
+ 
+ // Como cJSON_AddStringToObject: con valor NULL la clave no aparece
+ static void jw_field(FrameWriter *w, const char *key, const char *val) {
+     if (!val) return;
+     jw_key(w, key);
+     jw_string(w, val);
+ }
+ 
+ static void jw_open(FrameWriter *w, char ch) {
+     jw_sep(w);
+     fw_put(w, &ch, 1);
+ }
+ 
+ static void jw_close(FrameWriter *w, char ch) {
+     fw_put(w, &ch, 1);
+ }
+ 
+ static void jw_u64(FrameWriter *w, const char *key, uint64_t v) {
+     char num[24];
+     jw_key(w, key);
+     fw_put(w, num, (size_t)snprintf(num, sizeof(num), "%llu", (unsigned long long)v));
+ }
+ 
+ // list_users_response y user_info_response: llamar con clients_mutex tomado
+ static void json_build(FrameWriter *w, const OutMsg *m) {
+     jw_open(w, '{');
+     jw_field(w, "type", msg_names[m->type]);
+     jw_field(w, "sender", m->sender);
+     switch (m->type) {
+         case MSG_LIST_USERS_RESPONSE: {
+             const DirPage *p = m->page;
+             jw_key(w, "content");
+             jw_open(w, '[');
+             for (size_t i = p->start; i < p->end; i++) {
+                 if (!registry.dir[i].c) continue;
+                 jw_sep(w);
+                 jw_string(w, registry.dir[i].c->name);
+             }
+             jw_close(w, ']');
+             jw_field(w, "timestamp", w->ts);
+             jw_u64(w, "version", m->version);
+             jw_u64(w, "cursor", p->cursor);
+             if (p->next) jw_u64(w, "next", p->next);
+             break;
+         }
+         case MSG_USER_JOINED:
+         case MSG_USER_LEFT:
+             jw_field(w, "content", m->user);
+             jw_field(w, "timestamp", w->ts);
+             jw_u64(w, "version", m->version);
+             break;
+         case MSG_USER_INFO_RESPONSE:
+             jw_field(w, "target", m->target);
+             jw_field(w, "timestamp", w->ts);
+             if (m->info) {
+                 jw_key(w, "content");
+                 jw_open(w, '{');
+                 jw_field(w, "ip", m->info->ip);
+                 jw_field(w, "status", m->info->status);
+                 jw_close(w, '}');
+             } else {
+                 jw_field(w, "content", "Usuario no encontrado");
+             }
+             break;
+         case MSG_STATUS_UPDATE:
+             jw_key(w, "content");
+             jw_open(w, '{');
+             jw_field(w, "user", m->user);
+             jw_field(w, "status", m->status);
+             jw_close(w, '}');
+             jw_field(w, "timestamp", w->ts);
+             break;
+         case MSG_STATUS_BATCH:
+             jw_key(w, "content");
+             jw_open(w, '[');
+             for (size_t i = 0; i < m->nchanges; i++) {
+                 jw_open(w, '{');
+                 jw_field(w, "user", m->changes[i].user);
+                 jw_field(w, "status", m->changes[i].status);
+                 jw_close(w, '}');
+             }
+             jw_close(w, ']');
+             jw_field(w, "timestamp", w->ts);
+             break;
+         default:
+             jw_field(w, "target", m->target);
+             jw_field(w, "content", m->content);
+             jw_field(w, "timestamp", w->ts);
+             if (m->seq) jw_u64(w, "seq", m->seq);
+     }
+     jw_close(w, '}');
+ }
+ 
+ // --- Binario ---
+ // Cada frame de "chat-protocol-bin" lleva uno o más registros, cada uno
+ // precedido por su largo en varint (LEB128). Un registro es:
+ //
+ //   u8 tipo (MsgType) | u64 timestamp epoch LE | usuario sender | usuario target | cuerpo
+ //
+ // Un "usuario" es un varint v: 0 = ausente, par = id interno v>>1 y impar
+ // = nombre en línea de v>>1 bytes. El servidor nombra a los usuarios por
+ // id y, antes del primer registro con un id que la conexión no conoce,
+ // le manda el MSG_USER_ID de ese id; los clientes pueden mandar
+ // nombres en línea y referirse por id solo a sí mismos o al servidor.
+ // El id 1 (SERVER_UID) está reservado: es siempre "server", nunca se
+ // anuncia y los clientes lo traducen sin esperar un MSG_USER_ID.
+ // Cuerpo según el tipo (str = varint largo + bytes; opt = varint largo+1,
+ // 0 = ausente):
+ //
+ //   list_users_response  varint n, n x (varint id, str nombre), varint versión,
+ //                        varint cursor, varint siguiente (0 = última página)
+ //   user_info_response   u8 existe; si existe str ip, str estado, si no opt content
+ //   status_update        usuario, str estado
+ //   status_batch         varint n, n x (usuario, str estado)
+ //   user_joined/left     usuario, varint versión
+ //   user_id              varint id, str nombre
+ //   los demás            opt content
+ //
+ // Los broadcasts que entran al historial agregan al final varint seq; los
+ // lectores ignoran lo que sobra después del cuerpo.
+ 
+ static void bw_u8(FrameWriter *w, uint8_t v) {
+     fw_put(w, &v, 1);
+ }
+ 
+ static void bw_varint(FrameWriter *w, uint64_t v) {
+     uint8_t buf[10];
+     size_t n = 0;
+     do {
+         buf[n] = v & 0x7F;
+         v >>= 7;
+         if (v) buf[n] |= 0x80;
+         n++;
+     } while (v);
+     fw_put(w, buf, n);
+ }
+ 
+ static void bw_u64(FrameWriter *w, uint64_t v) {
+     uint8_t buf[8];
+     for (int i = 0; i < 8; i++) buf[i] = (uint8_t)(v >> (8 * i));
+     fw_put(w, buf, 8);
+ }
+ 
+ static void bw_str(FrameWriter *w, const char *s) {
+     size_t n = strlen(s);
+     bw_varint(w, n);
+     fw_put(w, s, n);
+ }
+ 
+ static void bw_opt(FrameWriter *w, const char *s) {
+     if (!s) {
+         bw_varint(w, 0);
+         return;
+     }
+     size_t n = strlen(s);
+     bw_varint(w, n + 1);
+     fw_put(w, s, n);
+ }
+ 
+ static void bw_user(FrameWriter *w, const char *name, uint32_t uid) {
+     if (uid) {
+         bw_varint(w, (uint64_t)uid << 1);
+     } else if (name) {
+         size_t n = strlen(name);
+         bw_varint(w, ((uint64_t)n << 1) | 1);
+         fw_put(w, name, n);
+     } else {
+         bw_varint(w, 0);
+     }
+ }
+ 
+ static void bin_build(FrameWriter *w, const OutMsg *m) {
+     bw_u8(w, (uint8_t)m->type);
+     bw_u64(w, (uint64_t)w->now);
+     bw_user(w, m->sender, m->sender_uid);
+     bw_user(w, m->target, m->target_uid);
+     switch (m->type) {
+         case MSG_LIST_USERS_RESPONSE: {
+             const DirPage *p = m->page;
+             bw_varint(w, p->count);
+             for (size_t i = p->start; i < p->end; i++) {
+                 const Client *c = registry.dir[i].c;
+                 if (!c) continue;
+                 bw_varint(w, c->uid);
+                 bw_str(w, c->name);
+             }
+             bw_varint(w, m->version);
+             bw_varint(w, p->cursor);
+             bw_varint(w, p->next);
+             break;
+         }
+         case MSG_USER_JOINED:
+         case MSG_USER_LEFT:
+             bw_user(w, m->user, m->user_uid);
+             bw_varint(w, m->version);
+             break;
+         case MSG_USER_INFO_RESPONSE:
+             bw_u8(w, m->info != NULL);
+             if (m->info) {
+                 bw_str(w, m->info->ip);
+                 bw_str(w, m->info->status);
+             } else {
+                 bw_opt(w, "Usuario no encontrado");
+             }
+             break;
+         case MSG_STATUS_UPDATE:
+             bw_user(w, m->user, m->user_uid);
+             bw_str(w, m->status);
+             break;
+         case MSG_STATUS_BATCH:
+             bw_varint(w, m->nchanges);
+             for (size_t i = 0; i < m->nchanges; i++) {
+                 bw_user(w, m->changes[i].user, m->changes[i].uid);
+                 bw_str(w, m->changes[i].status);
+             }
+             break;
+         case MSG_USER_ID:
+             bw_varint(w, m->user_uid);
+             bw_str(w, m->user);
+             break;
+         default:
+             bw_opt(w, m->content);
+             if (m->seq) bw_varint(w, m->seq);
+     }
+ }
+ 
+ // Codifica m en el formato pedido; NULL si el formato no tiene ese tipo
+ static void bind_put(FrameWriter *w, uint32_t uid, const char *name) {
+     if (!uid || uid == SERVER_UID) return;
+     fw_put(w, &uid, sizeof(uid));
+     fw_put(w, name, strlen(name) + 1);
+ }
+ 
+ // Los uid que bin_build escribe en lugar del nombre, para el anuncio
+ // perezoso de client_enqueue
+ static void bind_build(FrameWriter *w, const OutMsg *m) {
+     bind_put(w, m->sender_uid, m->sender);
+     bind_put(w, m->target_uid, m->target);
+     switch (m->type) {
+         case MSG_USER_JOINED:
+         case MSG_USER_LEFT:
+         case MSG_STATUS_UPDATE:
+             bind_put(w, m->user_uid, m->user);
+             break;
+         case MSG_STATUS_BATCH:
+             for (size_t i = 0; i < m->nchanges; i++)
+                 bind_put(w, m->changes[i].uid, m->changes[i].user);
+             break;
+         default:
+             break;
+     }
+ }
+ 
+ static Frame *encode_msg(WireFormat fmt, const OutMsg *m) {
+     if (fmt == FMT_JSON && m->type == MSG_USER_ID) return NULL;
+     time_t now = m->ts ? m->ts : time(NULL);
+     FrameWriter w = { .now = now, .ts = timestamp_at(now) };
+     if (fmt == FMT_JSON) json_build(&w, m);
+     else bin_build(&w, m);
+ 
+     size_t body = w.len, prefix = 0, binds = 0;
+     if (fmt == FMT_BIN) {
+         FrameWriter lw = { 0 };
+         bw_varint(&lw, body);
+         prefix = lw.len;
+         lw.len = 0;
+         bind_build(&lw, m);
+         binds = lw.len;
+     }
+     Frame *f = frame_alloc(prefix + body, binds);
+     if (!f) return NULL;
+     w = (FrameWriter){ .out = (char *)f->buf + LWS_PRE, .now = now, .ts = w.ts };
+     if (fmt == FMT_JSON) {
+         json_build(&w, m);
+     } else {
+         bw_varint(&w, body);
+         bin_build(&w, m);
+         bind_build(&w, m);
+         if (m->type == MSG_USER_ID) f->bind_uid = m->user_uid;
+     }
+     return f;
+ }
+ 
+ static Frame *bind_frame(uint32_t uid, const char *name) {
+     OutMsg m = { .type = MSG_USER_ID, .sender = "server", .sender_uid = SERVER_UID,
+                  .user = name, .user_uid = uid };
+     return encode_msg(FMT_BIN, &m);
+ }
+ 
+ // ----------------- Envío de mensajes -----------------
+ 
+ static void send_frame(Client *c, Frame *f) {
+     if (!f) return;
+     deliver_frame(c, f);
+     frame_unref(f);
+ }
+ 
+ void send_ws_text(Client *c, const char *msg) {
+     send_frame(c, frame_new(msg, strlen(msg)));
+ }
+ 
+ static void send_msg(Client *c, const OutMsg *m) {
+     send_frame(c, encode_msg(c->fmt, m));
+ }
+ 
+ // Codifica solo los formatos que tienen alguna conexión abierta, salvo
+ // los que van al historial: esos se codifican en todos porque se repiten
+ // a quien se conecte después. Por lo mismo llevan el remitente con su
+ // nombre y no con su uid: quien los reciba en la repetición puede no
+ // haber visto nunca el user_id de ese uid.
+ static void fanout_msg(const OutMsg *m, Channel *ch, Client *exclude) {
+     Metrics *mx = metrics_self();
+     uint64_t t0 = mx ? mono_ns() : 0;
+     OutMsg inline_sender;
+     if (m->seq && m->sender_uid) {
+         inline_sender = *m;
+         inline_sender.sender_uid = 0;
+         m = &inline_sender;
+     }
+     Frame *fs[FMT_COUNT];
+     for (int i = 0; i < FMT_COUNT; i++)
+         fs[i] = m->seq || __atomic_load_n(&fmt_clients[i], __ATOMIC_RELAXED) ? encode_msg(i, m) : NULL;
+     broadcast_frames(fs, ch, exclude, m->seq);
+     for (int i = 0; i < FMT_COUNT; i++)
+         if (fs[i]) frame_unref(fs[i]);
+     if (mx) hist_observe(&mx->fanout, mono_ns() - t0);
+ }
+
+ static void broadcast_msg(const OutMsg *m, Client *exclude) {
+     fanout_msg(m, NULL, exclude);
+ }
+ 
+ static void send_server(Client *c, MsgType type, const char *content) {
+     OutMsg m = { .type = type, .sender = "server", .sender_uid = SERVER_UID, .content = content };
+     send_msg(c, &m);
+ }
+ 
+ static void broadcast_server(MsgType type, const char *content, Client *exclude) {
+     OutMsg m = { .type = type, .sender = "server", .sender_uid = SERVER_UID, .content = content };
+     broadcast_msg(&m, exclude);
+ }
+ 
+ // ----------------- Directorio de usuarios -----------------
+ // list_users pagina el directorio en orden de uid: el content del pedido
+ // es "cursor=N&limit=N&version=N&subscribe=1" (todo opcional). Cada
+ // respuesta lleva la versión del directorio y, si hay más, el cursor de la
+ // siguiente página. Quien ya tiene la versión actual recibe una página
+ // vacía. Los suscriptos reciben user_joined / user_left con la versión
+ // nueva y mantienen su copia sin volver a pedir la lista.
+ //
+ // Los suscriptos son los miembros de un canal interno (su nombre no pasa
+ // channel_name_ok, así que nadie se une por join): un alta o baja se
+ // reparte solo a ellos, con el mismo mecanismo que los canales.
+ 
+ #define USER_PAGE 100          // por defecto, y la que se manda al registrarse
+ #define USER_PAGE_MAX 1000
+ #define DIRECTORY_CHANNEL "*directorio"
+ 
+ static Channel *directory_channel;
+ 
+ typedef struct {
+     uint32_t cursor;
+     size_t limit;
+     uint64_t version;    // la que ya tiene el cliente (0 = ninguna)
+     int subscribe;
+ } ListQuery;
+ 
+ // Sin content es el pedido de siempre: la lista completa
+ static int list_query(const char *s, ListQuery *q) {
+     *q = (ListQuery){ .limit = s ? USER_PAGE : SIZE_MAX };
+     while (s && *s) {
+         const char *eq = strchr(s, '=');
+         if (!eq) return -1;
+         char *end;
+         unsigned long long v = strtoull(eq + 1, &end, 10);
+         if (end == eq + 1 || (*end && *end != '&')) return -1;
+         size_t klen = (size_t)(eq - s);
+         if (klen == 6 && memcmp(s, "cursor", 6) == 0) q->cursor = v > UINT32_MAX ? UINT32_MAX : (uint32_t)v;
+         else if (klen == 5 && memcmp(s, "limit", 5) == 0) q->limit = v < 1 ? 1 : v > USER_PAGE_MAX ? USER_PAGE_MAX : v;
+         else if (klen == 7 && memcmp(s, "version", 7) == 0) q->version = v;
+         else if (klen == 9 && memcmp(s, "subscribe", 9) == 0) q->subscribe = v != 0;
+         else return -1;
+         s = *end ? end + 1 : end;
+     }
+     return 0;
+ }
+ 
+ // Llamar con clients_mutex tomado
+ static void dir_page(const ListQuery *q, DirPage *p) {
+     *p = (DirPage){ .cursor = q->cursor };
+     p->start = p->end = dir_lower_bound(q->cursor + 1);
+     if (q->version && q->version == registry.version && !q->cursor) return;   // ya está al día
+     while (p->end < registry.dir_len && p->count < q->limit)
+         if (registry.dir[p->end++].c) p->count++;
+     // Hay siguiente si queda algún registrado después
+     for (size_t i = p->end; i < registry.dir_len; i++)
+         if (registry.dir[i].c) {
+             p->next = registry.dir[p->end - 1].uid;
+             break;
+         }
+ }
+ 
+ void send_user_list(Client *to, const ListQuery *q) {
+     OutMsg m = { .type = MSG_LIST_USERS_RESPONSE, .sender = "server", .sender_uid = SERVER_UID };
+     DirPage page;
+     clients_lock();
+     dir_page(q, &page);
+     m.page = &page;
+     m.version = registry.version;
+     Frame *f = encode_msg(to->fmt, &m);
+     pthread_mutex_unlock(&clients_mutex);
+     send_frame(to, f);
+ }
+ 
+ static void directory_delta(MsgType type, const Client *c, uint64_t version) {
+     if (!directory_channel || !__atomic_load_n(&directory_channel->members, __ATOMIC_RELAXED)) return;
+     OutMsg m = { .type = type, .sender = "server", .sender_uid = SERVER_UID,
+                  .user = c->name, .user_uid = c->uid, .version = version };
+     fanout_msg(&m, directory_channel, NULL);
+ }
+ 
+ static void directory_left(Client *c, uint64_t version) {
+     directory_delta(MSG_USER_LEFT, c, version);
+ }
+ 
+ void send_user_info(Client *to, const char *target_name) {
+     OutMsg m = { .type = MSG_USER_INFO_RESPONSE, .sender = "server", .sender_uid = SERVER_UID,
+                  .target = target_name };
+     clients_lock();
+     m.info = find_client_by_name(target_name);
+     if (m.info) m.target_uid = m.info->uid;
+     Frame *f = encode_msg(to->fmt, &m);
+     pthread_mutex_unlock(&clients_mutex);
+     send_frame(to, f);
+ }
+ 
+ // Avisa a todos que user cambió de estado
+ static void broadcast_status(const char *user, uint32_t uid, const char *status) {
+     OutMsg m = { .type = MSG_STATUS_UPDATE, .sender = "server", .sender_uid = SERVER_UID,
+                  .user = user, .user_uid = uid, .status = status };
+     broadcast_msg(&m, NULL);
+ }
+ 
+ // ----------------- Presencia -----------------
+ // Los cambios de estado (change_status y el paso a INACTIVO) no se
+ // anuncian uno por uno: se anotan los clientes que cambiaron y cada
+ // --presence-ms el shard 0 manda un solo status_batch a todos con el
+ // estado final de cada uno. Un cliente aparece una vez por tanda aunque
+ // cambie varias veces, y si volvió al estado que ya se había anunciado
+ // no aparece. Así una tanda de usuarios que pasan a INACTIVO en el mismo
+ // segundo es un frame por cliente y no uno por cambio.
+ 
+ static struct {
+     pthread_mutex_t lock;
+     Client **pending;    // con referencia tomada
+     size_t count, cap;
+     lws_sorted_usec_list_t sul;
+ } presence = { .lock = PTHREAD_MUTEX_INITIALIZER };
+ 
+ // c pasó de prev a status; se llama sin clients_mutex
+ static void presence_changed(Client *c, const char *prev, const char *status) {
+     if (cfg.presence_ms) {
+         pthread_mutex_lock(&presence.lock);
+         int queued = c->presence_queued;
+         if (!queued && presence.count == presence.cap) {
+             size_t cap = presence.cap ? presence.cap * 2 : 64;
+             Client **pending = realloc(presence.pending, cap * sizeof(Client *));
+             if (pending) {
+                 presence.pending = pending;
+                 presence.cap = cap;
+             }
+         }
+         if (!queued && presence.count < presence.cap) {
+             c->presence_queued = queued = 1;
+             strncpy(c->presence_prev, prev, sizeof(c->presence_prev) - 1);
+             presence.pending[presence.count++] = client_ref(c);
+         }
+         pthread_mutex_unlock(&presence.lock);
+         if (queued) return;
+     }
+     // Sin tandas (o sin memoria para anotarlo): se anuncia ya
+     broadcast_status(c->name, c->uid, status);
+ }
+ 
+ // Corre en el hilo del shard 0 cada cfg.presence_ms
+ static void presence_flush(lws_sorted_usec_list_t *sul) {
+     pthread_mutex_lock(&presence.lock);
+     Client **list = NULL;
+     size_t n = presence.count;
+     StatusChange *changes = n ? malloc(n * sizeof(StatusChange)) : NULL;
+     if (changes) {
+         list = presence.pending;
+         presence.pending = NULL;
+         presence.count = presence.cap = 0;
+         for (size_t i = 0; i < n; i++) {
+             list[i]->presence_queued = 0;
+             memcpy(changes[i].status, list[i]->presence_prev, sizeof(changes[i].status));
+         }
+     } else {
+         n = 0;   // sin memoria: la tanda sigue pendiente hasta la próxima vuelta
+     }
+     pthread_mutex_unlock(&presence.lock);
+ 
+     // Estado final de cada uno; quedan solo los que cambiaron de verdad
+     size_t k = 0;
+     if (changes) {
+         clients_lock();
+         for (size_t i = 0; i < n; i++) {
+             Client *c = list[i];
+             if (__atomic_load_n(&c->closed, __ATOMIC_ACQUIRE) || strcmp(c->status, changes[i].status) == 0)
+                 continue;
+             StatusChange *sc = &changes[k++];
+             memcpy(sc->status, c->status, sizeof(sc->status));
+             memcpy(sc->user, c->name, sizeof(sc->user));
+             sc->uid = c->uid;
+         }
+         pthread_mutex_unlock(&clients_mutex);
+     }
+     if (k) {
+         OutMsg m = { .type = MSG_STATUS_BATCH, .sender = "server", .sender_uid = SERVER_UID,
+                      .changes = changes, .nchanges = k };
+         broadcast_msg(&m, NULL);
+     }
+     for (size_t i = 0; i < n; i++) client_unref(list[i]);
+     free(list);
+     free(changes);
+     if (!force_exit)
+         lws_sul_schedule(context, 0, sul, presence_flush, cfg.presence_ms * LWS_US_PER_MS);
+ }
+ 
+ // ----------------- Almacén de mensajes -----------------
+ // Con --store DIR cada broadcast y privado se guarda en segmentos de solo
+ // agregado (DIR/<primer seq>.seg). Junto a cada segmento hay un índice
+ // (.idx) de entradas fijas mapeado en memoria, en orden de seq: número,
+ // hora, offset y largo de cada registro. Una lectura por rango busca en
+ // binario el segmento y la entrada, y lee con pread solo esos registros.
+ //
+ // Los hilos de servicio solo arman el registro y lo encolan; el número de
+ // secuencia se asigna al encolar, así que el orden del archivo es el de
+ // los números. Un hilo escritor agrega los registros al segmento y hace
+ // fdatasync en tandas (a lo sumo uno cada --store-fsync-ms). El índice no
+ // se sincroniza: al arrancar se rehace desde el segmento lo que falte y se
+ // corta un registro incompleto al final.
+ //
+ // Los privados a usuarios desconectados se marcan STORE_OFFLINE y se
+ // entregan cuando el usuario se registra; un registro STORE_DELIVERED
+ // anota hasta qué número se entregó para no repetirlos tras reiniciar.
+ // Solo se guardan privados para nombres que ya se registraron alguna vez:
+ // el primer registro de cada nombre deja un STORE_USER.
+ // Los enteros van en el orden de bytes del host.
+ 
+ #define STORE_OFFLINE 1              // flag: privado a un usuario desconectado
+ #define STORE_DELIVERED 0xFF         // tipo: entrega offline (target, content = seq)
+ #define STORE_USER 0xFE              // tipo: primer registro de un nombre (sender)
+ #define STORE_NULL UINT32_MAX        // content_len de un content ausente
+ #define STORE_QUEUE_MAX 65536        // registros esperando al escritor
+ #define STORE_IOV 64                 // registros por pwritev
+ #define OFFLINE_MAX 1000             // privados pendientes por usuario
+ #define OFFLINE_BUCKETS 1024
+ 
+ typedef struct {
+     uint32_t len;            // registro completo, cabecera incluida
+     uint32_t crc;            // crc32 desde seq hasta el final
+     uint64_t seq;
+     int64_t ts;
+     uint8_t type, flags;
+     uint16_t sender_len, target_len, pad;
+     uint32_t content_len;
+     uint32_t pad2;
+ } RecHdr;
+ 
+ typedef struct {
+     uint64_t seq;
+     int64_t ts;
+     uint64_t off;
+     uint32_t len;            // 0 = entrada libre
+     uint8_t type, flags;
+     uint16_t pad;
+ } IdxEntry;
+ 
+ typedef struct {
+     uint64_t first_seq;
+     int fd;
+     IdxEntry *idx;           // mapeado, cap entradas
+     size_t cap;
+     size_t count;            // entradas publicadas (atómico)
+     uint64_t size;           // bytes escritos; solo el escritor
+ } Segment;
+ 
+ typedef struct StoreRec {
+     struct StoreRec *next;
+     size_t len;
+     unsigned char buf[];     // RecHdr + sender + target + content
+ } StoreRec;
+ 
+ typedef struct OfflineBox {
+     struct OfflineBox *next;
+     char name[50];
+     uint64_t *seqs;          // privados pendientes, en orden
+     size_t count, cap;
+     uint64_t delivered;      // entregados hasta este número
+ } OfflineBox;
+ 
+ // Registro leído del almacén; los strings apuntan a mem
+ typedef struct {
+     RecHdr h;
+     const char *sender, *target, *content;
+     char *mem;
+ } StoredMsg;
+ 
+ static struct {
+     int enabled;
+     int dir_fd;
+     pthread_mutex_t lock;        // cola, seq y last_ts
+     pthread_cond_t cond;
+     StoreRec *head, *tail;
+     size_t pending;
+     int64_t last_ts;
+     pthread_mutex_t seg_lock;    // arreglo de segmentos
+     Segment **segs;
+     size_t nsegs, segs_cap;
+     pthread_mutex_t off_lock;
+     OfflineBox *offline[OFFLINE_BUCKETS];
+     uint64_t written, dropped;
+     pthread_t thread;
+     int stop;
+ } store = { .dir_fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER,
+             .seg_lock = PTHREAD_MUTEX_INITIALIZER, .off_lock = PTHREAD_MUTEX_INITIALIZER };
+ 
+ static uint32_t crc_table[256];
+ 
+ static void crc32_init(void) {
+     for (uint32_t i = 0; i < 256; i++) {
+         uint32_t c = i;
+         for (int k = 0; k < 8; k++) c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+         crc_table[i] = c;
+     }
+ }
+ 
+ static uint32_t crc32_buf(const unsigned char *p, size_t n) {
+     uint32_t c = 0xFFFFFFFFu;
+     while (n--) c = crc_table[(c ^ *p++) & 0xFF] ^ (c >> 8);
+     return c ^ 0xFFFFFFFFu;
+ }
+ 
+ static uint32_t rec_crc(const unsigned char *rec, size_t len) {
+     return crc32_buf(rec + offsetof(RecHdr, seq), len - offsetof(RecHdr, seq));
+ }
+ 
+ // Agrega un registro a la cola del escritor y devuelve su número. Si el
+ // escritor está muy atrasado el registro se descarta (y se cuenta), pero
+ // el número se asigna igual.
+ static uint64_t store_append(uint8_t type, uint8_t flags, const char *sender, const char *target,
+                              const char *content, time_t ts) {
+     size_t sl = strlen(sender), tl = target ? strlen(target) : 0, cl = content ? strlen(content) : 0;
+     size_t len = sizeof(RecHdr) + sl + tl + cl;
+     StoreRec *r = sl <= UINT16_MAX && tl <= UINT16_MAX ? malloc(sizeof(StoreRec) + len) : NULL;
+     if (r) {
+         RecHdr h = { .len = (uint32_t)len, .type = type, .flags = flags, .sender_len = (uint16_t)sl,
+                      .target_len = (uint16_t)tl, .content_len = content ? (uint32_t)cl : STORE_NULL };
+         memcpy(r->buf, &h, sizeof(h));
+         memcpy(r->buf + sizeof(h), sender, sl);
+         if (tl) memcpy(r->buf + sizeof(h) + sl, target, tl);
+         if (cl) memcpy(r->buf + sizeof(h) + sl + tl, content, cl);
+         r->len = len;
+         r->next = NULL;
+     }
+ 
+     pthread_mutex_lock(&store.lock);
+     uint64_t seq = __atomic_add_fetch(&history_seq, 1, __ATOMIC_RELAXED);
+     // La hora no retrocede: el índice se puede buscar en binario por hora
+     if (ts < store.last_ts) ts = store.last_ts;
+     store.last_ts = ts;
+     if (r && store.pending >= STORE_QUEUE_MAX) {
+         free(r);
+         r = NULL;
+     }
+     if (r) {
+         RecHdr *h = (RecHdr *)r->buf;
+         h->seq = seq;
+         h->ts = ts;
+         if (store.tail) store.tail->next = r;
+         else store.head = r;
+         store.tail = r;
+         store.pending++;
+         pthread_cond_signal(&store.cond);
+     } else {
+         store.dropped++;
+     }
+     pthread_mutex_unlock(&store.lock);
+     return seq;
+ }
+ 
+ static Segment *segment_open(uint64_t first_seq, int create) {
+     char name[32];
+     snprintf(name, sizeof(name), "%020llu.seg", (unsigned long long)first_seq);
+     int flags = O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_EXCL : 0);
+     int fd = openat(store.dir_fd, name, flags, 0644);
+     if (fd < 0) return NULL;
+     memcpy(name + 20, ".idx", 5);
+     int ifd = openat(store.dir_fd, name, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+     struct stat st;
+     if (ifd < 0 || fstat(ifd, &st) < 0) {
+         if (ifd >= 0) close(ifd);
+         close(fd);
+         return NULL;
+     }
+     // El índice se dimensiona para el peor caso: registros sin payload
+     size_t bytes = (size_t)st.st_size;
+     if (!bytes) {
+         bytes = cfg.store_segment / sizeof(RecHdr) * sizeof(IdxEntry);
+         if (ftruncate(ifd, (off_t)bytes) < 0) bytes = 0;
+     }
+     void *map = bytes ? mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, ifd, 0) : MAP_FAILED;
+     close(ifd);
+     Segment *seg = map != MAP_FAILED ? calloc(1, sizeof(Segment)) : NULL;
+     if (!seg) {
+         if (map != MAP_FAILED) munmap(map, bytes);
+         close(fd);
+         return NULL;
+     }
+     seg->first_seq = first_seq;
+     seg->fd = fd;
+     seg->idx = map;
+     seg->cap = bytes / sizeof(IdxEntry);
+     return seg;
+ }
+ 
+ static int segment_add(Segment *seg) {
+     pthread_mutex_lock(&store.seg_lock);
+     if (store.nsegs == store.segs_cap) {
+         size_t cap = store.segs_cap ? store.segs_cap * 2 : 16;
+         Segment **segs = realloc(store.segs, cap * sizeof(Segment *));
+         if (!segs) {
+             pthread_mutex_unlock(&store.seg_lock);
+             return -1;
+         }
+         store.segs = segs;
+         store.segs_cap = cap;
+     }
+     store.segs[store.nsegs++] = seg;
+     pthread_mutex_unlock(&store.seg_lock);
+     return 0;
+ }
+ 
+ // Copia de los punteros a segmentos; los Segment no se liberan mientras
+ // el servidor corre, así que se pueden usar sin el lock
+ static Segment **store_snapshot(size_t *n) {
+     pthread_mutex_lock(&store.seg_lock);
+     Segment **segs = malloc((store.nsegs ? store.nsegs : 1) * sizeof(Segment *));
+     *n = segs ? store.nsegs : 0;
+     if (segs) memcpy(segs, store.segs, store.nsegs * sizeof(Segment *));
+     pthread_mutex_unlock(&store.seg_lock);
+     return segs;
+ }
+ 
+ static void stored_free(StoredMsg *m) {
+     free(m->mem);
+     m->mem = NULL;
+ }
+ 
+ // Lee la entrada i del segmento
+ static int store_load(const Segment *seg, size_t i, StoredMsg *m) {
+     const IdxEntry *e = &seg->idx[i];
+     unsigned char *rec = malloc(e->len + 3);
+     if (!rec) return -1;
+     if (pread(seg->fd, rec, e->len, (off_t)e->off) != (ssize_t)e->len) {
+         free(rec);
+         return -1;
+     }
+     memcpy(&m->h, rec, sizeof(RecHdr));
+     size_t sl = m->h.sender_len, tl = m->h.target_len;
+     size_t cl = m->h.content_len == STORE_NULL ? 0 : m->h.content_len;
+     if (m->h.len != e->len || sizeof(RecHdr) + sl + tl + cl != e->len) {
+         free(rec);
+         return -1;
+     }
+     // Los strings se corren hacia la cabecera para dejar lugar a los '\0'
+     char *p = (char *)rec;
+     memmove(p, rec + sizeof(RecHdr), sl);
+     p[sl] = '\0';
+     memmove(p + sl + 1, rec + sizeof(RecHdr) + sl, tl);
+     p[sl + 1 + tl] = '\0';
+     memmove(p + sl + tl + 2, rec + sizeof(RecHdr) + sl + tl, cl);
+     p[sl + tl + 2 + cl] = '\0';
+     m->sender = p;
+     m->target = tl ? p + sl + 1 : NULL;
+     m->content = m->h.content_len == STORE_NULL ? NULL : p + sl + tl + 2;
+     m->mem = p;
+     return 0;
+ }
+ 
+ // Primera entrada con seq > since_seq y hora >= since_ts. Los dos crecen
+ // con la posición, así que alcanza con búsqueda binaria: primero entre
+ // segmentos (por su última entrada) y después dentro del segmento.
+ static int store_seek(Segment **segs, size_t n, uint64_t since_seq, time_t since_ts,
+                       size_t *seg_i, size_t *pos) {
+     #define STORE_AFTER(e) ((e)->seq > since_seq && (e)->ts >= (int64_t)since_ts)
+     size_t lo = 0, hi = n;
+     while (lo < hi) {
+         size_t mid = (lo + hi) / 2;
+         size_t cnt = __atomic_load_n(&segs[mid]->count, __ATOMIC_ACQUIRE);
+         if (cnt && STORE_AFTER(&segs[mid]->idx[cnt - 1])) hi = mid;
+         else lo = mid + 1;
+     }
+     if (lo == n) return -1;
+     const Segment *seg = segs[lo];
+     size_t a = 0, b = __atomic_load_n(&seg->count, __ATOMIC_ACQUIRE);
+     while (a < b) {
+         size_t mid = (a + b) / 2;
+         if (STORE_AFTER(&seg->idx[mid])) b = mid;
+         else a = mid + 1;
+     }
+     #undef STORE_AFTER
+     *seg_i = lo;
+     *pos = a;
+     return 0;
+ }
+ 
+ // Entrada exacta de seq (o -1 si todavía no se escribió)
+ static int store_find(Segment **segs, size_t n, uint64_t seq, size_t *seg_i, size_t *pos) {
+     if (store_seek(segs, n, seq - 1, 0, seg_i, pos) < 0) return -1;
+     return segs[*seg_i]->idx[*pos].seq == seq ? 0 : -1;
+ }
+ 
+ // ---- Escritor ----
+ 
+ static Segment *store_current(void) {
+     return store.nsegs ? store.segs[store.nsegs - 1] : NULL;
+ }
+ 
+ static Segment *store_rotate(uint64_t first_seq) {
+     Segment *old = store_current();
+     if (old) fdatasync(old->fd);
+     Segment *seg = segment_open(first_seq, 1);
+     if (!seg || segment_add(seg) < 0) {
+         log_msg(LOG_LVL_ERROR, "Almacén: no se pudo crear el segmento %llu: %s",
+                 (unsigned long long)first_seq, strerror(errno));
+         return NULL;
+     }
+     fsync(store.dir_fd);   // que el archivo nuevo sobreviva a un corte
+     return seg;
+ }
+ 
+ // Escribe los registros pendientes del segmento y publica sus entradas
+ static void store_flush_iov(Segment *seg, struct iovec *iov, StoreRec **recs, int n) {
+     if (!n) return;
+     uint64_t off = seg->size;
+     size_t total = 0;
+     for (int i = 0; i < n; i++) total += iov[i].iov_len;
+     ssize_t w = pwritev(seg->fd, iov, n, (off_t)off);
+     if (w != (ssize_t)total) {
+         // Sin publicar nada: lo escrito a medias lo corta la recuperación
+         log_msg(LOG_LVL_ERROR, "Almacén: error de escritura: %s", w < 0 ? strerror(errno) : "incompleta");
+         return;
+     }
+     size_t count = seg->count;
+     for (int i = 0; i < n; i++) {
+         const RecHdr *h = (const RecHdr *)recs[i]->buf;
+         seg->idx[count++] = (IdxEntry){ .seq = h->seq, .ts = h->ts, .off = off,
+                                         .len = h->len, .type = h->type, .flags = h->flags };
+         off += h->len;
+     }
+     seg->size = off;
+     __atomic_store_n(&seg->count, count, __ATOMIC_RELEASE);
+     __atomic_fetch_add(&store.written, (uint64_t)n, __ATOMIC_RELAXED);
+ }
+ 
+ static void store_write(StoreRec *list) {
+     struct iovec iov[STORE_IOV];
+     StoreRec *recs[STORE_IOV];
+     int n = 0;
+     size_t batch = 0;   // bytes en iov
+     Segment *seg = store_current();
+     while (list) {
+         StoreRec *r = list;
+         RecHdr *h = (RecHdr *)r->buf;
+         h->crc = rec_crc(r->buf, r->len);
+         int full = !seg || seg->count + n == seg->cap ||
+                    (seg->size + batch + r->len > cfg.store_segment && seg->count + n > 0);
+         if (full || n == STORE_IOV) {
+             if (seg) store_flush_iov(seg, iov, recs, n);
+             for (int i = 0; i < n; i++) free(recs[i]);
+             n = 0;
+             batch = 0;
+             if (full) seg = store_rotate(h->seq);
+         }
+         list = r->next;
+         if (!seg) {
+             free(r);
+             continue;
+         }
+         iov[n].iov_base = r->buf;
+         iov[n].iov_len = r->len;
+         recs[n++] = r;
+         batch += r->len;
+     }
+     if (seg) store_flush_iov(seg, iov, recs, n);
+     for (int i = 0; i < n; i++) free(recs[i]);
+ }
+ 
+ static void *store_writer(void *arg) {
+     (void)arg;
+     int dirty = 0;
+     uint64_t last_sync = mono_ns();
+     for (;;) {
+         pthread_mutex_lock(&store.lock);
+         if (!store.head && !store.stop) {
+             if (dirty) {
+                 struct timespec until;
+                 clock_gettime(CLOCK_REALTIME, &until);
+                 until.tv_nsec += cfg.store_fsync_ms % 1000 * 1000000;
+                 until.tv_sec += cfg.store_fsync_ms / 1000 + until.tv_nsec / 1000000000;
+                 until.tv_nsec %= 1000000000;
+                 pthread_cond_timedwait(&store.cond, &store.lock, &until);
+             } else {
+                 pthread_cond_wait(&store.cond, &store.lock);
+             }
+         }
+         StoreRec *list = store.head;
+         store.head = store.tail = NULL;
+         store.pending = 0;
+         int stop = store.stop;
+         pthread_mutex_unlock(&store.lock);
+ 
+         if (list) {
+             store_write(list);
+             dirty = 1;
+         }
+         uint64_t now = mono_ns();
+         if (dirty && (stop || now - last_sync >= (uint64_t)cfg.store_fsync_ms * 1000000)) {
+             Segment *seg = store_current();
+             if (seg) fdatasync(seg->fd);
+             dirty = 0;
+             last_sync = now;
+         }
+         if (stop && !list) return NULL;
+     }
+ }
+ 
+ // ---- Entregas offline ----
+ 
+ static OfflineBox *offline_box(const char *name, int create) {
+     OfflineBox **slot = &store.offline[hash_name(name) % OFFLINE_BUCKETS];
+     for (OfflineBox *b = *slot; b; b = b->next)
+         if (strcmp(b->name, name) == 0) return b;
+     if (!create) return NULL;
+     OfflineBox *b = calloc(1, sizeof(OfflineBox));
+     if (!b) return NULL;
+     strncpy(b->name, name, sizeof(b->name) - 1);
+     b->next = *slot;
+     *slot = b;
+     return b;
+ }
+ 
+ // Llamar con off_lock tomado
+ static int offline_add(const char *name, uint64_t seq) {
+     OfflineBox *b = offline_box(name, 1);
+     if (!b || b->count == OFFLINE_MAX || seq <= b->delivered) return -1;
+     if (b->count == b->cap) {
+         size_t cap = b->cap ? b->cap * 2 : 8;
+         uint64_t *seqs = realloc(b->seqs, cap * sizeof(uint64_t));
+         if (!seqs) return -1;
+         b->seqs = seqs;
+         b->cap = cap;
+     }
+     b->seqs[b->count++] = seq;
+     return 0;
+ }
+ 
+ // Llamar con off_lock tomado
+ static void offline_mark(OfflineBox *b, uint64_t upto) {
+     size_t k = 0;
+     while (k < b->count && b->seqs[k] <= upto) k++;
+     memmove(b->seqs, b->seqs + k, (b->count - k) * sizeof(uint64_t));
+     b->count -= k;
+     if (upto > b->delivered) b->delivered = upto;
+ }
+ 
+ // Guarda un privado para un usuario desconectado. Devuelve -1 si no se
+ // puede porque el almacén está apagado o el nombre nunca se registró, y
+ // -2 si su buzón está lleno.
+ static int store_offline(const char *sender, const char *target, const char *content) {
+     if (!store.enabled) return -1;
+     pthread_mutex_lock(&store.off_lock);
+     OfflineBox *b = offline_box(target, 0);
+     int rc = !b ? -1 : b->count == OFFLINE_MAX ? -2 : 0;
+     pthread_mutex_unlock(&store.off_lock);
+     if (rc < 0) return rc;
+     uint64_t seq = store_append(MSG_PRIVATE, STORE_OFFLINE, sender, target, content, time(NULL));
+     pthread_mutex_lock(&store.off_lock);
+     rc = offline_add(target, seq) < 0 ? -2 : 0;
+     pthread_mutex_unlock(&store.off_lock);
+     return rc;
+ }
+ 
+ // Entrega a c los privados que le llegaron mientras estaba desconectado,
+ // tantos como entren en su cola. La primera vez que se ve el nombre le
+ // abre el buzón. Solo desde el hilo dueño de c.
+ static void offline_deliver(Client *c) {
+     if (!store.enabled) return;
+     size_t room = cfg.queue_max - c->outq.count;
+     uint64_t seqs[64];
+     size_t n = 0;
+     pthread_mutex_lock(&store.off_lock);
+     OfflineBox *b = offline_box(c->name, 0);
+     int first = !b;
+     if (first) b = offline_box(c->name, 1);
+     if (b) {
+         n = b->count < 64 ? b->count : 64;
+         if (n > room) n = room;
+         if (n) memcpy(seqs, b->seqs, n * sizeof(uint64_t));
+     }
+     pthread_mutex_unlock(&store.off_lock);
+     if (first && b) store_append(STORE_USER, 0, c->name, NULL, NULL, time(NULL));
+     if (!n) return;
+ 
+     size_t nsegs;
+     Segment **segs = store_snapshot(&nsegs);
+     uint64_t upto = 0;
+     for (size_t k = 0; segs && k < n; k++) {
+         size_t si, pos;
+         StoredMsg sm;
+         // Uno todavía en la cola del escritor queda para el próximo registro
+         if (store_find(segs, nsegs, seqs[k], &si, &pos) < 0 || store_load(segs[si], pos, &sm) < 0) break;
+         OutMsg out = { .type = MSG_PRIVATE, .sender = sm.sender, .target = c->name,
+                        .target_uid = c->uid, .content = sm.content, .ts = (time_t)sm.h.ts };
+         send_msg(c, &out);
+         stored_free(&sm);
+         upto = seqs[k];
+     }
+     free(segs);
+     if (!upto) return;
+ 
+     pthread_mutex_lock(&store.off_lock);
+     if ((b = offline_box(c->name, 0))) offline_mark(b, upto);
+     pthread_mutex_unlock(&store.off_lock);
+     char num[24];
+     snprintf(num, sizeof(num), "%llu", (unsigned long long)upto);
+     store_append(STORE_DELIVERED, 0, "server", c->name, num, time(NULL));
+     log_action("Entregados a %s los privados pendientes hasta el #%s", c->name, num);
+ }
+ 
+ // ---- Lecturas para el historial ----
+ 
+ // Broadcasts con número mayor que since_seq y hora desde since_ts, los más
+ // viejos primero y tantos como entren en la cola de c: el cliente pide la
+ // página siguiente con el último número recibido. Solo desde el hilo
+ // dueño de c; lee del disco (normalmente del page cache) en el hilo.
+ static void store_replay(Client *c, uint64_t since_seq, time_t since_ts) {
+     size_t room = cfg.queue_max - c->outq.count;
+     size_t nsegs, si, pos;
+     Segment **segs = store_snapshot(&nsegs);
+     if (segs && store_seek(segs, nsegs, since_seq, since_ts, &si, &pos) == 0) {
+         for (; room && si < nsegs; si++, pos = 0) {
+             const Segment *seg = segs[si];
+             size_t count = __atomic_load_n(&seg->count, __ATOMIC_ACQUIRE);
+             for (; room && pos < count; pos++) {
+                 StoredMsg sm;
+                 if (seg->idx[pos].type != MSG_BROADCAST || store_load(seg, pos, &sm) < 0) continue;
+                 OutMsg out = { .type = MSG_BROADCAST, .sender = sm.sender, .content = sm.content,
+                                .seq = sm.h.seq, .ts = (time_t)sm.h.ts };
+                 Frame *f = encode_msg(c->fmt, &out);
+                 if (f) {
+                     client_enqueue(c, f);
+                     frame_unref(f);
+                     room--;
+                 }
+                 stored_free(&sm);
+             }
+         }
+     }
+     free(segs);
+ }
+ 
+ // Carga en el historial de cada shard los últimos broadcasts guardados.
+ // Antes de arrancar los hilos de servicio.
+ static void store_preload_history(void) {
+     if (!cfg.history || !store.nsegs) return;
+     // Recorre el índice hacia atrás hasta juntar cfg.history broadcasts
+     size_t si = store.nsegs, pos = 0, found = 0;
+     while (si > 0 && found < cfg.history) {
+         const Segment *seg = store.segs[si - 1];
+         pos = seg->count;
+         while (pos > 0 && found < cfg.history)
+             if (seg->idx[--pos].type == MSG_BROADCAST) found++;
+         if (found < cfg.history) si--;
+     }
+     if (si == 0) {
+         si = 1;
+         pos = 0;
+     }
+     for (si--; si < store.nsegs; si++, pos = 0) {
+         const Segment *seg = store.segs[si];
+         for (; pos < seg->count; pos++) {
+             StoredMsg sm;
+             if (seg->idx[pos].type != MSG_BROADCAST || store_load(seg, pos, &sm) < 0) continue;
+             OutMsg out = { .type = MSG_BROADCAST, .sender = sm.sender, .content = sm.content,
+                            .seq = sm.h.seq, .ts = (time_t)sm.h.ts };
+             // Cada shard con sus propios frames
+             for (int i = 0; i < cfg.threads; i++) {
+                 Frame *fs[FMT_COUNT];
+                 for (int k = 0; k < FMT_COUNT; k++) fs[k] = encode_msg(k, &out);
+                 history_push(&shards[i], fs, out.seq, out.ts);
+                 for (int k = 0; k < FMT_COUNT; k++)
+                     if (fs[k]) frame_unref(fs[k]);
+             }
+             stored_free(&sm);
+         }
+     }
+ }
+ 
+ // ---- Arranque y recuperación ----
+ 
+ // Cuenta las entradas del índice, descarta las que apuntan más allá del
+ // segmento y rehace las que falten leyendo la cola del segmento. Un
+ // registro incompleto o con crc inválido corta el segmento ahí.
+ static void segment_recover(Segment *seg) {
+     size_t a = 0, b = seg->cap;
+     while (a < b) {
+         size_t mid = (a + b) / 2;
+         if (seg->idx[mid].len) a = mid + 1;
+         else b = mid;
+     }
+     struct stat st;
+     uint64_t file = fstat(seg->fd, &st) == 0 ? (uint64_t)st.st_size : 0;
+     size_t count = a;
+     while (count && seg->idx[count - 1].off + seg->idx[count - 1].len > file) count--;
+     uint64_t off = count ? seg->idx[count - 1].off + seg->idx[count - 1].len : 0;
+ 
+     unsigned char *rec = NULL;
+     while (off + sizeof(RecHdr) <= file && count < seg->cap) {
+         RecHdr h;
+         if (pread(seg->fd, &h, sizeof(h), (off_t)off) != sizeof(h)) break;
+         if (h.len < sizeof(RecHdr) || off + h.len > file) break;
+         unsigned char *p = realloc(rec, h.len);
+         if (!p) break;
+         rec = p;
+         if (pread(seg->fd, rec, h.len, (off_t)off) != (ssize_t)h.len || rec_crc(rec, h.len) != h.crc) break;
+         seg->idx[count++] = (IdxEntry){ .seq = h.seq, .ts = h.ts, .off = off, .len = h.len,
+                                         .type = h.type, .flags = h.flags };
+         off += h.len;
+     }
+     free(rec);
+     if (off < file) {
+         log_msg(LOG_LVL_ERROR, "Almacén: segmento %llu cortado en %llu de %llu bytes",
+                 (unsigned long long)seg->first_seq, (unsigned long long)off, (unsigned long long)file);
+         if (ftruncate(seg->fd, (off_t)off) < 0) log_msg(LOG_LVL_ERROR, "Almacén: ftruncate: %s", strerror(errno));
+     }
+     memset(&seg->idx[count], 0, (a > count ? a - count : 0) * sizeof(IdxEntry));
+     seg->count = count;
+     seg->size = off;
+ }
+ 
+ static int cmp_u64(const void *a, const void *b) {
+     uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+     return x < y ? -1 : x > y;
+ }
+ 
+ static int store_open(void) {
+     mkdir(cfg.store_dir, 0755);
+     store.dir_fd = open(cfg.store_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+     if (store.dir_fd < 0) {
+         fprintf(stderr, "Almacén: no se pudo abrir %s: %s\n", cfg.store_dir, strerror(errno));
+         return -1;
+     }
+     crc32_init();
+ 
+     // Los segmentos se nombran por su primer número
+     DIR *dir = fdopendir(dup(store.dir_fd));
+     uint64_t *firsts = NULL;
+     size_t n = 0, cap = 0;
+     struct dirent *de;
+     while (dir && (de = readdir(dir))) {
+         char *end;
+         uint64_t first = strtoull(de->d_name, &end, 10);
+         if (end == de->d_name || strcmp(end, ".seg") != 0) continue;
+         if (n == cap) {
+             cap = cap ? cap * 2 : 16;
+             uint64_t *p = realloc(firsts, cap * sizeof(uint64_t));
+             if (!p) break;
+             firsts = p;
+         }
+         firsts[n++] = first;
+     }
+     if (dir) closedir(dir);
+     if (n) qsort(firsts, n, sizeof(uint64_t), cmp_u64);
+ 
+     for (size_t i = 0; i < n; i++) {
+         Segment *seg = segment_open(firsts[i], 0);
+         if (!seg || segment_add(seg) < 0) {
+             fprintf(stderr, "Almacén: no se pudo abrir el segmento %llu\n", (unsigned long long)firsts[i]);
+             free(firsts);
+             return -1;
+         }
+         segment_recover(seg);
+         // Rehace los buzones offline con el índice; solo lee esos registros
+         for (size_t k = 0; k < seg->count; k++) {
+             const IdxEntry *e = &seg->idx[k];
+             StoredMsg sm;
+             if (!(e->flags & STORE_OFFLINE) && e->type != STORE_DELIVERED && e->type != STORE_USER)
+                 continue;
+             if (!e->len || store_load(seg, k, &sm) < 0) continue;
+             if (e->type == STORE_USER) {
+                 offline_box(sm.sender, 1);
+             } else if (!sm.target) {
+                 // registro sin destinatario: no hay buzón que rehacer
+             } else if (e->type == STORE_DELIVERED) {
+                 OfflineBox *b = offline_box(sm.target, 1);
+                 if (b && sm.content) offline_mark(b, strtoull(sm.content, NULL, 10));
+             } else {
+                 offline_add(sm.target, e->seq);
+             }
+             stored_free(&sm);
+         }
+         if (seg->count) {
+             history_seq = seg->idx[seg->count - 1].seq;
+             store.last_ts = seg->idx[seg->count - 1].ts;
+         }
+     }
+     free(firsts);
+ 
+     if (pthread_create(&store.thread, NULL, store_writer, NULL) != 0) return -1;
+     store.enabled = 1;
+     log_action("Almacén de mensajes en %s: %zu segmentos, último #%llu",
+                cfg.store_dir, store.nsegs, (unsigned long long)history_seq);
+     return 0;
+ }
  
- #define BUFFER_SIZE 2048
- #define MAX_STATUS_LEN 10
- #define INACTIVITY_TIMEOUT 60
+ static void store_shutdown(void) {
+     if (!store.enabled) return;
+     pthread_mutex_lock(&store.lock);
+     store.stop = 1;
+     pthread_cond_signal(&store.cond);
+     pthread_mutex_unlock(&store.lock);
+     pthread_join(store.thread, NULL);
+ }
  
- #define STATUS_ACTIVE   "ACTIVO"
- #define STATUS_BUSY     "OCUPADO"
- #define STATUS_INACTIVE "INACTIVO"
-
- void get_timestamp(char *buffer, size_t len);  // ← Esta línea soluciona el warning
-
+ static void wheel_tick(lws_sorted_usec_list_t *sul) {
+     TimerWheel *w = lws_container_of(sul, TimerWheel, sul);
+     Shard *sh = lws_container_of(w, Shard, wheel);
+     wheel_advance(w, (uint64_t)time(NULL));
+     epoch_reclaim();
+     if (!force_exit)
+         lws_sul_schedule(context, sh->id, &w->sul, wheel_tick, LWS_US_PER_SEC);
+ }
  
- typedef struct Client {
-     struct lws *wsi;
-     char name[50];
-     char ip[INET_ADDRSTRLEN];
-     char status[MAX_STATUS_LEN];
-     time_t last_activity;
-     struct Client *next;
- } Client;
+ // Vencimiento del temporizador de inactividad. last_activity se actualiza
+ // sin tocar la rueda; si hubo actividad desde que se armó, solo se rearma
+ // por el tiempo que falta.
+ static void idle_expired(Timer *t) {
+     Client *c = lws_container_of(t, Client, idle_timer);
+     TimerWheel *w = &c->shard->wheel;
+     time_t idle = time(NULL) - c->last_activity;
+     if (idle <= INACTIVITY_TIMEOUT) {
+         timer_arm(w, t, INACTIVITY_TIMEOUT - idle + 1, idle_expired);
+         return;
+     }
+     clients_lock();
+     int was_active = strcmp(c->status, STATUS_ACTIVE) == 0;
+     if (was_active) strncpy(c->status, STATUS_INACTIVE, sizeof(c->status)-1);
+     pthread_mutex_unlock(&clients_mutex);
+     // Solo los usuarios ACTIVO tienen el temporizador armado; se vuelve a
+     // armar cuando el usuario regresa a ACTIVO con change_status.
+     if (was_active) {
+         log_action("Cliente %s pasó a INACTIVO", c->name);
+         presence_changed(c, STATUS_ACTIVE, STATUS_INACTIVE);
+     }
+ }
  
- static Client *clients = NULL;
- pthread_mutex_t clients_mutex = PTHREAD_MUTEX_INITIALIZER;
- static volatile int force_exit = 0;
+ // ----------------- Compresión (permessage-deflate) -----------------
+ // lws negocia la extensión con cada cliente que la ofrezca. La ventana y
+ // el memLevel acotan el estado de zlib por conexión: el compresor usa
+ // 2^(ventana+2) + 2^(mem+9) bytes (16 KB con los valores por defecto).
+ // Achicar la ventana del compresor después de negociar es válido: el otro
+ // lado solo necesita una ventana igual o mayor.
+ //
+ // La extensión de lws comprime todos los mensajes de la conexión; no hay
+ // forma de dejar pasar sin comprimir los cortos, así que el costo se mide
+ // (payload vs bytes en la red y CPU en lws_write) y se puede apagar con
+ // --no-deflate.
  
- void get_timestamp(char *buffer, size_t len) {
-     time_t now = time(NULL);
-     struct tm *tm_info = localtime(&now);
-     strftime(buffer, len, "%Y-%m-%dT%H:%M:%S", tm_info);
+ #define TX_STATS_INTERVAL 60   // segundos entre muestras de tráfico
+ 
+ static const struct lws_extension exts[] = {
+     { "permessage-deflate", lws_extension_callback_pm_deflate, "permessage-deflate" },
+     { NULL, NULL, NULL }
+ };
+ 
+ static void deflate_configure(struct lws *wsi) {
+     char val[8];
+     // Falla si el cliente no negoció la extensión; no es un error
+     snprintf(val, sizeof(val), "%d", cfg.deflate_window);
+     lws_set_extension_option(wsi, "permessage-deflate", "server_max_window_bits", val);
+     snprintf(val, sizeof(val), "%d", cfg.deflate_mem);
+     lws_set_extension_option(wsi, "permessage-deflate", "mem_level", val);
+     snprintf(val, sizeof(val), "%d", cfg.deflate_level);
+     lws_set_extension_option(wsi, "permessage-deflate", "compression_level", val);
  }
  
- void add_client(Client *new_client) {
-     pthread_mutex_lock(&clients_mutex);
-     new_client->next = clients;
-     clients = new_client;
-     log_action("Cliente registrado: %s (%s)", new_client->name, new_client->ip);
-     pthread_mutex_unlock(&clients_mutex);
+ // Cada shard muestrea sus conexiones; el shard 0 además publica el total
+ static void tx_stats_tick(Timer *t) {
+     Shard *sh = lws_container_of(t, Shard, stats_timer);
+     for (size_t i = 0; i < sh->members.count; i++) tx_sample(sh->members.items[i]);
+     timer_arm(&sh->wheel, t, TX_STATS_INTERVAL, tx_stats_tick);
+     if (sh->id != 0) return;
+ 
+     uint64_t payload = 0, wire = 0, cpu_ns = 0;
+     for (int i = 0; i < cfg.threads; i++) {
+         payload += __atomic_load_n(&shards[i].tx_payload, __ATOMIC_RELAXED);
+         wire += __atomic_load_n(&shards[i].tx_wire, __ATOMIC_RELAXED);
+         cpu_ns += __atomic_load_n(&shards[i].tx_cpu_ns, __ATOMIC_RELAXED);
+     }
+     if (!payload) return;
+     log_action("Tráfico de salida: %llu B de payload, %llu B en la red (%.1f%% ahorrado), "
+                "%.1f ms de CPU en lws_write (deflate %s)",
+                (unsigned long long)payload, (unsigned long long)wire,
+                100.0 * ((double)payload - (double)wire) / (double)payload,
+                cpu_ns / 1e6, cfg.deflate ? "activo" : "apagado");
  }
  
- void remove_client(struct lws *wsi) {
-     pthread_mutex_lock(&clients_mutex);
-     Client *prev = NULL, *curr = clients;
-     while (curr) {
-         if (curr->wsi == wsi) {
-             if (prev) prev->next = curr->next;
-             else clients = curr->next;
-             log_action("Cliente eliminado: %s (%s)", curr->name, curr->ip);
-             free(curr);
-             break;
+ // ----------------- Endpoint /metrics -----------------
+ // Formato de texto de Prometheus, servido por el mismo contexto de lws en
+ // el puerto del chat. Se arma completo al recibir el pedido y se envía en
+ // trozos desde HTTP_WRITEABLE.
+ 
+ #define METRICS_CHUNK 4096
+ 
+ typedef struct {
+     char *body;
+     size_t len, cap, sent;
+ } MetricsReq;
+ 
+ static void mr_printf(MetricsReq *r, const char *format, ...) {
+     va_list args;
+     for (;;) {
+         size_t room = r->cap - r->len;
+         va_start(args, format);
+         int n = vsnprintf(r->body ? r->body + r->len : NULL, room, format, args);
+         va_end(args);
+         if (n < 0) return;
+         if ((size_t)n < room) {
+             r->len += (size_t)n;
+             return;
          }
-         prev = curr;
-         curr = curr->next;
+         size_t cap = r->cap ? r->cap * 2 : 16384;
+         while (cap - r->len <= (size_t)n) cap *= 2;
+         char *body = realloc(r->body, cap);
+         if (!body) return;
+         r->body = body;
+         r->cap = cap;
      }
-     pthread_mutex_unlock(&clients_mutex);
  }
  
- Client* find_client_by_name(const char *name) {
-     Client *curr = clients;
-     while (curr) {
-         if (strcmp(curr->name, name) == 0)
-             return curr;
-         curr = curr->next;
+ static void mr_histogram(MetricsReq *r, const char *name, const char *label, const Histogram *h) {
+     uint64_t cum = 0;
+     for (int i = 0; i <= METRIC_BUCKETS; i++) {
+         cum += h->buckets[i];
+         if (i < METRIC_BUCKETS)
+             mr_printf(r, "%s_bucket{%s%sle=\"%g\"} %llu\n", name, label, *label ? "," : "",
+                       metric_bounds[i] / 1e9, (unsigned long long)cum);
+         else
+             mr_printf(r, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, label, *label ? "," : "",
+                       (unsigned long long)cum);
      }
-     return NULL;
+     const char *open = *label ? "{" : "", *close = *label ? "}" : "";
+     mr_printf(r, "%s_sum%s%s%s %.9f\n", name, open, label, close, h->sum_ns / 1e9);
+     mr_printf(r, "%s_count%s%s%s %llu\n", name, open, label, close, (unsigned long long)h->count);
  }
  
- void send_ws_text(struct lws *wsi, const char *msg) {
-     unsigned char buf[LWS_PRE + BUFFER_SIZE];
-     size_t msg_len = strlen(msg);
-     if (msg_len > BUFFER_SIZE) msg_len = BUFFER_SIZE;
-     memcpy(&buf[LWS_PRE], msg, msg_len);
-     lws_write(wsi, &buf[LWS_PRE], msg_len, LWS_WRITE_TEXT);
-     lws_callback_on_writable(wsi);
- }
- 
- void send_json(struct lws *wsi, const char *type, const char *sender, const char *target, const char *content) {
-     cJSON *root = cJSON_CreateObject();
-     cJSON_AddStringToObject(root, "type", type);
-     if (sender) cJSON_AddStringToObject(root, "sender", sender);
-     if (target) cJSON_AddStringToObject(root, "target", target);
-     if (content) cJSON_AddStringToObject(root, "content", content);
-     char ts[64];
-     get_timestamp(ts, sizeof(ts));
-     cJSON_AddStringToObject(root, "timestamp", ts);
-     char *json_str = cJSON_PrintUnformatted(root);
-     send_ws_text(wsi, json_str);
-     free(json_str);
-     cJSON_Delete(root);
+ static void hist_sum(Histogram *dst, const Histogram *src) {
+     for (int i = 0; i <= METRIC_BUCKETS; i++)
+         dst->buckets[i] += __atomic_load_n(&src->buckets[i], __ATOMIC_RELAXED);
+     dst->count += __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+     dst->sum_ns += __atomic_load_n(&src->sum_ns, __ATOMIC_RELAXED);
  }
  
- void broadcast_json(const char *type, const char *sender, const char *content, struct lws *exclude) {
-     cJSON *root = cJSON_CreateObject();
-     cJSON_AddStringToObject(root, "type", type);
-     cJSON_AddStringToObject(root, "sender", sender);
-     cJSON_AddStringToObject(root, "content", content);
-     char ts[64];
-     get_timestamp(ts, sizeof(ts));
-     cJSON_AddStringToObject(root, "timestamp", ts);
-     char *json_str = cJSON_PrintUnformatted(root);
-     pthread_mutex_lock(&clients_mutex);
-     Client *c = clients;
-     while (c) {
-         if (c->wsi != exclude) send_ws_text(c->wsi, json_str);
-         c = c->next;
+ static void mr_pools(MetricsReq *r) {
+     uint64_t hits[POOL_CLASSES] = { 0 }, misses[POOL_CLASSES] = { 0 };
+     size_t depot[POOL_CLASSES];
+     pthread_mutex_lock(&pools.lock);
+     for (const PoolCache *pc = pools.caches; pc; pc = pc->next)
+         for (int k = 0; k < POOL_CLASSES; k++) {
+             hits[k] += __atomic_load_n(&pc->hits[k], __ATOMIC_RELAXED);
+             misses[k] += __atomic_load_n(&pc->misses[k], __ATOMIC_RELAXED);
+         }
+     memcpy(depot, pools.depot_count, sizeof(depot));
+     pthread_mutex_unlock(&pools.lock);
+ 
+     mr_printf(r, "# HELP chat_pool_hits_total Reservas servidas con bloques ya libres del pool.\n"
+                  "# TYPE chat_pool_hits_total counter\n");
+     for (int k = 0; k < POOL_CLASSES; k++)
+         mr_printf(r, "chat_pool_hits_total{size=\"%zu\"} %llu\n", pool_sizes[k], (unsigned long long)hits[k]);
+     mr_printf(r, "# HELP chat_pool_misses_total Reservas que tuvieron que cortar un slab nuevo.\n"
+                  "# TYPE chat_pool_misses_total counter\n");
+     for (int k = 0; k < POOL_CLASSES; k++)
+         mr_printf(r, "chat_pool_misses_total{size=\"%zu\"} %llu\n", pool_sizes[k], (unsigned long long)misses[k]);
+     mr_printf(r, "# HELP chat_pool_depot_blocks Bloques libres en el depósito global.\n"
+                  "# TYPE chat_pool_depot_blocks gauge\n");
+     for (int k = 0; k < POOL_CLASSES; k++)
+         mr_printf(r, "chat_pool_depot_blocks{size=\"%zu\"} %zu\n", pool_sizes[k], depot[k]);
+     // Los slabs no se devuelven, así que su total es también el pico
+     mr_printf(r, "# HELP chat_pool_slab_bytes Memoria tomada en slabs (pico de uso de los pools).\n"
+                  "# TYPE chat_pool_slab_bytes gauge\n"
+                  "chat_pool_slab_bytes %zu\n"
+                  "# HELP chat_pool_large_bytes Bloques más grandes que el pool, pedidos a malloc.\n"
+                  "# TYPE chat_pool_large_bytes gauge\n"
+                  "chat_pool_large_bytes %zu\n"
+                  "# HELP chat_pool_large_peak_bytes Pico de chat_pool_large_bytes.\n"
+                  "# TYPE chat_pool_large_peak_bytes gauge\n"
+                  "chat_pool_large_peak_bytes %zu\n",
+               __atomic_load_n(&pools.slab_bytes, __ATOMIC_RELAXED),
+               __atomic_load_n(&pools.large_bytes, __ATOMIC_RELAXED),
+               __atomic_load_n(&pools.large_peak, __ATOMIC_RELAXED));
+ }
+ 
+ static void metrics_render(MetricsReq *r) {
+     static const char *const fmt_names[FMT_COUNT] = { "chat-protocol", "chat-protocol-bin" };
+     Metrics *sum = calloc(1, sizeof(Metrics));
+     if (!sum) return;
+     for (int i = 0; i < cfg.threads; i++) {
+         const Metrics *mx = shards[i].metrics;
+         for (int t = 0; t < MSG_TYPE_COUNT; t++) {
+             sum->received[t] += __atomic_load_n(&mx->received[t], __ATOMIC_RELAXED);
+             hist_sum(&sum->dispatch[t], &mx->dispatch[t]);
+         }
+         hist_sum(&sum->fanout, &mx->fanout);
+         sum->dropped += __atomic_load_n(&mx->dropped, __ATOMIC_RELAXED);
+         sum->lock_acquired += __atomic_load_n(&mx->lock_acquired, __ATOMIC_RELAXED);
+         sum->lock_contended += __atomic_load_n(&mx->lock_contended, __ATOMIC_RELAXED);
+         sum->lock_wait_ns += __atomic_load_n(&mx->lock_wait_ns, __ATOMIC_RELAXED);
      }
+ 
+     mr_printf(r, "# HELP chat_clients_connected Conexiones WebSocket abiertas.\n"
+                  "# TYPE chat_clients_connected gauge\n");
+     for (int f = 0; f < FMT_COUNT; f++)
+         mr_printf(r, "chat_clients_connected{protocol=\"%s\"} %d\n", fmt_names[f],
+                   __atomic_load_n(&fmt_clients[f], __ATOMIC_RELAXED));
+     clients_lock();
+     size_t users = registry.count;
      pthread_mutex_unlock(&clients_mutex);
-     free(json_str);
-     cJSON_Delete(root);
+     mr_printf(r, "# HELP chat_users_registered Usuarios registrados.\n"
+                  "# TYPE chat_users_registered gauge\n"
+                  "chat_users_registered %zu\n", users);
+     pthread_mutex_lock(&channels.lock);
+     size_t nchannels = channels.count;
+     pthread_mutex_unlock(&channels.lock);
+     mr_printf(r, "# HELP chat_channels Canales creados (además de " GLOBAL_CHANNEL ").\n"
+                  "# TYPE chat_channels gauge\n"
+                  "chat_channels %zu\n", nchannels);
+
+     // Solo los tipos que mandan los clientes
+     mr_printf(r, "# HELP chat_messages_received_total Mensajes recibidos por tipo.\n"
+                  "# TYPE chat_messages_received_total counter\n");
+     for (int t = 0; t < MSG_TYPE_COUNT; t++)
+         if (msg_inbound(t)) mr_printf(r, "chat_messages_received_total{type=\"%s\"} %llu\n", msg_names[t],
+                   (unsigned long long)sum->received[t]);
+     mr_printf(r, "# HELP chat_dispatch_seconds Desde la llegada del mensaje hasta terminar de manejarlo.\n"
+                  "# TYPE chat_dispatch_seconds histogram\n");
+     for (int t = 0; t < MSG_TYPE_COUNT; t++) {
+         if (!msg_inbound(t)) continue;
+         char label[64];
+         snprintf(label, sizeof(label), "type=\"%s\"", msg_names[t]);
+         mr_histogram(r, "chat_dispatch_seconds", label, &sum->dispatch[t]);
+     }
+     mr_printf(r, "# HELP chat_broadcast_fanout_seconds Codificar y repartir un broadcast a todos los shards.\n"
+                  "# TYPE chat_broadcast_fanout_seconds histogram\n");
+     mr_histogram(r, "chat_broadcast_fanout_seconds", "", &sum->fanout);
+ 
+     mr_printf(r, "# HELP chat_outbound_queue_frames Frames esperando en las colas de salida.\n"
+                  "# TYPE chat_outbound_queue_frames gauge\n");
+     for (int i = 0; i < cfg.threads; i++)
+         mr_printf(r, "chat_outbound_queue_frames{shard=\"%d\"} %lld\n", i,
+                   (long long)__atomic_load_n(&shards[i].metrics->queued, __ATOMIC_RELAXED));
+     mr_printf(r, "# HELP chat_frames_dropped_total Frames descartados por colas llenas.\n"
+                  "# TYPE chat_frames_dropped_total counter\n"
+                  "chat_frames_dropped_total %llu\n", (unsigned long long)sum->dropped);
+ 
+     mr_printf(r, "# HELP chat_clients_mutex_acquisitions_total Veces que se tomó clients_mutex.\n"
+                  "# TYPE chat_clients_mutex_acquisitions_total counter\n"
+                  "chat_clients_mutex_acquisitions_total %llu\n"
+                  "# HELP chat_clients_mutex_contended_total Veces que hubo que esperar clients_mutex.\n"
+                  "# TYPE chat_clients_mutex_contended_total counter\n"
+                  "chat_clients_mutex_contended_total %llu\n"
+                  "# HELP chat_clients_mutex_wait_seconds_total Tiempo esperando clients_mutex.\n"
+                  "# TYPE chat_clients_mutex_wait_seconds_total counter\n"
+                  "chat_clients_mutex_wait_seconds_total %.9f\n",
+               (unsigned long long)sum->lock_acquired, (unsigned long long)sum->lock_contended,
+               sum->lock_wait_ns / 1e9);
+     mr_pools(r);
+ 
+     if (store.enabled) {
+         pthread_mutex_lock(&store.lock);
+         size_t pending = store.pending;
+         unsigned long long dropped = store.dropped;
+         pthread_mutex_unlock(&store.lock);
+         mr_printf(r, "# HELP chat_store_backlog_records Registros esperando al escritor del almacén.\n"
+                      "# TYPE chat_store_backlog_records gauge\n"
+                      "chat_store_backlog_records %zu\n"
+                      "# HELP chat_store_written_total Registros escritos en el almacén.\n"
+                      "# TYPE chat_store_written_total counter\n"
+                      "chat_store_written_total %llu\n"
+                      "# HELP chat_store_dropped_total Registros descartados por escritor atrasado.\n"
+                      "# TYPE chat_store_dropped_total counter\n"
+                      "chat_store_dropped_total %llu\n",
+                   pending, (unsigned long long)__atomic_load_n(&store.written, __ATOMIC_RELAXED), dropped);
+     }
+ 
+     size_t head = __atomic_load_n(&logq.head, __ATOMIC_RELAXED);
+     size_t tail = __atomic_load_n(&logq.tail, __ATOMIC_RELAXED);
+     mr_printf(r, "# HELP chat_log_backlog_lines Líneas de bitácora esperando al escritor.\n"
+                  "# TYPE chat_log_backlog_lines gauge\n"
+                  "chat_log_backlog_lines %zu\n"
+                  "# HELP chat_log_dropped_total Líneas de bitácora descartadas por anillo lleno.\n"
+                  "# TYPE chat_log_dropped_total counter\n"
+                  "chat_log_dropped_total %lu\n",
+               head > tail ? head - tail : 0, __atomic_load_n(&logq.dropped, __ATOMIC_RELAXED));
+     free(sum);
  }
  
- void send_user_list(struct lws *wsi) {
-     cJSON *root = cJSON_CreateObject();
-     cJSON_AddStringToObject(root, "type", "list_users_response");
-     cJSON_AddStringToObject(root, "sender", "server");
-     cJSON *array = cJSON_CreateArray();
-     pthread_mutex_lock(&clients_mutex);
-     Client *c = clients;
-     while (c) {
-         cJSON_AddItemToArray(array, cJSON_CreateString(c->name));
-         c = c->next;
+ static int callback_metrics(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len) {
+     MetricsReq *r = user;
+     switch (reason) {
+         case LWS_CALLBACK_HTTP: {
+             unsigned char hdr[LWS_PRE + 256], *start = hdr + LWS_PRE, *p = start, *end = hdr + sizeof(hdr) - 1;
+             memset(r, 0, sizeof(*r));
+             metrics_render(r);
+             if (!r->body) return -1;
+             if (lws_add_http_common_headers(wsi, HTTP_STATUS_OK, "text/plain; version=0.0.4",
+                                             r->len, &p, end) ||
+                 lws_finalize_write_http_header(wsi, start, &p, end))
+                 return -1;
+             lws_callback_on_writable(wsi);
+             return 0;
+         }
+         case LWS_CALLBACK_HTTP_WRITEABLE: {
+             if (!r->body) break;
+             unsigned char buf[LWS_PRE + METRICS_CHUNK];
+             size_t n = r->len - r->sent < METRICS_CHUNK ? r->len - r->sent : METRICS_CHUNK;
+             int last = r->sent + n == r->len;
+             memcpy(buf + LWS_PRE, r->body + r->sent, n);
+             if (lws_write(wsi, buf + LWS_PRE, n, last ? LWS_WRITE_HTTP_FINAL : LWS_WRITE_HTTP) < (int)n)
+                 return -1;
+             r->sent += n;
+             if (!last) {
+                 lws_callback_on_writable(wsi);
+                 return 0;
+             }
+             free(r->body);
+             r->body = NULL;
+             return lws_http_transaction_completed(wsi) ? -1 : 0;
+         }
+         case LWS_CALLBACK_CLOSED_HTTP:
+             if (r) {
+                 free(r->body);
+                 r->body = NULL;
+             }
+             break;
+         default:
+             break;
      }
-     pthread_mutex_unlock(&clients_mutex);
-     cJSON_AddItemToObject(root, "content", array);
-     char ts[64];
-     get_timestamp(ts, sizeof(ts));
-     cJSON_AddStringToObject(root, "timestamp", ts);
-     char *json_str = cJSON_PrintUnformatted(root);
-     send_ws_text(wsi, json_str);
-     free(json_str);
-     cJSON_Delete(root);
+     return lws_callback_http_dummy(wsi, reason, user, in, len);
  }
  
- void send_user_info(struct lws *wsi, const char *target_name) {
-     Client *user = find_client_by_name(target_name);
-     cJSON *root = cJSON_CreateObject();
-     cJSON_AddStringToObject(root, "type", "user_info_response");
-     cJSON_AddStringToObject(root, "sender", "server");
-     cJSON_AddStringToObject(root, "target", target_name);
-     char ts[64];
-     get_timestamp(ts, sizeof(ts));
-     cJSON_AddStringToObject(root, "timestamp", ts);
-     if (user) {
-         cJSON *info = cJSON_CreateObject();
-         cJSON_AddStringToObject(info, "ip", user->ip);
-         cJSON_AddStringToObject(info, "status", user->status);
-         cJSON_AddItemToObject(root, "content", info);
-     } else {
-         cJSON_AddStringToObject(root, "content", "Usuario no encontrado");
+ // ----------------- Decodificador del protocolo -----------------
+ // Los mensajes entrantes tienen un esquema fijo de strings (type, sender,
+ // target, content, timestamp). El camino rápido los decodifica en el mismo
+ // buffer de lws sin reservar memoria: una primera pasada valida y ubica
+ // los valores, y solo si todo encaja la segunda pasada les quita los
+ // escapes y los termina en '\0' en su lugar (el texto sin escapes nunca es
+ // más largo que el original). Cualquier otra forma cae a cJSON.
+ 
+ enum { FIELD_TYPE, FIELD_SENDER, FIELD_TARGET, FIELD_CONTENT, FIELD_TIMESTAMP, FIELD_COUNT };
+ 
+ typedef struct {
+     MsgType type;
+     const char *field[FIELD_COUNT];   // NULL si no vino o vino null
+ } ChatMsg;
+ 
+ static MsgType msg_type_of(const char *s, size_t len) {
+     switch (len) {
+         case 4:
+             return memcmp(s, "join", 4) == 0 ? MSG_JOIN : MSG_UNKNOWN;
+         case 5:
+             return memcmp(s, "leave", 5) == 0 ? MSG_LEAVE : MSG_UNKNOWN;
+         case 7:
+             if (s[0] == 'p') return memcmp(s, "private", 7) == 0 ? MSG_PRIVATE : MSG_UNKNOWN;
+             if (s[0] == 'h') return memcmp(s, "history", 7) == 0 ? MSG_HISTORY : MSG_UNKNOWN;
+             return MSG_UNKNOWN;
+         case 8:
+             return memcmp(s, "register", 8) == 0 ? MSG_REGISTER : MSG_UNKNOWN;
+         case 9:
+             if (s[0] == 'b') return memcmp(s, "broadcast", 9) == 0 ? MSG_BROADCAST : MSG_UNKNOWN;
+             if (s[0] == 'u') return memcmp(s, "user_info", 9) == 0 ? MSG_USER_INFO : MSG_UNKNOWN;
+             return MSG_UNKNOWN;
+         case 10:
+             if (s[0] == 'l') return memcmp(s, "list_users", 10) == 0 ? MSG_LIST_USERS : MSG_UNKNOWN;
+             if (s[0] == 'd') return memcmp(s, "disconnect", 10) == 0 ? MSG_DISCONNECT : MSG_UNKNOWN;
+             return MSG_UNKNOWN;
+         case 13:
+             return memcmp(s, "change_status", 13) == 0 ? MSG_CHANGE_STATUS : MSG_UNKNOWN;
+         case 15:
+             return memcmp(s, "channel_message", 15) == 0 ? MSG_CHANNEL_MESSAGE : MSG_UNKNOWN;
      }
-     char *json_str = cJSON_PrintUnformatted(root);
-     send_ws_text(wsi, json_str);
-     free(json_str);
-     cJSON_Delete(root);
+     return MSG_UNKNOWN;
  }
  
- void *inactivity_monitor(void *arg) {
-     while (!force_exit) {
-         sleep(5);
-         time_t now = time(NULL);
-         pthread_mutex_lock(&clients_mutex);
-         Client *c = clients;
-         while (c) {
-             if (strcmp(c->status, STATUS_ACTIVE) == 0 && difftime(now, c->last_activity) > INACTIVITY_TIMEOUT) {
-                 strncpy(c->status, STATUS_INACTIVE, sizeof(c->status)-1);
-                 cJSON *notif = cJSON_CreateObject();
-                 cJSON_AddStringToObject(notif, "type", "status_update");
-                 cJSON_AddStringToObject(notif, "sender", "server");
-                 cJSON *content = cJSON_CreateObject();
-                 cJSON_AddStringToObject(content, "user", c->name);
-                 cJSON_AddStringToObject(content, "status", STATUS_INACTIVE);
-                 cJSON_AddItemToObject(notif, "content", content);
-                 char ts[64]; get_timestamp(ts, sizeof(ts));
-                 cJSON_AddStringToObject(notif, "timestamp", ts);
-                 char *notif_str = cJSON_PrintUnformatted(notif);
-                 Client *tmp = clients;
-                 while (tmp) { send_ws_text(tmp->wsi, notif_str); tmp = tmp->next; }
-                 free(notif_str);
-                 cJSON_Delete(notif);
-             }
-             c = c->next;
+ static int field_of(const char *key, size_t len) {
+     switch (len) {
+         case 4: return memcmp(key, "type", 4) == 0 ? FIELD_TYPE : -1;
+         case 6:
+             if (memcmp(key, "sender", 6) == 0) return FIELD_SENDER;
+             if (memcmp(key, "target", 6) == 0) return FIELD_TARGET;
+             return -1;
+         case 7: return memcmp(key, "content", 7) == 0 ? FIELD_CONTENT : -1;
+         case 9: return memcmp(key, "timestamp", 9) == 0 ? FIELD_TIMESTAMP : -1;
+     }
+     return -1;
+ }
+ 
+ static const char *skip_ws(const char *p, const char *end) {
+     while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) p++;
+     return p;
+ }
+ 
+ // Ubica el final de un string JSON que empieza después de la comilla.
+ // Devuelve la comilla de cierre o NULL; *escaped indica si hay '\'.
+ static const char *scan_string(const char *p, const char *end, int *escaped) {
+     *escaped = 0;
+     while (p < end) {
+         unsigned char ch = (unsigned char)*p;
+         if (ch == '"') return p;
+         if (ch < 0x20) return NULL;
+         if (ch == '\\') {
+             *escaped = 1;
+             if (++p == end) return NULL;
          }
-         pthread_mutex_unlock(&clients_mutex);
+         p++;
      }
      return NULL;
  }
  
- void* cliente_session(void* arg) {
-    Client* client = (Client*)arg;
-    
-    char logmsg[128];
-    snprintf(logmsg, sizeof(logmsg), "Hilo creado para el cliente: %s (%s)", client->name, client->ip);
-    log_action("%s", logmsg);
-
-    // Aquí se puede simular alguna actividad del cliente
-    while (!force_exit) {
-        pthread_mutex_lock(&clients_mutex);
-        time_t now = time(NULL);
-        double idle = difftime(now, client->last_activity);
-        pthread_mutex_unlock(&clients_mutex);
-
-        if (idle > 120) {
-            // Por ejemplo, simular que este hilo detecta inactividad o ejecuta acciones personalizadas
-            log_action("Cliente %s está inactivo por más de 120s (monitoreado por su hilo)", client->name);
-        }
-
-        sleep(10); // Intervalo de simulación
-    }
-
-    return NULL;
-}
+ static int hex4(const char *p, unsigned *out) {
+     unsigned v = 0;
+     for (int i = 0; i < 4; i++) {
+         char ch = p[i];
+         v <<= 4;
+         if (ch >= '0' && ch <= '9') v |= ch - '0';
+         else if (ch >= 'a' && ch <= 'f') v |= ch - 'a' + 10;
+         else if (ch >= 'A' && ch <= 'F') v |= ch - 'A' + 10;
+         else return -1;
+     }
+     *out = v;
+     return 0;
+ }
+ 
+ // Quita los escapes de [p, end) escribiendo sobre el mismo buffer y
+ // termina el resultado con '\0'. Devuelve -1 si hay un escape inválido.
+ static int unescape_in_place(char *p, char *end) {
+     char *out = p;
+     while (p < end) {
+         if (*p != '\\') {
+             *out++ = *p++;
+             continue;
+         }
+         p++;
+         switch (*p++) {
+             case '"':  *out++ = '"'; break;
+             case '\\': *out++ = '\\'; break;
+             case '/':  *out++ = '/'; break;
+             case 'b':  *out++ = '\b'; break;
+             case 'f':  *out++ = '\f'; break;
+             case 'n':  *out++ = '\n'; break;
+             case 'r':  *out++ = '\r'; break;
+             case 't':  *out++ = '\t'; break;
+             case 'u': {
+                 unsigned cp, lo;
+                 if (end - p < 4 || hex4(p, &cp) < 0) return -1;
+                 p += 4;
+                 if (cp >= 0xD800 && cp <= 0xDBFF) {
+                     if (end - p < 6 || p[0] != '\\' || p[1] != 'u' || hex4(p + 2, &lo) < 0 ||
+                         lo < 0xDC00 || lo > 0xDFFF)
+                         return -1;
+                     p += 6;
+                     cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+                 } else if (cp >= 0xDC00 && cp <= 0xDFFF) {
+                     return -1;
+                 }
+                 // La secuencia UTF-8 nunca es más larga que el escape
+                 if (cp < 0x80) {
+                     *out++ = (char)cp;
+                 } else if (cp < 0x800) {
+                     *out++ = (char)(0xC0 | (cp >> 6));
+                     *out++ = (char)(0x80 | (cp & 0x3F));
+                 } else if (cp < 0x10000) {
+                     *out++ = (char)(0xE0 | (cp >> 12));
+                     *out++ = (char)(0x80 | ((cp >> 6) & 0x3F));
+                     *out++ = (char)(0x80 | (cp & 0x3F));
+                 } else {
+                     *out++ = (char)(0xF0 | (cp >> 18));
+                     *out++ = (char)(0x80 | ((cp >> 12) & 0x3F));
+                     *out++ = (char)(0x80 | ((cp >> 6) & 0x3F));
+                     *out++ = (char)(0x80 | (cp & 0x3F));
+                 }
+                 break;
+             }
+             default:
+                 return -1;
+         }
+     }
+     *out = '\0';
+     return 0;
+ }
+ 
+ // Lo mismo que acepta unescape_in_place, sin escribir: escapes conocidos
+ // y \u con cuatro dígitos, con los surrogates en pares alto-bajo
+ static int escapes_valid(const char *q, const char *end) {
+     for (; q < end; q++) {
+         if (*q != '\\') continue;
+         if (++q == end) return 0;
+         if (*q != 'u') {
+             if (!strchr("\"\\/bfnrt", *q)) return 0;
+             continue;
+         }
+         unsigned cp, lo;
+         if (end - q < 5 || hex4(q + 1, &cp) < 0) return 0;
+         q += 4;
+         if (cp >= 0xDC00 && cp <= 0xDFFF) return 0;
+         if (cp >= 0xD800 && cp <= 0xDBFF) {
+             if (end - q < 7 || q[1] != '\\' || q[2] != 'u' || hex4(q + 3, &lo) < 0 ||
+                 lo < 0xDC00 || lo > 0xDFFF)
+                 return 0;
+             q += 6;
+         }
+     }
+     return 1;
+ }
 
+ // Camino rápido. Devuelve 0 si decodificó y -1 si hay que usar cJSON (en
+ // ese caso el buffer no se modificó).
+ static int chat_decode(char *buf, size_t len, ChatMsg *m) {
+     struct { char *start, *end; int escaped; } span[FIELD_COUNT];
+     const char *p = buf, *end = buf + len;
+     memset(span, 0, sizeof(span));
+ 
+     p = skip_ws(p, end);
+     if (p == end || *p++ != '{') return -1;
+     p = skip_ws(p, end);
+     if (p < end && *p == '}') return -1;
+     for (;;) {
+         int escaped;
+         if (p == end || *p++ != '"') return -1;
+         const char *key = p;
+         p = scan_string(p, end, &escaped);
+         if (!p || escaped) return -1;
+         int field = field_of(key, (size_t)(p - key));
+         if (field < 0 || span[field].start) return -1;
+         p = skip_ws(p + 1, end);
+         if (p == end || *p++ != ':') return -1;
+         p = skip_ws(p, end);
+         if (p < end && *p == '"') {
+             const char *val = ++p;
+             p = scan_string(p, end, &escaped);
+             if (!p) return -1;
+             span[field].start = (char *)val;
+             span[field].end = (char *)p;
+             span[field].escaped = escaped;
+             p++;
+         } else if (end - p >= 4 && memcmp(p, "null", 4) == 0) {
+             p += 4;
+         } else {
+             return -1;
+         }
+         p = skip_ws(p, end);
+         if (p == end) return -1;
+         if (*p == '}') break;
+         if (*p++ != ',') return -1;
+         p = skip_ws(p, end);
+     }
+     if (skip_ws(p + 1, end) != end) return -1;
+     // Los escapes se validan antes de tocar el buffer, así la segunda
+     // pasada no puede fallar a medias
+     for (int i = 0; i < FIELD_COUNT; i++)
+         if (span[i].escaped && !escapes_valid(span[i].start, span[i].end)) return -1;
+ 
+     // Segunda pasada: ya es seguro escribir sobre el buffer
+     for (int i = 0; i < FIELD_COUNT; i++) {
+         m->field[i] = NULL;
+         if (!span[i].start) continue;
+         if (span[i].escaped) {
+             unescape_in_place(span[i].start, span[i].end);
+         } else {
+             *span[i].end = '\0';
+         }
+         m->field[i] = span[i].start;
+     }
+     m->type = m->field[FIELD_TYPE] ? msg_type_of(m->field[FIELD_TYPE], strlen(m->field[FIELD_TYPE]))
+                                    : MSG_UNKNOWN;
+     return 0;
+ }
+ 
+ static const char *cjson_str(const cJSON *root, const char *key) {
+     cJSON *item = cJSON_GetObjectItemCaseSensitive(root, key);
+     return cJSON_IsString(item) ? item->valuestring : NULL;
+ }
+ 
+ // Camino lento para mensajes con otra forma (campos extra, números, etc.).
+ // Los valores apuntan dentro de *root, que el llamador libera.
+ static int chat_decode_cjson(const char *buf, size_t len, ChatMsg *m, cJSON **root) {
+     *root = cJSON_ParseWithLength(buf, len);
+     if (!*root) return -1;
+     static const char *const keys[FIELD_COUNT] = { "type", "sender", "target", "content", "timestamp" };
+     for (int i = 0; i < FIELD_COUNT; i++) m->field[i] = cjson_str(*root, keys[i]);
+     m->type = m->field[FIELD_TYPE] ? msg_type_of(m->field[FIELD_TYPE], strlen(m->field[FIELD_TYPE]))
+                                    : MSG_UNKNOWN;
+     return 0;
+ }
+ 
+ // Registros binarios (ver el formato junto a bin_build). Igual que en JSON,
+ // se decodifican en el buffer recibido: cada string se corre un byte o más
+ // hacia atrás, sobre su propio prefijo de largo, y queda terminado en
+ // '\0'. Como todo string viene precedido por al menos un byte, lo escrito
+ // nunca alcanza a lo que falta leer.
+ 
+ typedef struct {
+     unsigned char *p, *end;
+ } BinReader;
+ 
+ static int br_varint(BinReader *r, uint64_t *v) {
+     *v = 0;
+     for (int shift = 0; shift < 64 && r->p < r->end; shift += 7) {
+         uint8_t b = *r->p++;
+         *v |= (uint64_t)(b & 0x7F) << shift;
+         if (!(b & 0x80)) return 0;
+     }
+     return -1;
+ }
+ 
+ static int br_bytes(BinReader *r, char **out, size_t n, const char **dst) {
+     if (n > (size_t)(r->end - r->p)) return -1;
+     memmove(*out, r->p, n);
+     (*out)[n] = '\0';
+     *dst = *out;
+     *out += n + 1;
+     r->p += n;
+     return 0;
+ }
+ 
+ static int br_opt(BinReader *r, char **out, const char **dst) {
+     uint64_t v;
+     if (br_varint(r, &v) < 0) return -1;
+     *dst = NULL;
+     return v ? br_bytes(r, out, (size_t)(v - 1), dst) : 0;
+ }
+ 
+ // Los clientes solo pueden nombrar por id al servidor o a sí mismos
+ static int br_user(BinReader *r, char **out, const Client *conn, const char **dst) {
+     uint64_t v;
+     if (br_varint(r, &v) < 0) return -1;
+     *dst = NULL;
+     if (v & 1) return br_bytes(r, out, (size_t)(v >> 1), dst);
+     if (!v) return 0;
+     if (v >> 1 == SERVER_UID) *dst = "server";
+     else if (conn->registered && v >> 1 == conn->uid) *dst = conn->name;
+     else return -1;
+     return 0;
+ }
+ 
+ static int bin_decode(const Client *conn, unsigned char *rec, size_t len, ChatMsg *m) {
+     if (len < 9) return -1;
+     BinReader r = { rec + 9, rec + len };   // tipo + timestamp
+     char *out = (char *)rec;
+     m->type = msg_inbound(rec[0]) ? (MsgType)rec[0] : MSG_UNKNOWN;
+     if (m->type == MSG_UNKNOWN) return -1;
+     m->field[FIELD_TYPE] = msg_names[m->type];
+     m->field[FIELD_TIMESTAMP] = NULL;
+     if (br_user(&r, &out, conn, &m->field[FIELD_SENDER]) < 0 ||
+         br_user(&r, &out, conn, &m->field[FIELD_TARGET]) < 0 ||
+         br_opt(&r, &out, &m->field[FIELD_CONTENT]) < 0)
+         return -1;
+     return r.p == r.end ? 0 : -1;
+ }
+ 
+ // ----------------- Manejo de mensajes -----------------
+ 
+ static void broadcast_public(const char *sender, uint32_t sender_uid, const char *content) {
+     OutMsg out = { .type = MSG_BROADCAST, .sender = sender, .sender_uid = sender_uid,
+                    .content = content };
+     if (store.enabled) out.seq = store_append(MSG_BROADCAST, 0, sender, NULL, content, time(NULL));
+     else if (cfg.history) out.seq = __atomic_add_fetch(&history_seq, 1, __ATOMIC_RELAXED);
+     broadcast_msg(&out, NULL);
+     log_msg(LOG_LVL_BODY, "Mensaje público de %s: %s", sender, content);
+ }
 
+ // Avisa a los miembros de ch (menos exclude) en nombre del servidor
+ static void channel_notice(Channel *ch, const char *content, Client *exclude) {
+     OutMsg m = { .type = MSG_CHANNEL_MESSAGE, .sender = "server", .sender_uid = SERVER_UID,
+                  .target = ch->name, .content = content };
+     fanout_msg(&m, ch, exclude);
+ }
 
- int callback_chat(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len) {
-     switch (reason) {
-         case LWS_CALLBACK_RECEIVE: {
-             char *msg = strndup((char *)in, len);
-             if (!msg) break;
-             cJSON *root = cJSON_Parse(msg);
-             free(msg);
-             if (!root) break;
-             cJSON *type_obj = cJSON_GetObjectItem(root, "type");
-             cJSON *sender_obj = cJSON_GetObjectItem(root, "sender");
-             cJSON *content_obj = cJSON_GetObjectItem(root, "content");
-             if (!cJSON_IsString(type_obj) || !cJSON_IsString(sender_obj)) {
-                 cJSON_Delete(root);
+ // Devuelve -1 si hay que cerrar la conexión
+ static int handle_message(Client *conn, const ChatMsg *m) {
+     const char *sender = m->field[FIELD_SENDER];
+     const char *target = m->field[FIELD_TARGET];
+     const char *content = m->field[FIELD_CONTENT];
+     if (!m->field[FIELD_TYPE] || !sender) return 0;
+     // El remitente es la propia conexión: no hace falta buscarlo
+     Client *client = conn->registered ? conn : NULL;
+     if (client) client->last_activity = time(NULL);
+     // Los clientes binarios reciben al remitente por id si es el propio
+     uint32_t sender_uid = client && strcmp(sender, client->name) == 0 ? client->uid : 0;
+ 
+     switch (m->type) {
+         case MSG_REGISTER: {
+             if (client) {
+                 send_server(conn, MSG_ERROR, "Ya estás registrado");
                  break;
              }
-             const char *type = type_obj->valuestring;
-             const char *sender = sender_obj->valuestring;
-             const char *content = cJSON_IsString(content_obj) ? content_obj->valuestring : NULL;
-             Client *client = find_client_by_name(sender);
-             if (client) client->last_activity = time(NULL);
- 
-             if (strcmp(type, "register") == 0) {
-                if (find_client_by_name(sender)) {
-                    send_json(wsi, "error", "server", NULL, "Nombre de usuario en uso");
-                    cJSON_Delete(root);
-                    return -1;
-                }
-            
-                Client *new_client = calloc(1, sizeof(Client));
-                new_client->wsi = wsi;
-                strncpy(new_client->name, sender, sizeof(new_client->name)-1);
-                const char *peer = lws_get_peer_simple(wsi, new_client->ip, sizeof(new_client->ip));
-                if (!peer) strncpy(new_client->ip, "desconocido", sizeof(new_client->ip)-1);
-                strncpy(new_client->status, STATUS_ACTIVE, sizeof(new_client->status)-1);
-                new_client->last_activity = time(NULL);
-            
-                add_client(new_client);
-            
-                pthread_t client_thread;
-                pthread_create(&client_thread, NULL, cliente_session, new_client);
-                pthread_detach(client_thread);
-            
-                send_json(wsi, "register_success", "server", NULL, "Registro exitoso");
-                broadcast_json("broadcast", "server", "Nuevo usuario conectado", wsi);
-                send_user_list(wsi);
-            }
-             else if (strcmp(type, "broadcast") == 0) {
-                 broadcast_json("broadcast", sender, content, NULL);
-                 log_action("Mensaje público de %s: %s", sender, content);
-             } else if (strcmp(type, "private") == 0) {
-                 cJSON *target_obj = cJSON_GetObjectItem(root, "target");
-                 if (cJSON_IsString(target_obj)) {
-                     Client *receiver = find_client_by_name(target_obj->valuestring);
-                     if (receiver) {
-                         send_json(receiver->wsi, "private", sender, receiver->name, content);
-                         log_action("Mensaje privado de %s a %s: %s", sender, receiver->name, content);
-                     } else {
-                         send_json(wsi, "error", "server", NULL, "Usuario no encontrado");
-                         log_action("Error: %s intentó enviar mensaje privado a usuario inexistente: %s", sender, target_obj->valuestring);
-                     }
-                 }
-             } else if (strcmp(type, "list_users") == 0) {
-                 send_user_list(wsi);
-                 log_action("Solicitud de lista de usuarios por %s", sender);
-             } else if (strcmp(type, "user_info") == 0) {
-                 cJSON *target_obj = cJSON_GetObjectItem(root, "target");
-                 log_action("Solicitud de información del usuario '%s' hecha por %s", target_obj->valuestring, sender);
-                 if (cJSON_IsString(target_obj)) {
-                     send_user_info(wsi, target_obj->valuestring);
-                 }
-             } else if (strcmp(type, "change_status") == 0 && client && content) {
-                 strncpy(client->status, content, sizeof(client->status)-1);
-                 cJSON *msg = cJSON_CreateObject();
-                 cJSON_AddStringToObject(msg, "type", "status_update");
-                 cJSON_AddStringToObject(msg, "sender", "server");
-                 cJSON *st = cJSON_CreateObject();
-                 cJSON_AddStringToObject(st, "user", sender);
-                 cJSON_AddStringToObject(st, "status", content);
-                 cJSON_AddItemToObject(msg, "content", st);
-                 char ts[64]; get_timestamp(ts, sizeof(ts));
-                 cJSON_AddStringToObject(msg, "timestamp", ts);
-                 char *msg_str = cJSON_PrintUnformatted(msg);
-                 log_action("Cambio de estado: %s → %s", sender, content);
-                 Client *tmp = clients;
-                 while (tmp) { send_ws_text(tmp->wsi, msg_str); tmp = tmp->next; }
-                 free(msg_str);
-                 cJSON_Delete(msg);
-             } else if (strcmp(type, "disconnect") == 0) {
-                 char goodbye[100];
-                 snprintf(goodbye, sizeof(goodbye), "%s ha salido", sender);
-                 broadcast_json("user_disconnected", "server", goodbye, wsi);
-                 remove_client(wsi);
-                 lws_close_reason(wsi, LWS_CLOSE_STATUS_NORMAL, NULL, 0);
-                 cJSON_Delete(root);
+             Client *new_client = conn;
+             strncpy(new_client->name, sender, sizeof(new_client->name)-1);
+             const char *peer = lws_get_peer_simple(conn->wsi, new_client->ip, sizeof(new_client->ip));
+             if (!peer) strncpy(new_client->ip, "desconocido", sizeof(new_client->ip)-1);
+             strncpy(new_client->status, STATUS_ACTIVE, sizeof(new_client->status)-1);
+             new_client->last_activity = time(NULL);
+ 
+             uint64_t version;
+             int rc = add_client(new_client, &version);
+             if (rc < 0) {
+                 // Se cierra después de que el error salga por la cola
+                 send_server(conn, MSG_ERROR, rc == -2 ? "Nombre de usuario en uso" : "Servidor sin memoria");
+                 new_client->name[0] = '\0';
+                 conn->close_pending = 1;
+                 break;
+             }
+ 
+             timer_arm(&conn->shard->wheel, &conn->idle_timer, INACTIVITY_TIMEOUT + 1, idle_expired);
+ 
+             send_server(conn, MSG_REGISTER_SUCCESS, "Registro exitoso");
+             broadcast_server(MSG_BROADCAST, "Nuevo usuario conectado", conn);
+             directory_delta(MSG_USER_JOINED, conn, version);
+             // Solo la primera página: el resto se pide con el cursor
+             send_user_list(conn, &(ListQuery){ .limit = USER_PAGE });
+             history_replay(conn, 0, 0);
+             offline_deliver(conn);
+             break;
+         }
+         case MSG_BROADCAST:
+             broadcast_public(sender, sender_uid, content);
+             break;
+         case MSG_PRIVATE: {
+             if (!target) break;
+             Client *receiver = client_lookup(target);
+             int rc;
+             if (receiver) {
+                 OutMsg out = { .type = MSG_PRIVATE, .sender = sender, .sender_uid = sender_uid,
+                                .target = receiver->name, .target_uid = receiver->uid, .content = content };
+                 if (store.enabled) store_append(MSG_PRIVATE, 0, sender, receiver->name, content, time(NULL));
+                 send_msg(receiver, &out);
+                 log_msg(LOG_LVL_BODY, "Mensaje privado de %s a %s: %s", sender, receiver->name, content);
+                 client_unref(receiver);
+             } else if ((rc = store_offline(sender, target, content)) == 0) {
+                 char note[128];
+                 snprintf(note, sizeof(note), "%s no está conectado: recibirá el mensaje al volver", target);
+                 send_server(conn, MSG_BROADCAST, note);
+                 log_msg(LOG_LVL_BODY, "Mensaje privado de %s a %s (desconectado): %s", sender, target, content);
+             } else if (rc == -2) {
+                 send_server(conn, MSG_ERROR, "El buzón del usuario está lleno");
+             } else {
+                 send_server(conn, MSG_ERROR, "Usuario no encontrado");
+                 log_action("Error: %s intentó enviar mensaje privado a usuario inexistente: %s", sender, target);
+             }
+             break;
+         }
+         case MSG_LIST_USERS: {
+             ListQuery q;
+             if (list_query(content, &q) < 0) {
+                 send_server(conn, MSG_ERROR, "Pedido de lista inválido");
+                 break;
+             }
+             // Suscribirse antes de armar la página: un alta entre medio
+             // llega como delta y no se pierde
+             if (q.subscribe && client && directory_channel && channel_join(conn, directory_channel) < 0) {
+                 send_server(conn, MSG_ERROR, "Demasiados canales");
+                 break;
+             }
+             send_user_list(conn, &q);
+             log_action("Solicitud de lista de usuarios por %s", sender);
+             break;
+         }
+         case MSG_USER_INFO:
+             if (!target) break;
+             log_action("Solicitud de información del usuario '%s' hecha por %s", target, sender);
+             send_user_info(conn, target);
+             break;
+         case MSG_CHANGE_STATUS:
+             if (!client || !content) break;
+             char prev[MAX_STATUS_LEN];
+             clients_lock();
+             memcpy(prev, client->status, sizeof(prev));
+             strncpy(client->status, content, sizeof(client->status)-1);
+             pthread_mutex_unlock(&clients_mutex);
+             if (strcmp(content, STATUS_ACTIVE) == 0 && !timer_armed(&client->idle_timer))
+                 timer_arm(&client->shard->wheel, &client->idle_timer, INACTIVITY_TIMEOUT + 1, idle_expired);
+             log_action("Cambio de estado: %s → %s", sender, content);
+             presence_changed(client, prev, content);
+             break;
+         case MSG_HISTORY: {
+             if (!client) break;
+             uint64_t since_seq = 0;
+             time_t since_ts = 0;
+             if (content && history_since(content, &since_seq, &since_ts) < 0) {
+                 send_server(conn, MSG_ERROR, "Valor de since inválido");
+                 break;
+             }
+             // Lo que el anillo ya no tiene se lee del almacén
+             const History *h = &conn->shard->history;
+             const HistEntry *oldest = h->count ? &h->items[h->head] : NULL;
+             int in_ring = !content || (oldest && (since_seq + 1 >= oldest->seq || since_ts > oldest->ts));
+             if (store.enabled && !in_ring) store_replay(conn, since_seq, since_ts);
+             else history_replay(conn, since_seq, since_ts);
+             log_action("Solicitud de historial de %s desde %s", sender, content ? content : "el inicio");
+             break;
+         }
+         case MSG_JOIN: {
+             if (!client) break;
+             if (!target || !channel_name_ok(target)) {
+                 send_server(conn, MSG_ERROR, "Nombre de canal inválido");
+                 break;
+             }
+             if (strcmp(target, GLOBAL_CHANNEL) == 0) {
+                 send_server(conn, MSG_ERROR, "Ya estás en " GLOBAL_CHANNEL);
+                 break;
+             }
+             Channel *ch = channel_get(target, 1);
+             int rc = ch ? channel_join(conn, ch) : -1;
+             if (rc < 0) {
+                 send_server(conn, MSG_ERROR, rc == -2 ? "Demasiados canales" : "No se pudo crear el canal");
+                 break;
+             }
+             char note[100];
+             snprintf(note, sizeof(note), "%d miembros", __atomic_load_n(&ch->members, __ATOMIC_RELAXED));
+             OutMsg ack = { .type = MSG_JOIN, .sender = "server", .sender_uid = SERVER_UID,
+                            .target = ch->name, .content = note };
+             send_msg(conn, &ack);
+             if (rc == 0) {
+                 snprintf(note, sizeof(note), "%s se unió al canal", sender);
+                 channel_notice(ch, note, conn);
+                 log_action("%s se unió a #%s", sender, ch->name);
+             }
+             break;
+         }
+         case MSG_LEAVE: {
+             if (!client || !target) break;
+             int k = client_channel_named(conn, target);
+             if (k < 0) {
+                 send_server(conn, MSG_ERROR, "No estás en ese canal");
+                 break;
+             }
+             Channel *ch = conn->chans[k].ch;
+             channel_drop(conn, k);
+             OutMsg ack = { .type = MSG_LEAVE, .sender = "server", .sender_uid = SERVER_UID,
+                            .target = ch->name };
+             send_msg(conn, &ack);
+             char note[100];
+             snprintf(note, sizeof(note), "%s salió del canal", sender);
+             channel_notice(ch, note, NULL);
+             log_action("%s salió de #%s", sender, ch->name);
+             break;
+         }
+         case MSG_CHANNEL_MESSAGE: {
+             if (!client || !target) break;
+             if (strcmp(target, GLOBAL_CHANNEL) == 0) {
+                 broadcast_public(sender, sender_uid, content);
+                 break;
+             }
+             int k = client_channel_named(conn, target);
+             if (k < 0) {
+                 send_server(conn, MSG_ERROR, "No estás en ese canal");
+                 break;
+             }
+             Channel *ch = conn->chans[k].ch;
+             OutMsg out = { .type = MSG_CHANNEL_MESSAGE, .sender = sender, .sender_uid = sender_uid,
+                            .target = ch->name, .content = content };
+             if (store.enabled) store_append(MSG_CHANNEL_MESSAGE, 0, sender, ch->name, content, time(NULL));
+             fanout_msg(&out, ch, NULL);
+             log_msg(LOG_LVL_BODY, "Mensaje de %s a #%s: %s", sender, ch->name, content);
+             break;
+         }
+         case MSG_DISCONNECT: {
+             char goodbye[100];
+             snprintf(goodbye, sizeof(goodbye), "%s ha salido", sender);
+             broadcast_server(MSG_USER_DISCONNECTED, goodbye, conn);
+             lws_close_reason(conn->wsi, LWS_CLOSE_STATUS_NORMAL, NULL, 0);
+             return -1;
+         }
+         default:
+             break;
+     }
+     return 0;
+ }
+ 
+ // Cuenta el mensaje y su latencia desde que llegó el primer fragmento
+ static int handle_counted(Client *conn, const ChatMsg *m) {
+     int rc = handle_message(conn, m);
+     Metrics *mx = conn->shard->metrics;
+     if (mx) {
+         stat_add(&mx->received[m->type], 1);
+         hist_observe(&mx->dispatch[m->type], mono_ns() - conn->rx_started);
+     }
+     return rc;
+ }
+ 
+ // Un frame binario trae uno o más registros con su largo adelante
+ static int dispatch_bin(Client *conn, unsigned char *buf, size_t len) {
+     BinReader r = { buf, buf + len };
+     while (r.p < r.end) {
+         uint64_t rec_len;
+         if (br_varint(&r, &rec_len) < 0 || rec_len > (uint64_t)(r.end - r.p)) return 0;
+         ChatMsg m;
+         unsigned char *rec = r.p;
+         r.p += rec_len;
+         if (bin_decode(conn, rec, (size_t)rec_len, &m) < 0) continue;
+         if (handle_counted(conn, &m) < 0) return -1;
+     }
+     return 0;
+ }
+ 
+ static int dispatch_frame(Client *conn, char *buf, size_t len) {
+     if (conn->fmt == FMT_BIN) return dispatch_bin(conn, (unsigned char *)buf, len);
+     ChatMsg m;
+     int rc = chat_decode(buf, len, &m);
+     if (rc == 0) return handle_counted(conn, &m);
+     cJSON *root;
+     if (chat_decode_cjson(buf, len, &m, &root) < 0) return 0;
+     rc = handle_counted(conn, &m);
+     cJSON_Delete(root);
+     return rc;
+ }
+ 
+ // Mensajes que llegan en varios fragmentos se juntan en conn->rx; los que
+ // llegan completos se decodifican directo sobre el buffer de lws.
+ static int receive_frame(Client *conn, char *in, size_t len) {
+     int complete = lws_is_final_fragment(conn->wsi) && !lws_remaining_packet_payload(conn->wsi);
+     if (!conn->rx_len && conn->shard->metrics) conn->rx_started = mono_ns();
+     if (complete && !conn->rx_len) return dispatch_frame(conn, in, len);
+ 
+     if (conn->rx_len + len > MAX_MESSAGE_SIZE) {
+         log_msg(LOG_LVL_ERROR, "Mensaje demasiado grande de %s", conn->name[0] ? conn->name : conn->ip);
+         return -1;
+     }
+     if (conn->rx_len + len > conn->rx_cap) {
+         size_t cap = conn->rx_cap ? conn->rx_cap : BUFFER_SIZE;
+         while (cap < conn->rx_len + len) cap *= 2;
+         char *rx = realloc(conn->rx, cap);
+         if (!rx) return -1;
+         conn->rx = rx;
+         conn->rx_cap = cap;
+     }
+     memcpy(conn->rx + conn->rx_len, in, len);
+     conn->rx_len += len;
+     if (!complete) return 0;
+     size_t total = conn->rx_len;
+     conn->rx_len = 0;
+     return dispatch_frame(conn, conn->rx, total);
+ }
+ 
+ int callback_chat(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len) {
+     Client *conn = user ? *(Client **)user : NULL;
+     switch (reason) {
+         case LWS_CALLBACK_ESTABLISHED: {
+             conn = client_new(wsi);
+             if (!conn) return -1;
+             clients_lock();
+             int rc = registry_attach(conn);
+             pthread_mutex_unlock(&clients_mutex);
+             if (rc < 0) {
+                 client_free(conn);
                  return -1;
              }
-             cJSON_Delete(root);
+             conn->fmt = lws_get_protocol(wsi)->id;
+             if (cfg.deflate) deflate_configure(wsi);
+             __atomic_fetch_add(&fmt_clients[conn->fmt], 1, __ATOMIC_RELAXED);
+             *(Client **)user = conn;
+             if (conn->shard) shard_wake_attach(conn->shard, wsi);
              break;
          }
+         case LWS_CALLBACK_RECEIVE:
+             if (conn && receive_frame(conn, in, len) < 0) return -1;
+             break;
+         case LWS_CALLBACK_SERVER_WRITEABLE:
+             if (conn && client_flush(conn) < 0) return -1;
+             break;
+         case LWS_CALLBACK_EVENT_WAIT_CANCELLED:
+             // Llega una vez por protocolo; el buzón se vacía con el primero
+             if (cur_shard && lws_get_protocol(wsi)->id == FMT_JSON) shard_drain_mailbox(cur_shard);
+             break;
          case LWS_CALLBACK_CLOSED:
+             if (!conn) break;
+             tx_sample(conn);
+             // Lo que quedó en la cola ya no se va a enviar. Antes de
+             // remove_client: después conn puede estar retirado.
+             if (conn->shard->metrics) stat_add(&conn->shard->metrics->queued, -(uint64_t)conn->outq.count);
+             shard_wake_detach(conn->shard, wsi);
              remove_client(wsi);
              break;
          default: break;
@@ -361,33 +4096,236 @@ void get_timestamp(char *buffer, size_t len);
  }
  
  static struct lws_protocols protocols[] = {
-     { "chat-protocol", callback_chat, 0, BUFFER_SIZE },
+     { "chat-protocol", callback_chat, sizeof(Client *), BUFFER_SIZE, FMT_JSON },
+     { "chat-protocol-bin", callback_chat, sizeof(Client *), BUFFER_SIZE, FMT_BIN },
+     { "http-metrics", callback_metrics, sizeof(MetricsReq), 0, 0 },
      { NULL, NULL, 0, 0 }
  };
  
+ static const struct lws_http_mount metrics_mount = {
+     .mountpoint = "/metrics",
+     .protocol = "http-metrics",
+     .origin_protocol = LWSMPRO_CALLBACK,
+     .mountpoint_len = 8,
+ };
+ 
  void sigint_handler(int sig) {
      force_exit = 1;
  }
  
+ static void *service_thread(void *arg) {
+     Shard *sh = arg;
+     cur_shard = sh;
+     lws_sul_schedule(context, sh->id, &sh->wheel.sul, wheel_tick, LWS_US_PER_SEC);
+     timer_arm(&sh->wheel, &sh->stats_timer, TX_STATS_INTERVAL, tx_stats_tick);
+     if (sh->id == 0 && cfg.presence_ms)
+         lws_sul_schedule(context, 0, &presence.sul, presence_flush, cfg.presence_ms * LWS_US_PER_MS);
+     while (!force_exit) lws_service_tsi(context, 5, sh->id);
+     return NULL;
+ }
+ 
+ static void usage(const char *prog) {
+     fprintf(stderr,
+             "Uso: %s [puerto] [opciones]\n"
+             "  --queue-max N          mensajes en cola por cliente (defecto 256)\n"
+             "  --slow-policy P        oldest | newest | disconnect (defecto oldest)\n"
+             "  --threads N            hilos de servicio / shards (defecto 1; a lo sumo\n"
+             "                         LWS_MAX_SMP de la libwebsockets instalada)\n"
+             "  --log-file RUTA        archivo de bitácora (defecto servidor.log)\n"
+             "  --log-level L          error | info | body (defecto body)\n"
+             "  --log-max-mb N         rotar al llegar a N MB (0 = nunca, defecto 10)\n"
+             "  --log-rotate-secs N    rotar cada N segundos (0 = nunca)\n"
+             "  --quiet                no copiar la bitácora a la consola\n"
+             "  --no-deflate           no ofrecer permessage-deflate\n"
+             "  --deflate-window N     bits de ventana del compresor, 9-15 (defecto 11)\n"
+             "  --deflate-mem N        memLevel de zlib, 1-9 (defecto 4)\n"
+             "  --deflate-level N      nivel de compresión, 1-9 (defecto 6)\n"
+             "  --no-metrics           no servir /metrics ni llevar contadores\n"
+             "  --history N            broadcasts que se repiten al registrarse (defecto 100, 0 = nada)\n"
+             "  --history-mb N         tope de memoria del historial en MB (defecto 4)\n"
+             "  --store DIR            guardar los mensajes en DIR (segmentos + índice)\n"
+             "  --store-segment-mb N   tamaño de cada segmento en MB (defecto 64)\n"
+             "  --store-fsync-ms N     fdatasync a lo sumo cada N ms (0 = cada tanda, defecto 100)\n"
+             "  --presence-ms N        juntar los cambios de estado cada N ms (0 = uno por cambio, defecto 250)\n",
+             prog);
+ }
+ 
+ static int parse_args(int argc, char **argv) {
+     static const struct option opts[] = {
+         { "queue-max",   required_argument, NULL, 'q' },
+         { "slow-policy", required_argument, NULL, 'p' },
+         { "threads",     required_argument, NULL, 't' },
+         { "log-file",    required_argument, NULL, 'L' },
+         { "log-level",   required_argument, NULL, 'l' },
+         { "log-max-mb",  required_argument, NULL, 'M' },
+         { "log-rotate-secs", required_argument, NULL, 'R' },
+         { "quiet",       no_argument,       NULL, 'Q' },
+         { "no-deflate",  no_argument,       NULL, 'D' },
+         { "deflate-window", required_argument, NULL, 'W' },
+         { "deflate-mem", required_argument, NULL, 'E' },
+         { "deflate-level", required_argument, NULL, 'V' },
+         { "no-metrics",  no_argument,       NULL, 'N' },
+         { "history",     required_argument, NULL, 'H' },
+         { "history-mb",  required_argument, NULL, 'B' },
+         { "store",       required_argument, NULL, 'S' },
+         { "store-segment-mb", required_argument, NULL, 'G' },
+         { "store-fsync-ms", required_argument, NULL, 'F' },
+         { "presence-ms", required_argument, NULL, 'P' },
+         { "help",        no_argument,       NULL, 'h' },
+         { NULL, 0, NULL, 0 }
+     };
+     int opt;
+     while ((opt = getopt_long(argc, argv, "h", opts, NULL)) != -1) {
+         switch (opt) {
+             case 'q':
+                 cfg.queue_max = strtoul(optarg, NULL, 10);
+                 if (!cfg.queue_max) return -1;
+                 break;
+             case 'p':
+                 if (strcmp(optarg, "oldest") == 0) cfg.slow_policy = SLOW_DROP_OLDEST;
+                 else if (strcmp(optarg, "newest") == 0) cfg.slow_policy = SLOW_DROP_NEWEST;
+                 else if (strcmp(optarg, "disconnect") == 0) cfg.slow_policy = SLOW_DISCONNECT;
+                 else return -1;
+                 break;
+             case 't':
+                 cfg.threads = atoi(optarg);
+                 if (cfg.threads < 1 || cfg.threads > 64) return -1;
+                 break;
+             case 'L':
+                 cfg.log_path = optarg;
+                 break;
+             case 'l':
+                 if (strcmp(optarg, "error") == 0) cfg.log_level = LOG_LVL_ERROR;
+                 else if (strcmp(optarg, "info") == 0) cfg.log_level = LOG_LVL_INFO;
+                 else if (strcmp(optarg, "body") == 0) cfg.log_level = LOG_LVL_BODY;
+                 else return -1;
+                 break;
+             case 'M':
+                 cfg.log_max_bytes = strtoul(optarg, NULL, 10) * 1024 * 1024;
+                 break;
+             case 'R':
+                 cfg.log_rotate_secs = strtol(optarg, NULL, 10);
+                 break;
+             case 'Q':
+                 cfg.log_stdout = 0;
+                 break;
+             case 'D':
+                 cfg.deflate = 0;
+                 break;
+             case 'W':
+                 cfg.deflate_window = atoi(optarg);
+                 if (cfg.deflate_window < 9 || cfg.deflate_window > 15) return -1;
+                 break;
+             case 'E':
+                 cfg.deflate_mem = atoi(optarg);
+                 if (cfg.deflate_mem < 1 || cfg.deflate_mem > 9) return -1;
+                 break;
+             case 'V':
+                 cfg.deflate_level = atoi(optarg);
+                 if (cfg.deflate_level < 1 || cfg.deflate_level > 9) return -1;
+                 break;
+             case 'N':
+                 cfg.metrics = 0;
+                 break;
+             case 'H':
+                 cfg.history = strtoul(optarg, NULL, 10);
+                 break;
+             case 'B':
+                 cfg.history_bytes = strtoul(optarg, NULL, 10) * 1024 * 1024;
+                 break;
+             case 'S':
+                 cfg.store_dir = optarg;
+                 break;
+             case 'G':
+                 cfg.store_segment = strtoul(optarg, NULL, 10) * 1024 * 1024;
+                 if (!cfg.store_segment) return -1;
+                 break;
+             case 'F':
+                 cfg.store_fsync_ms = strtol(optarg, NULL, 10);
+                 if (cfg.store_fsync_ms < 0) return -1;
+                 break;
+             case 'P':
+                 cfg.presence_ms = strtol(optarg, NULL, 10);
+                 if (cfg.presence_ms < 0) return -1;
+                 break;
+             default:
+                 return -1;
+         }
+     }
+     if (optind < argc) cfg.port = atoi(argv[optind]);
+     return 0;
+ }
+ 
  int main(int argc, char **argv) {
      signal(SIGINT, sigint_handler);
-     int port = 8080;
-     if (argc > 1) port = atoi(argv[1]);
+     if (parse_args(argc, argv) < 0) {
+         usage(argv[0]);
+         return 1;
+     }
+     if (log_init() < 0) {
+         fprintf(stderr, "Error al iniciar la bitácora\n");
+         return 1;
+     }
+     pool_init();
      struct lws_context_creation_info info;
      memset(&info, 0, sizeof(info));
-     info.port = port;
+     info.port = cfg.port;
      info.protocols = protocols;
+     if (cfg.deflate) info.extensions = exts;
+     if (cfg.metrics) info.mounts = &metrics_mount;
      info.options = LWS_SERVER_OPTION_DO_SSL_GLOBAL_INIT;
-     struct lws_context *context = lws_create_context(&info);
+     info.count_threads = cfg.threads;
+     context = lws_create_context(&info);
      if (!context) {
          fprintf(stderr, "Error al crear el contexto\n");
          return -1;
      }
-     pthread_t monitor_thread;
-     pthread_create(&monitor_thread, NULL, inactivity_monitor, NULL);
-     printf("Servidor WebSocket iniciado en el puerto %d\n", port);
-     while (!force_exit) lws_service(context, 5);
+     // lws crea a lo sumo LWS_MAX_SMP hilos (1 si se compiló sin soporte
+     // SMP); los shards tienen que coincidir con los que de verdad hay
+     int lws_threads = lws_get_count_threads(context);
+     if (lws_threads < cfg.threads) {
+         fprintf(stderr, "Aviso: libwebsockets solo admite %d hilo(s) de servicio (LWS_MAX_SMP); "
+                 "se usan %d en vez de %d\n", lws_threads, lws_threads, cfg.threads);
+         cfg.threads = lws_threads;
+     }
+     shards = calloc(cfg.threads, sizeof(Shard));
+     if (!shards) return -1;
+     for (int i = 0; i < cfg.threads; i++) {
+         shards[i].id = i;
+         pthread_mutex_init(&shards[i].mb_lock, NULL);
+         wheel_init(&shards[i].wheel);
+         if (cfg.metrics) {
+             shards[i].metrics = aligned_alloc(64, sizeof(Metrics));
+             if (!shards[i].metrics) return -1;
+             memset(shards[i].metrics, 0, sizeof(Metrics));
+         }
+         if (cfg.history) {
+             shards[i].history.items = calloc(cfg.history, sizeof(HistEntry));
+             if (!shards[i].history.items) return -1;
+         }
+     }
+     directory_channel = channel_get(DIRECTORY_CHANNEL, 1);
+     if (!directory_channel) return -1;
+     if (cfg.store_dir) {
+         if (store_open() < 0) {
+             lws_context_destroy(context);
+             return 1;
+         }
+         store_preload_history();
+     }
+     printf("Servidor WebSocket iniciado en el puerto %d (%d hilos)\n", cfg.port, cfg.threads);
+ 
+     // El hilo principal atiende el shard 0; el resto tiene hilo propio
+     pthread_t *service = calloc(cfg.threads, sizeof(pthread_t));
+     for (int i = 1; i < cfg.threads; i++)
+         pthread_create(&service[i], NULL, service_thread, &shards[i]);
+     service_thread(&shards[0]);
+     for (int i = 1; i < cfg.threads; i++)
+         pthread_join(service[i], NULL);
+     free(service);
      lws_context_destroy(context);
+     store_shutdown();
+     log_shutdown();
      return 0;
  }
  
\ No newline at end of file